@@ -10,6 +10,11 @@ using Arya::Material;
 
 class MapInfo;
 
+namespace Arya
+{
+    class LineOfSight;
+}
+
 class Map
 {
     public:
@@ -23,11 +28,17 @@ class Map
         bool initGraphics(Scene* scene);
 
         float heightAtGroundPosition(float x, float z);
+
+        //Line of sight over the terrain on a grid of gridSize^2 cells
+        //that covers worldSize x worldSize. The caller owns it.
+        //Returns 0 when the height data is not loaded
+        Arya::LineOfSight* createLineOfSight(int gridSize, float worldSize);
         float getSize() const { return scaleVector.x; }
 
     private:
         Scene* scene;
         Arya::File* hFile;
+        Arya::LineOfSight* fogLineOfSight;
         vec3 scaleVector;
 
         bool terrainInitialized;
@@ -141,6 +141,8 @@ class Unit
 		std::vector<vec2> pathNodes;
         Unit* targetUnit;
         UnitState unitState;
+        //Clip ids of the animations per state, resolved in setObject
+        int animationIds[UNIT_DYING + 1];
         Cell* currentCell;
         bool selected;
 
@@ -337,6 +337,9 @@ void GameSessionInput::moveSelectedUnits()
     float best_distance = 100.0;
     //Faction* from_faction = 0;
 
+    // units hidden by the fog of war can not be targeted
+    vector<Unit*> enemyUnits;
+    vector<vec2> enemyPositions;
     float dist;
     for(unsigned int j = 0; j < session->getFactions().size(); ++j) {
         if(session->getFactions()[j] == lf) continue;
@@ -346,9 +349,25 @@ void GameSessionInput::moveSelectedUnits()
         {
             dist = glm::distance((*it)->getPosition(), clickPos);
             if(dist < (*it)->getInfo()->radius && dist < best_distance)
+            {
+                enemyUnits.push_back(*it);
+                enemyPositions.push_back((*it)->getPosition2());
+            }
+        }
+    }
+
+    if(!enemyUnits.empty())
+    {
+        vector<unsigned int> visibleMask((enemyUnits.size() + 31) / 32);
+        Root::shared().getScene()->getFogMap()->queryVisibility(&enemyPositions[0], enemyUnits.size(), &visibleMask[0]);
+        for(unsigned int i = 0; i < enemyUnits.size(); ++i)
+        {
+            if(!((visibleMask[i >> 5] >> (i & 31)) & 1)) continue;
+            dist = glm::distance(enemyUnits[i]->getPosition(), clickPos);
+            if(dist < best_distance)
             {
                 best_distance = dist; 
-                best_unit = (*it);
+                best_unit = enemyUnits[i];
             }
         }
     }
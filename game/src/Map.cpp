@@ -1,6 +1,7 @@
 #include "../include/Map.h"
 #include "../include/MapInfo.h"
 #include "../include/common/GameLogger.h"
+#include "LineOfSight.h"
 
 #include <boost/algorithm/string.hpp>
 
@@ -8,6 +9,7 @@ Map::Map(MapInfo* _info)
 {
     scene = 0;
     hFile = 0;
+    fogLineOfSight = 0;
     terrainInitialized = false;
 	info = _info;
 }
@@ -16,8 +18,13 @@ Map::~Map()
 {
 #ifndef SERVERONLY
     if(terrainInitialized) //unset terrain
+    {
         scene->setTerrain(0, 0, 0, vector<Arya::Material*>(), 0, 0);
+        scene->getFogMap()->setLineOfSight(0);
+    }
 #endif
+    if(fogLineOfSight) delete fogLineOfSight;
+    fogLineOfSight = 0;
     terrainInitialized = false;
 
     if(hFile) Arya::FileSystem::shared().releaseFile(hFile);
@@ -30,7 +37,8 @@ bool Map::initHeightData()
 
     string heightMapString(info->heightmap);
     heightMapString.insert(0, "textures/");
-    hFile = Arya::FileSystem::shared().getFile(heightMapString);
+    //Mapped, so large heightmaps are only read where they are used
+    hFile = Arya::FileSystem::shared().getMappedFile(heightMapString);
     if(!hFile)
     {
         GAME_LOG_WARNING("Unable to load heightmap data!");
@@ -64,11 +72,25 @@ bool Map::initGraphics(Scene* sc)
     mat4 scaleMatrix = glm::scale(mat4(1.0), scaleVector);
     scene->getTerrain()->setScaleMatrix(scaleMatrix);
 
+    //The terrain blocks the vision of units
+    Arya::FogMap* fogMap = scene->getFogMap();
+    fogLineOfSight = createLineOfSight(fogMap->getSize(), fogMap->getRepresentedSize());
+    fogMap->setLineOfSight(fogLineOfSight);
+
     terrainInitialized = true;
 #endif
     return true;
 }
 
+Arya::LineOfSight* Map::createLineOfSight(int gridSize, float worldSize)
+{
+    if(!hFile) return 0;
+    Arya::LineOfSight* los = new Arya::LineOfSight;
+    los->init((const unsigned short*)hFile->getData(), info->heightmapSize,
+            scaleVector.x, scaleVector.z, scaleVector.y, gridSize, worldSize);
+    return los;
+}
+
 float Map::heightAtGroundPosition(float x, float z)
 {
     if(!hFile)
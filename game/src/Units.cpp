@@ -8,6 +8,7 @@
 #include "../include/ServerGameSession.h"
 #include "../include/common/Cells.h"
 #include <math.h>
+#include <set>
 
 #ifdef _WIN32
 #define M_PI 3.14159265358979323846
@@ -36,6 +37,8 @@ Unit::Unit(int _type, int _id, GameSession* _session) : session(_session), id(_i
 
 	selected = false;
 	unitState = UNIT_IDLE;
+	for(int i = 0; i <= UNIT_DYING; ++i)
+		animationIds[i] = -1;
 	targetUnit = 0;
 	currentCell = 0;
 
@@ -88,9 +91,41 @@ Unit::~Unit()
 	//delete healthBar;
 }
 
+#ifndef SERVERONLY
+//Returns -1 when the model has no animation with this name.
+//A missing animation is reported once per unit type and name
+static int findAnimation(Arya::Model* model, const string& name, int type)
+{
+	if(name.empty()) return -1;
+	int id = model->getAnimationId(name);
+	if(id < 0)
+	{
+		static std::set<std::pair<int, string> > reported;
+		if(reported.insert(std::make_pair(type, name)).second)
+			GAME_LOG_WARNING("Animation not found: " << name << " (unit type " << type << ")");
+	}
+	return id;
+}
+#endif
+
 void Unit::setObject(Object* obj)
 {
 	object = obj;
+	//Units that can not move are drawn from the cached shadows
+	if(object && unitInfo) object->setStatic(unitInfo->speed <= 0.0f);
+
+#ifndef SERVERONLY
+	//Look up the animations once instead of on every state change
+	for(int i = 0; i <= UNIT_DYING; ++i)
+		animationIds[i] = -1;
+	if(!object || !unitInfo || !object->getModel()) return;
+	Arya::Model* model = object->getModel();
+	animationIds[UNIT_IDLE] = findAnimation(model, unitInfo->animationIdle, type);
+	animationIds[UNIT_RUNNING] = findAnimation(model, unitInfo->animationMove, type);
+	animationIds[UNIT_ATTACKING_OUT_OF_RANGE] = findAnimation(model, unitInfo->animationAttackOutOfRange, type);
+	animationIds[UNIT_ATTACKING] = findAnimation(model, unitInfo->animationAttack, type);
+	animationIds[UNIT_DYING] = findAnimation(model, unitInfo->animationDie, type);
+#endif
 }
 
 void Unit::setSelected(bool _sel)
@@ -480,28 +515,28 @@ void Unit::setUnitState(UnitState state)
 	{
 		case UNIT_IDLE:
 			setTintColor(vec3(0.0,0.0,0.0));
-			object->setAnimation(unitInfo->animationIdle.c_str());
+			object->setAnimation(animationIds[unitState]);
 			break;
 
 		case UNIT_RUNNING:
 			setTintColor(vec3(0.0,1.0,0.0));
-			object->setAnimation(unitInfo->animationMove.c_str());
+			object->setAnimation(animationIds[unitState]);
 			break;
 
 		case UNIT_ATTACKING_OUT_OF_RANGE:
 			setTintColor(vec3(0.0,0.0,1.0));
-			object->setAnimation(unitInfo->animationAttackOutOfRange.c_str());
+			object->setAnimation(animationIds[unitState]);
 			break;
 
 		case UNIT_ATTACKING:
 			setTintColor(vec3(1.0,0.0,0.0));
-			object->setAnimation(unitInfo->animationAttack.c_str());
+			object->setAnimation(animationIds[unitState]);
             object->setAnimationTime(unitInfo->attackSpeed);
 			break;
 
 		case UNIT_DYING:
 			setTintColor(vec3(1.0,1.0,1.0));
-			object->setAnimation(unitInfo->animationDie.c_str());
+			object->setAnimation(animationIds[unitState]);
 			break;
 	}
 #endif
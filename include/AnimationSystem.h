@@ -0,0 +1,64 @@
+//Playback state of all animated objects
+//
+//The state is stored as arrays with one entry per animated object
+//(structure of arrays) so that all animations are advanced in one
+//loop per frame, instead of a virtual call per object.
+//Objects own a slot in these arrays, the slots are kept dense:
+//when an object is removed the last slot is moved into its place.
+//Animations are addressed by the clip id of the model, see
+//Model::getAnimationId
+#pragma once
+
+#include <vector>
+
+using std::vector;
+
+namespace Arya
+{
+    class Object;
+    class Model;
+    struct AnimationClip;
+
+    class AnimationSystem
+    {
+        public:
+            AnimationSystem();
+            ~AnimationSystem();
+
+            //Returns the slot of the object
+            int add(Object* owner, const Model* model);
+            void remove(int slot);
+
+            //Starts the clip, unless it is already playing.
+            //Invalid ids are ignored
+            void play(int slot, int clipId);
+            //Changes the speed so that the current clip takes time seconds
+            void setDuration(int slot, float time);
+
+            //Advances all animations
+            void update(float elapsedTime);
+
+            //Absolute key frame of the model and the interpolation
+            //in [0,1] towards the next frame. Valid after update
+            int getFrame(int slot) const { return frame[slot]; }
+            float getInterpolation(int slot) const { return interpolation[slot]; }
+
+            unsigned int getCount() const { return owners.size(); }
+
+        private:
+            vector<Object*> owners;
+            vector<const Model*> models;
+            vector<int> clipIds;
+            vector<const AnimationClip*> clips; //0 when no clip is playing
+            vector<float> time; //in the clip
+            vector<float> speed; //0 when no clip is playing
+            vector<float> length; //of the clip
+            vector<float> inverseLength; //0 when no clip is playing
+            vector<int> clipFrame; //relative to the start of the clip
+            //Output
+            vector<int> frame;
+            vector<float> interpolation;
+
+            void resolveFrame(int slot);
+    };
+}
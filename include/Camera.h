@@ -3,10 +3,17 @@
 #include <glm/glm.hpp>
 
 using glm::vec3;
+using glm::vec4;
 using glm::mat4;
 
 namespace Arya
 {
+    //Extracts the 6 clipping planes of a view-projection matrix.
+    //The planes are normalized (xyz is the unit normal pointing
+    //into the frustum, w the distance) so that
+    //dot(plane.xyz, point) + plane.w is a distance in world units
+    void getFrustumPlanes(const mat4& vpMatrix, vec4 planes[6]);
+
     class Camera
     {
         public:
@@ -69,6 +76,7 @@ namespace Arya
 
             mat4 getVMatrix();
             mat4 getVPMatrix();
+            const mat4& getProjectionMatrix() const { return projectionMatrix; }
             mat4 getInverseVPMatrix();
 
         private:
@@ -1,5 +1,5 @@
-/* Decals is a singleton, but render function gets called by terrain (after 
- * terrain is rendered)
+/* Decals is a singleton, but queueRender gets called by the scene and
+ * the decals are drawn after the terrain
  * - To add Decals you shoulde make AND register them 
  */
 #pragma once
@@ -13,6 +13,7 @@ using glm::vec2;
 using glm::vec3;
 
 #include "common/Singleton.h"
+#include "RenderQueue.h"
 
 namespace Arya
 {
@@ -33,14 +34,16 @@ namespace Arya
 			vec3 color;
 	};
 
-	class Decals : public Singleton<Decals>
+	class Decals : public Singleton<Decals>, public RenderQueueListener
 	{
 		public:
 			Decals();
 			~Decals();
 
 			bool init();
-			void render();
+			//Adds a render item for every decal, drawn after the terrain
+			void queueRender(RenderQueue& queue);
+			void renderItem(const RenderItem& item);
 			void addDecal(Decal* d);
 			void removeDecal(Decal* d);
 			void clear();
@@ -54,6 +57,9 @@ namespace Arya
 			int indexCount;
 
 			ShaderProgram* decalProgram;
+			GLint decalColorLocation;
+			GLint scaleFactorLocation;
+			GLint offsetLocation;
 			GLuint decalVao; // do we want LODs like in terrain?
 			GLuint vertexBuffer;
 	};
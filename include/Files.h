@@ -20,10 +20,12 @@ namespace Arya
 	public:
 		char* getData(){ return data; }
 		unsigned int getSize(){ return size; }
+		bool isMapped(){ return mapped; }
 	private:
 		char* data;
 		unsigned int size;
 		int refcount;
+		bool mapped;
 		friend class FileSystem;
 	};
 
@@ -43,6 +45,13 @@ namespace Arya
 		//When the caller is done it should call unloadFile
 		File* getFile(string filename);
 
+		//Same as getFile, but the file is mapped into memory instead of read.
+		//Parts of the file are only loaded when they are accessed, and the
+		//system can drop them again. Use this for large binary files.
+		//Mapped data is read only and is NOT followed by a terminating 0.
+		//On systems without mmap the file is loaded with getFile
+		File* getMappedFile(string filename);
+
 		//Releases the file. When the reference count is zero
 		//the file is removed from memory
 		void releaseFile(File* file);
@@ -56,6 +65,8 @@ namespace Arya
 		string applicationPath;
 		void initApplicationPath();
 
+		void freeFileData(File* file);
+
 		//TODO: Have some virtual directory-tree like structure to be able to
 		//iterate through all files in a directory.
 		map<string,File*> loadedFiles;
@@ -7,20 +7,37 @@ using glm::vec2;
 #include <vector>
 using std::vector;
 
+namespace sf
+{
+	class Thread;
+}
+
 namespace Arya
 {
+	struct FogBlurBand;
+	class StreamBuffer;
+	class LineOfSight;
+
 	struct Visionary
 	{
 		Visionary(vec2* _pos, float* _radius)
 		{
 			pos = _pos;
 			radius = _radius;
+			stampX = stampY = 0;
+			stampRadius = 0;
 		}
 
 		~Visionary() { }
 
 		vec2* pos;
 		float* radius;
+
+		// The circle that is currently stamped on the fog map,
+		// in fog map cells. A radius of 0 means nothing is stamped
+		int stampX;
+		int stampY;
+		int stampRadius;
 	};
 
 	class FogMap
@@ -31,42 +48,90 @@ namespace Arya
 
 			bool init();
 			void initTexture();
-			void updateTexture();
+			// Uploads [minX, maxX) x [minY, maxY) of the blurred map
+			void updateTexture(int minX, int minY, int maxX, int maxY);
+			// Makes everything that is visible explored.
+			// The visionaries are stamped again on the next update
 			void clear();
-			void blur();
-			void colorize(vec2 position, float radius);
+			// Blurs [minX, maxX) x [minY, maxY) of fogData into fogDeltaData with a 5x5 box filter.
+			// At the edges only the pixels inside the map are averaged.
+			// Large regions are split in bands of rows that are blurred in parallel
+			void blur(int minX, int minY, int maxX, int maxY);
+			// Only the regions around visionaries that moved are stamped again,
+			// blurred and uploaded
 			void update(float elapsedTime);
 
 			// This returns whether a certain position is visible by the local player
-			bool isVisible(vec2 pos);
+			bool isVisible(vec2 pos) const;
+			// Tests a batch of positions. Bit i%32 of visibleMask[i/32] is set when
+			// positions[i] is visible, so visibleMask needs (count+31)/32 words.
+			// Positions outside the map are not visible
+			void queryVisibility(const vec2* positions, int count, unsigned int* visibleMask) const;
 			GLuint getFogMapTextureHandle() const { return fogMapTextureHandle; };
 
 			void addVisionary(Visionary* visionary);
 			void removeVisionary(Visionary* visionary);
 
+			// With a line of sight the terrain blocks vision, otherwise
+			// vision is a circle. Its grid has to match the fog map.
+			// The fog map does not take ownership, set to 0 before deleting it
+			void setLineOfSight(LineOfSight* los);
+
+			int getSize() const { return fogMapSize; }
+			float getRepresentedSize() const { return representedSize; }
+
 		private:
 			int fogMapSize; //pixelcount of one side
 
 			float fogUpdateTime;
 
-			// as it is now, 255 means visible and 67 means explored
-			// maybe later:
-			// 1st bit is for 'explored'
-			// 2nd bit is for 'visible'
+			// Visible and explored pixels, 1 bit per pixel,
+			// every row is bitplaneWords words
+			unsigned int* visibleBits;
+			unsigned int* exploredBits;
+			int bitplaneWords;
+
+			// Input of the blur, made from the bitplanes:
+			// 255 means visible, 63 explored and 0 unexplored
 			unsigned char* fogData;
+			void updateShade(int minX, int minY, int maxX, int maxY);
 
 			// not sure what to do with this yet
 			// currently use it to store the blurred texture data
 			unsigned char* fogDeltaData; // TODO: how to use this?
 
-			void precalculateBresenhemCircles();
-			unsigned char** bresenhemCircles;
+			// Sets the visible bits of the stamped circle of the visionary
+			// that are inside [minX, maxX) x [minY, maxY)
+			void stamp(const Visionary* v, int minX, int minY, int maxX, int maxY);
+			void markStampDirty(const Visionary* v);
+			int radiusToCells(float radius);
+
+			// Circles are stored as the half width of every row,
+			// from the center row outward. Made when a radius is first used
+			const vector<int>& getCircleSpans(int radius);
+			vector<vector<int> > circleSpans;
+
+			// Regions that changed since the last update, max is exclusive.
+			// Regions that overlap or are close are merged, so units in
+			// different corners of the map do not make the whole map dirty
+			struct DirtyRect
+			{
+				int minX, minY, maxX, maxY;
+			};
+			void markDirty(int minX, int minY, int maxX, int maxY);
+			void updateRegion(const DirtyRect& rect);
+			vector<DirtyRect> dirtyRects;
 
 			void positionToIndex(vec2 pos, int& centerX, int& centerY);
 			float representedSize;
 
 			vector<Visionary*> visionaries;
+			LineOfSight* lineOfSight;
+
+			vector<FogBlurBand*> blurBands;
+			vector<sf::Thread*> blurThreads; // one less than bands, the first band runs on the calling thread
 			GLuint fogMapTextureHandle;
+			StreamBuffer* uploadBuffer;
 	};
 }
 
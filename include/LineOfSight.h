@@ -0,0 +1,63 @@
+//Line of sight over the terrain, on a grid of square cells
+//
+//Every cell holds the highest terrain height inside it. Visibility
+//around a viewer is found with one radial sweep: the cells are visited
+//ring by ring, and every cell takes the horizon (the steepest slope
+//seen so far on the line to the viewer) from the one or two cells of
+//the previous ring that this line passes. A cell is visible when its
+//own slope is not below that horizon. Every cell is visited once.
+//
+//This has no graphics dependencies so the server can use it as well.
+//markVisible uses internal scratch memory, so one LineOfSight
+//should only be used by one thread at a time.
+#pragma once
+
+#include <vector>
+
+using std::vector;
+
+namespace Arya
+{
+    class LineOfSight
+    {
+        public:
+            LineOfSight();
+            ~LineOfSight();
+
+            //The grid has gridSize x gridSize cells and covers
+            //[-worldSize/2, worldSize/2] in x and z.
+            //heights are heightMapSize^2 unsigned shorts of a terrain of terrainWidth
+            //by terrainDepth around the origin, where 65535 is heightScale high.
+            //heights are only read here
+            void init(const unsigned short* heights, int heightMapSize,
+                    float terrainWidth, float terrainDepth, float heightScale,
+                    int gridSize, float worldSize);
+
+            int getGridSize() const { return gridSize; }
+            float getWorldSize() const { return worldSize; }
+
+            //Returns false when the position is outside the grid
+            bool positionToCell(float x, float z, int& cellX, int& cellY) const;
+
+            //Sets the bits of the cells within radius cells of the center that are
+            //visible from eyeHeight above the terrain, clipped to [minX, maxX) x [minY, maxY).
+            //Bit x of row y is bit x%32 of bits[y*wordsPerRow + x/32]
+            void markVisible(int centerX, int centerY, int radius, float eyeHeight,
+                    unsigned int* bits, int wordsPerRow, int minX, int minY, int maxX, int maxY);
+
+            //Whether a target targetHeight above the terrain can be seen from eyeHeight above the terrain
+            bool canSee(int fromX, int fromY, float eyeHeight, int toX, int toY, float targetHeight) const;
+
+        private:
+            int gridSize;
+            float worldSize;
+            vector<float> cellHeights; //in world units
+            vector<float> horizon; //scratch for markVisible
+
+            float getCellHeight(int x, int y) const
+            {
+                if(x < 0 || y < 0 || x >= gridSize || y >= gridSize) return 0.0f;
+                return cellHeights[y*gridSize + x];
+            }
+    };
+}
@@ -22,13 +22,23 @@ namespace Arya
 			vec4 getParameters() {
 				return vec4(specAmp, specPow, ambient, diffuse);
 			}
+
+			//Used by Model. A material holds a reference
+			//to its texture for as long as it is loaded
+			void addRef(){ refCount++; }
+			void release(){ refCount--; }
+			int getRefCount() const { return refCount; }
 		private:
 			friend class MaterialManager;
             friend class ResourceManager<Material>;
 			Material(std::string _name, Texture* _texture, std::string _type, float _specAmp, float _specPow, float _ambient, float _diffuse){
 				name=_name; texture=_texture; type=_type; specAmp=_specAmp; specPow=_specPow; ambient=_ambient; diffuse=_diffuse;
+				refCount=0;
+				if(texture) texture->addRef();
 			}
-			~Material(){}
+			~Material(){ if(texture) texture->release(); }
+
+			int refCount;
     };
 
 	class MaterialManager : public Singleton<MaterialManager>, public ResourceManager<Material> {
@@ -40,8 +50,11 @@ namespace Arya
             void cleanup();
 
 			Material* getMaterial( std::string filename ){return getResource(filename); }
+			//The material can be evicted when its refcount drops to zero
+			Material* getUnpinnedMaterial( std::string filename ){return getUnpinnedResource(filename); }
 
         private:
 			Material* loadResource(std::string filename);
+			bool isEvictable(Material* mat){ return mat->getRefCount() <= 0; }
     };
 };
@@ -1,9 +1,33 @@
 #pragma once
 
 #include <GL/glew.h>
+#include <glm/glm.hpp>
+
+#include <vector>
+
+using glm::vec2;
+using glm::vec3;
+using std::vector;
 
 namespace Arya
 {
+    //Index range of a level of detail
+    struct MeshLOD
+    {
+        GLsizei firstIndex;
+        GLsizei indexCount;
+    };
+
+    //Model space vertices and triangles of the full level of detail,
+    //decoded from the model file. Kept on the CPU for the static batches
+    struct MeshGeometry
+    {
+        vector<vec3> positions;
+        vector<vec2> texCoords;
+        vector<vec3> normals; //0 for meshes without normals
+        vector<GLuint> indices;
+    };
+
     class Mesh
     {
         public:
@@ -18,17 +42,52 @@ namespace Arya
             void release(){ refCount--; }
             int getRefCount() const { return refCount; }
 
-            void createVAOs(int frameCount);
+            void createVAO();
+            //Creates frameBuffer and frameTexture with the data
+            //of all frames, in the compressed format
+            void createFrameTexture(const void* data, int size);
 
             int frameCount; //1 for static models
-            GLuint* vaoHandles; //a list of framecount handles
+            GLuint vaoHandle;
+            //Static meshes have all vertex attributes in vertexBuffer.
+            //Animated meshes only have their texture coordinates there,
+            //the positions and normals of all frames are in frameBuffer.
+            //The shader reads them from frameTexture with gl_VertexID
+            //and the frame numbers of the instance, see staticmodel.vert
             GLuint vertexBuffer;
+            GLuint frameBuffer;
+            GLuint frameTexture; //GL_TEXTURE_BUFFER, GL_RGBA16UI
             GLsizei vertexCount; //PER FRAME
             GLuint indexBuffer;
-            GLsizei indexCount;
+            GLsizei indexCount; //of level 0
+            //All levels use the same vertices, their indices are after
+            //each other in indexBuffer. Empty for non-indexed meshes
+            vector<MeshLOD> lods;
+            //Clamped to the levels of this mesh
+            const MeshLOD& getLOD(int level) const { return lods[level < (int)lods.size() ? level : lods.size() - 1]; }
             GLenum primitiveType;
             int materialIndex; //the model has a list of materials
 
+            //Compressed meshes store positions as 16 bit values in
+            //[0,1] and normals octahedral encoded. The shader decodes
+            //them with these, see staticmodel.vert.
+            //For other meshes the offset is 0 and the scale 1
+            bool compressed;
+            vec3 positionOffset;
+            vec3 positionScale;
+
+            //Skinned meshes have bone indices and weights in
+            //attributes 3 and 4 and use the pose of the instance
+            bool skinned;
+
+            //ModelVertexFormat of the data in vertexBuffer, -1 when
+            //the layout is not one of them (converted animated meshes)
+            int vertexFormat;
+
+            //Static triangle meshes of static models, 0 for
+            //other meshes. See StaticBatcher
+            MeshGeometry* geometry;
+
         private:
             int refCount;
 
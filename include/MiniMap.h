@@ -11,6 +11,7 @@ namespace Arya
 	class Window;
 	class ShaderProgram;
 	class Texture;
+	class StreamBuffer;
 
 	class MiniMap : public InputListener
 	{
@@ -34,7 +35,9 @@ namespace Arya
 			Texture* mmTexture;
 			
 			// Camera part
-			GLuint cameraCornersVBO;
+			StreamBuffer* cameraCornersBuffer;
+			GLint cameraCornersFirst; //first vertex of the current corners
+			void setCameraCorners(const GLfloat* cameraVertices);
 			GLuint cameraCornersVAO;
 			
 			// for drawing textures
@@ -0,0 +1,152 @@
+//Layout of .aryamodel files, version 2
+//Shared by the engine loader and the tools, so it has no dependencies
+//
+//  ModelFileHeader
+//  sectionCount times ModelFileSection (the table of contents)
+//  the sections, each one starting at a multiple of MODEL_SECTION_ALIGNMENT
+//
+//Every section is an array of count elements of a fixed size,
+//so the loader checks a section with one comparison and never has
+//to scan it. On load only the header and the table of contents are
+//hashed (tocChecksum); the checksum of the whole file is only
+//verified when the modelvalidate cvar is set. Names are stored in the string section with their length
+//and a terminating 0. Vertex and index sections are in the layout
+//that is passed to glBufferData, so they can be used directly from
+//a mapped file. All values are little endian.
+//
+//Version 1 files (magic "ArMo", no version field) are still loaded,
+//see ModelManager::parseLegacyModel
+#pragma once
+
+#include <cstddef>
+
+namespace Arya
+{
+    #define MODEL_FILE_MAGIC (('A' << 0) | ('r' << 8) | ('y' << 16) | ('M' << 24))
+    #define MODEL_FILE_VERSION 2
+    #define MODEL_SECTION_ALIGNMENT 16
+
+    enum ModelSectionType
+    {
+        //chars, all names with a terminating 0
+        MODEL_SECTION_STRINGS = 1,
+        //ModelFileName per material, the texture is the name with .tga appended
+        MODEL_SECTION_MATERIALS = 2,
+        //ModelFileAnimation per animation
+        MODEL_SECTION_ANIMATIONS = 3,
+        //floats, the frame times of all animations after each other
+        MODEL_SECTION_FRAME_TIMES = 4,
+        //ModelFileSubmesh per submesh
+        MODEL_SECTION_SUBMESHES = 5,
+        //bytes, the vertex data of one submesh in its vertex format
+        MODEL_SECTION_VERTICES = 6,
+        //unsigned ints, the indices of one submesh
+        MODEL_SECTION_INDICES = 7,
+        //Bone animated models only
+        //ints, the parent of every bone or -1. Parents come before their children
+        MODEL_SECTION_BONE_PARENTS = 8,
+        //16 floats per bone, the inverse bind matrix (column major)
+        MODEL_SECTION_BONE_INVERSE_BIND = 9,
+        //7 floats per bone per frame: translation xyz and rotation
+        //quaternion xyzw of the bone relative to its parent
+        MODEL_SECTION_BONE_KEYS = 10,
+        //ModelFileLOD per simplified level of a submesh
+        MODEL_SECTION_LODS = 11
+    };
+
+    //Vertex data of a submesh
+    enum ModelVertexFormat
+    {
+        //Every frame: per vertex 3 floats position, 2 floats texcoord
+        VERTEX_FORMAT_FLOAT = 0,
+        //Every frame: per vertex 3 floats position, 2 floats texcoord, 3 floats normal
+        VERTEX_FORMAT_FLOAT_NORMALS = 1,
+        //Once: per vertex 2 floats texcoord
+        //Every frame: per vertex 3 unsigned shorts position, mapping [0,65535]
+        //to the model bounding box, and 2 signed bytes octahedral normal
+        VERTEX_FORMAT_COMPRESSED = 2,
+        //Only one frame: per vertex 3 floats position, 2 floats texcoord,
+        //3 floats normal, 4 unsigned bytes bone index, 4 unsigned bytes weight
+        //The mesh is skinned with the skeleton of the model
+        VERTEX_FORMAT_SKINNED = 3
+    };
+
+    struct ModelFileHeader
+    {
+        unsigned int magic; //MODEL_FILE_MAGIC
+        unsigned int version; //MODEL_FILE_VERSION
+        unsigned int headerSize; //sizeof(ModelFileHeader), later versions may add fields
+        unsigned int fileSize;
+        unsigned int checksum; //of the whole file, see modelFileChecksum
+        int modelType; //1 static, 2 vertex animated, 3 bone animated
+        int frameCount; //1 for static models
+        int sectionCount;
+        float boundsMin[3]; //model space bounding box of all frames
+        float boundsMax[3];
+        //modelFileChecksum of the header and the table of contents
+        unsigned int tocChecksum;
+    };
+
+    struct ModelFileSection
+    {
+        unsigned int type; //ModelSectionType, unknown types are skipped
+        unsigned int offset; //from the start of the file
+        unsigned int size; //in bytes, count times the element size
+        unsigned int count;
+    };
+
+    struct ModelFileName
+    {
+        unsigned int offset; //in the string section
+        unsigned int length; //without the terminating 0
+    };
+
+    struct ModelFileAnimation
+    {
+        ModelFileName name;
+        int startFrame; //inclusive
+        int endFrame; //inclusive
+        int firstFrameTime; //index in the frame time section, endFrame - startFrame + 1 entries
+    };
+
+    struct ModelFileSubmesh
+    {
+        int materialIndex;
+        int primitiveType; //GL primitive
+        int vertexCount; //per frame
+        int vertexFormat; //ModelVertexFormat
+        int indexCount; //0 for non-indexed submeshes
+        int vertexSection; //index in the table of contents
+        int indexSection; //-1 for non-indexed submeshes
+        int padding;
+    };
+
+    //A simplified version of a submesh. It uses the vertices of the
+    //submesh, only the indices are different. The levels of a submesh
+    //are listed from fine to coarse, the submesh itself is level 0
+    struct ModelFileLOD
+    {
+        int submesh;
+        int indexSection; //index in the table of contents
+        float error; //largest distance to the full mesh, in model units
+        int padding;
+    };
+
+    //FNV-1a over the first size bytes of the file as 32 bit words,
+    //with both checksum fields taken as 0. size has to be a multiple
+    //of 4 and include the header
+    inline unsigned int modelFileChecksum(const void* data, unsigned int size)
+    {
+        const unsigned int* words = static_cast<const unsigned int*>(data);
+        const unsigned int wordCount = size / 4;
+        const unsigned int checksumWord = offsetof(ModelFileHeader, checksum) / 4;
+        const unsigned int tocChecksumWord = offsetof(ModelFileHeader, tocChecksum) / 4;
+        unsigned int hash = 2166136261u;
+        for(unsigned int i = 0; i < wordCount; ++i)
+        {
+            hash ^= (i == checksumWord || i == tocChecksumWord ? 0 : words[i]);
+            hash *= 16777619u;
+        }
+        return hash;
+    }
+}
@@ -10,6 +10,8 @@ using std::vector;
 
 #include <glm/glm.hpp>
 using glm::vec3;
+using glm::vec4;
+using glm::mat4;
 
 namespace Arya
 {
@@ -24,26 +26,16 @@ namespace Arya
         BoneAnimated = 3
     };
 
-    //Base class for an animation state, stored in each object
-    //Only contains the state, not the full animation data
-    //Subclasses (in the cpp file) can be bone positions or keyframes
-    //The actual keyframe data (like timings) are in the Model
-    class AnimationState
+    //A named animation: a range of key frames that is looped.
+    //Objects refer to clips by their id, see Model::getAnimationId.
+    //The playback state of all objects is in the AnimationSystem
+    struct AnimationClip
     {
-        public:
-            AnimationState(){}
-            virtual ~AnimationState(){}
-
-            virtual void setAnimation(std::string name) = 0;
-            virtual void updateAnimation(float elapsedTime) = 0;
-
-            virtual int getCurFrame() = 0;
-            virtual float getInterpolation() = 0;
-
-            //For currently set animation:
-            virtual float getAnimationTime() = 0;
-            //Change speed of current animation
-            virtual void setAnimationTime(float newTime) = 0;
+        int startFrame; //inclusive
+        int endFrame; //inclusive
+        vector<float> frameTimes; //size = end - start + 1
+        vector<float> frameStarts; //time in the clip where every frame starts
+        float length; //sum of the frame times
     };
 
     //Base class for animation data
@@ -55,6 +47,9 @@ namespace Arya
             virtual ~AnimationData(){}
     };
 
+    //Vertex data of a mesh in the model file, see ModelManager
+    struct SubmeshSource;
+
     class Model
     {
         public:
@@ -64,13 +59,34 @@ namespace Arya
             const vector<Material*>& getMaterials() const { return materials; }
 
             const AnimationData* getAnimationData() const { return animationData; }
-
-            //Called by Object
-            AnimationState* createAnimationState();
+            //Bone animated models, 0 for other models
+            int getBoneCount() const;
+            //Writes the skinning matrices of the pose between two key frames
+            //to palette: for every bone the 3 rows of the top 3x4 part
+            void evaluatePose(int frame, int nextFrame, float interpolation, vec4* palette) const;
+
+            //Levels of detail: level 0 is the full model, every next level
+            //has fewer triangles and a larger error (in model units).
+            //Meshes with fewer levels use their last one, see Mesh::getLOD
+            int getLODCount() const { return lodErrors.size(); }
+            float getLODError(int level) const { return lodErrors[level]; }
+
+            //The frame that is interpolated to from the given frame
+            int getNextFrame(int frame) const { return (frame >= 0 && frame < (int)nextFrames.size()) ? nextFrames[frame] : frame; }
+
+            //Animation clips. Ids are in [0, getAnimationCount()),
+            //getAnimationId returns -1 when the name is not found
+            int getAnimationCount() const;
+            int getAnimationId(const std::string& name) const;
+            const AnimationClip* getAnimation(int id) const;
             void addRef(){ refCount++; }
             void release(){ refCount--; }
+            int getRefCount() const { return refCount; }
 
 			vec3 getBoundingBoxVertex(int vertexNumber);
+            //Model space center and half size of the bounding box
+            vec3 getBoundingBoxCenter() const { return 0.5f*vec3(minX + maxX, minY + maxY, minZ + maxZ); }
+            vec3 getBoundingBoxExtent() const { return 0.5f*vec3(maxX - minX, maxY - minY, maxZ - minZ); }
         protected:
             //Private constructor because only
             //ModelManager is allowed to create these
@@ -89,6 +105,8 @@ namespace Arya
             vector<Material*> materials;
 
             AnimationData* animationData;
+            vector<int> nextFrames; //see getNextFrame
+            vector<float> lodErrors; //see getLODCount
 
 			float minX; // Values needed to define
 			float maxX; // bounding box for model.
@@ -98,9 +116,8 @@ namespace Arya
 			float maxZ;
 
             int refCount;
-            //TODO: keep a list of objects that
-            //use this model. This way we can
-            //use OpenGL instancing
+            //Objects using the same model are drawn
+            //with OpenGL instancing, see Scene::render
     };
 
     class ModelManager : public Singleton<ModelManager>, public ResourceManager<Model> {
@@ -111,8 +128,26 @@ namespace Arya
             bool initialize();
             void cleanup();
 
-            Model* getModel(std::string filename){ return getResource(filename); }
+            //The model can be evicted as soon as no Object uses it anymore
+            Model* getModel(std::string filename){ return getUnpinnedResource(filename); }
+
+            //Also verify the checksum of the whole file on load,
+            //see the modelvalidate cvar
+            void setValidateFiles(bool validate){ validateFiles = validate; }
         private:
+            bool validateFiles;
+
             Model* loadResource(std::string filename );
+
+            //The parsers fill in everything except the meshes, those are
+            //returned as submeshes that point into the file data.
+            //See ModelFormat.h for the current format
+            bool parseModel(const std::string& filename, const char* data, unsigned int size,
+                    Model* model, vector<SubmeshSource>& submeshes);
+            bool parseLegacyModel(const std::string& filename, const char* data, unsigned int size,
+                    Model* model, vector<SubmeshSource>& submeshes);
+            //Uploads the submeshes, returns the GPU memory that is used
+            unsigned int createMeshes(Model* model, const vector<SubmeshSource>& submeshes);
+            bool isEvictable(Model* model){ return model->getRefCount() <= 0; }
     };
 }
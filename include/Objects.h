@@ -3,6 +3,7 @@
 #include <GL/glew.h>
 #include <vector>
 #include <glm/glm.hpp>
+#include "TransformSystem.h"
 
 using glm::vec2;
 using glm::vec3;
@@ -13,32 +14,48 @@ using std::vector;
 namespace Arya
 {
     class Model;
-    class AnimationState;
+    class AnimationSystem;
+    class StaticBatcher;
 
     class Object
     {
         public:
-            void setPosition(vec3 pos){ position = pos; updateMatrix = true; }
-            const vec3& getPosition() const { return position; }
-            vec2 getPosition2() const { return vec2(position.x, position.z); }
+            //The transform is stored in the TransformSystem of the scene,
+            //which computes the move matrices of all moved objects at once.
+            //Static objects also tell the StaticBatcher that they moved
+            void setPosition(vec3 pos){ transforms->setPosition(transformSlot, pos); if(staticObject) batchChanged(); }
+            const vec3& getPosition() const { return transforms->getPosition(transformSlot); }
+            vec2 getPosition2() const { const vec3& p = getPosition(); return vec2(p.x, p.z); }
 
-            void setYaw(float y){ yaw = y; updateMatrix = true; }
-            float getYaw() const { return yaw; }
+            void setYaw(float y){ transforms->setYaw(transformSlot, y); if(staticObject) batchChanged(); }
+            float getYaw() const { return transforms->getYaw(transformSlot); }
 
-            const mat4& getMoveMatrix();
+            const mat4& getMoveMatrix(){ return transforms->getMatrix(transformSlot); }
 
             vec3 getTintColor() const { return tintColor; }
             void setTintColor(vec3 tColor) { tintColor = tColor; }
 
-            //setModel also recreates a new AnimationState object
+            //setModel also resets the animation
             void setModel(Model* model);
             Model* getModel() const { return model; }
 
+            //Looks up the clip id, prefer the version with the id
             void setAnimation(const char* name);
+            //Clip id of the model, see Model::getAnimationId
+            void setAnimation(int clipId);
             void setAnimationTime(float time); //for the currently set animation
 
-            AnimationState* getAnimationState() const { return animState; }
-            void updateAnimation(float elapsedTime);
+            //The animation is advanced by the AnimationSystem of the scene
+            int getAnimationFrame() const;
+            float getAnimationInterpolation() const;
+
+            //Level of detail of the model, chosen by the Scene
+            int getLODLevel() const { return lodLevel; }
+
+            //Static objects do not move, their shadows are cached.
+            //They can still be moved, but that redraws the cache
+            void setStatic(bool s){ if(s == staticObject) return; staticObject = s; batchChanged(); }
+            bool isStatic() const { return staticObject; }
 
             //Scene will delete the object on next frame update
             void setObsolete() { obsolete = true; }
@@ -47,19 +64,28 @@ namespace Arya
         private:
             //Only Scene can make Objects
             friend class Scene;
-            Object();
+            friend class AnimationSystem;
+            friend class StaticBatcher;
+            friend class TransformSystem;
+            Object(AnimationSystem* animations, TransformSystem* transforms, StaticBatcher* batcher);
             ~Object();
 
+            //See StaticBatcher::objectChanged
+            void batchChanged();
+
             Model* model;
-            AnimationState* animState;
+            AnimationSystem* animations;
+            int animationSlot; //-1 when the model has no animations
+            int lodLevel; //chosen by the Scene, see Scene::selectLODs
+            StaticBatcher* batcher;
+            int batchSlot; //-1 when the object is not merged into the static batches
+            bool batchPending; //in the changed objects of the batcher
 
-            vec3 position;
-            float pitch;
-            float yaw;
+            TransformSystem* transforms;
+            int transformSlot;
 
-            mat4 mMatrix; //cached
-            bool updateMatrix;
             bool obsolete;
+            bool staticObject;
 
             vec3 tintColor;
     };
@@ -0,0 +1,137 @@
+//Render queue and GL state cache
+//
+//GLStateCache remembers the currently bound program, textures,
+//vertex array and a few enable flags so that redundant GL calls
+//are dropped. All rendering code should bind through it.
+//Code that calls GL directly must call invalidate() afterwards.
+//It counts the state changes that were issued and skipped.
+//
+//RenderQueue collects RenderItems for one frame (or one pass).
+//Every item has a 64 bit sort key built with makeSortKey:
+//      pass | program | texture | vertex array | depth
+//so after sorting, items that share state are drawn after each other.
+//GL handles are not put in the key directly: the queue gives them
+//small ids in the order they are first seen since the last clear,
+//so two handles only share key bits after 4096 programs or 65536
+//textures or vertex arrays in one queue.
+//On submit the queue binds the program, texture and vertex array
+//of the item and then calls the owner to set uniforms and draw.
+#pragma once
+
+#include <vector>
+#include <map>
+#include <GL/glew.h>
+#include "common/Singleton.h"
+
+using std::vector;
+using std::map;
+
+namespace Arya
+{
+    typedef unsigned long long SortKey;
+
+    //Passes are drawn in this order
+    enum RenderPass
+    {
+        PASS_SHADOW = 0,
+        PASS_TERRAIN,
+        PASS_DECALS,
+        PASS_OBJECTS
+    };
+
+    struct RenderItem;
+
+    class RenderQueueListener
+    {
+        public:
+            virtual ~RenderQueueListener(){}
+            //Set uniforms and issue the draw call.
+            //The program, texture and vertex array of the item are bound
+            virtual void renderItem(const RenderItem& item) = 0;
+    };
+
+    struct RenderItem
+    {
+        SortKey sortKey;
+        RenderQueueListener* owner;
+        GLuint program;
+        GLuint vertexArray;
+        GLuint texture;
+        int textureUnit;
+        int index; //for use by the owner
+
+        bool operator<(const RenderItem& other) const { return sortKey < other.sortKey; }
+    };
+
+    class GLStateCache : public Singleton<GLStateCache>
+    {
+        public:
+            GLStateCache();
+            ~GLStateCache();
+
+            static const int MAX_TEXTURE_UNITS = 16;
+
+            void useProgram(GLuint program);
+            //Also sets the active texture unit.
+            //Every unit is assumed to be used with one target only
+            void bindTexture(int unit, GLuint texture, GLenum target = GL_TEXTURE_2D);
+            void bindVertexArray(GLuint vertexArray);
+
+            void setBlend(bool enable);
+            void setDepthTest(bool enable);
+            void setCullFace(bool enable);
+
+            //Forget all cached state. Must be called after
+            //GL state was changed without using the cache
+            void invalidate();
+
+            unsigned int getIssuedCount() const { return issuedCount; }
+            unsigned int getSkippedCount() const { return skippedCount; }
+            void resetCounters(){ issuedCount = skippedCount = 0; }
+
+        private:
+            GLuint currentProgram;
+            GLuint currentVertexArray;
+            GLuint currentTextures[MAX_TEXTURE_UNITS];
+            int activeTextureUnit;
+
+            //-1 unknown, 0 disabled, 1 enabled
+            int blendState;
+            int depthTestState;
+            int cullFaceState;
+
+            unsigned int issuedCount;
+            unsigned int skippedCount;
+
+            void setCapability(GLenum cap, int& state, bool enable);
+    };
+
+    class RenderQueue
+    {
+        public:
+            RenderQueue(){}
+            ~RenderQueue(){}
+
+            //Depth is in [0,1] and only used to order
+            //items that share all other state
+            SortKey makeSortKey(RenderPass pass, GLuint program, GLuint texture, GLuint vertexArray, float depth);
+
+            void addItem(const RenderItem& item){ items.push_back(item); }
+            //Also forgets the ids of the handles
+            void clear();
+            unsigned int getItemCount() const { return items.size(); }
+
+            //Sorts and renders all items. The queue is not cleared
+            void submit();
+
+        private:
+            vector<RenderItem> items;
+
+            //Handle to id, see makeSortKey
+            typedef map<GLuint, unsigned int> HandleIds;
+            static unsigned int getHandleId(HandleIds& ids, GLuint handle);
+            HandleIds programIds;
+            HandleIds textureIds;
+            HandleIds vertexArrayIds;
+    };
+}
@@ -1,10 +1,21 @@
 //Base class for TextureManager, MeshManager, SoundManager and so on
 //This class supplies public functions:
 //      getResource - returns resource if loaded, or calls loadResource if not
+//                    The resource is marked persistent: it is never evicted
+//      getUnpinnedResource - same as getResource, but the resource may be evicted
+//                    as soon as the subclass reports that it is no longer in use
 //      unloadAll - deletes all resources
 //      resourceLoaded - check if a resource is loaded
 //The sub class must implement only 'loadResource'
 //      This implementation must call addResource() to add it to the resource list
+//
+//Residency:
+//      Every resource has a memory size (given to addResource) and a
+//      last-used stamp. When a memory budget is set, enforceBudget() unloads
+//      resources that are not in use, least recently used first, until
+//      the memory usage is within the budget again.
+//      A sub class decides what 'in use' means by implementing isEvictable.
+//      By default nothing is ever evicted.
 
 #pragma once
 #include "common/Logger.h"
@@ -18,46 +29,135 @@ namespace Arya
 {
     template <typename T> class ResourceManager {
         public:
-            ResourceManager(){ defaultResource = 0; };
+            ResourceManager(){ defaultResource = 0; memoryBudget = 0; memoryUsage = 0; useCounter = 0; evictionCount = 0; };
             virtual ~ResourceManager(){ unloadAll(); }
 
             //Will load the resource if not already loaded
+            //The resource will stay loaded until unloadAll is called
             T* getResource( std::string filename )
             {
-                ResourceContainer::iterator iter = resources.find(filename);
-                if( iter != resources.end() )
-                    return (T*)(iter->second);
-                T* ret = loadResource(filename);
-                if(ret) return ret;
-                return defaultResource;
+                return getResource(filename, true);
+            }
+
+            //Will load the resource if not already loaded
+            //The resource can be evicted when it is not in use anymore
+            T* getUnpinnedResource( std::string filename )
+            {
+                return getResource(filename, false);
             }
 
             void unloadAll()
             {
-                for( ResourceContainer::iterator iter = resources.begin(); iter != resources.end(); ++iter ){
-                    T* resource = (T*)iter->second;
+                for( typename ResourceContainer::iterator iter = resources.begin(); iter != resources.end(); ++iter ){
+                    T* resource = iter->second.resource;
                     delete resource; //This will call the deconstructor
                 }
                 resources.clear();
+                memoryUsage = 0;
             }
 
             bool resourceLoaded( std::string name ){
-                ResourceContainer::iterator iter = resources.find(name);
+                typename ResourceContainer::iterator iter = resources.find(name);
                 return (iter != resources.end());
             }
 
+            //Budget in bytes. Zero means no budget
+            void setMemoryBudget(unsigned int bytes){ memoryBudget = bytes; }
+            unsigned int getMemoryBudget() const { return memoryBudget; }
+            unsigned int getMemoryUsage() const { return memoryUsage; }
+            unsigned int getResourceCount() const { return resources.size(); }
+            unsigned int getEvictionCount() const { return evictionCount; }
+            bool isOverBudget() const { return memoryBudget && memoryUsage > memoryBudget; }
+
+            //Unloads resources that are not in use, least recently
+            //used first, until the memory usage is within the budget
+            void enforceBudget()
+            {
+                while( isOverBudget() )
+                {
+                    typename ResourceContainer::iterator victim = resources.end();
+                    for( typename ResourceContainer::iterator iter = resources.begin(); iter != resources.end(); ++iter ){
+                        if( iter->second.persistent || !isEvictable(iter->second.resource) ) continue;
+                        if( victim == resources.end() || iter->second.lastUsed < victim->second.lastUsed )
+                            victim = iter;
+                    }
+                    if( victim == resources.end() ) return; //everything is in use
+                    evict(victim);
+                }
+            }
+
+            //Unloads all resources that are not in use, regardless of the budget
+            void unloadUnused()
+            {
+                for( typename ResourceContainer::iterator iter = resources.begin(); iter != resources.end(); ){
+                    //evict invalidates the iterator so we must increase it first
+                    typename ResourceContainer::iterator evict_iter = iter++;
+                    if( !evict_iter->second.persistent && isEvictable(evict_iter->second.resource) )
+                        evict(evict_iter);
+                }
+            }
+
         private:
-            typedef std::multimap<string,void*> ResourceContainer;
+            struct ResourceInfo
+            {
+                T* resource;
+                unsigned int memorySize; //in bytes
+                unsigned int lastUsed; //value of useCounter at the last request
+                bool persistent;
+            };
+            typedef std::multimap<string,ResourceInfo> ResourceContainer;
             ResourceContainer resources;
 
+            unsigned int memoryBudget;
+            unsigned int memoryUsage;
+            unsigned int useCounter;
+            unsigned int evictionCount;
+
+            T* getResource( std::string filename, bool persistent )
+            {
+                typename ResourceContainer::iterator iter = resources.find(filename);
+                if( iter != resources.end() ){
+                    iter->second.lastUsed = ++useCounter;
+                    if( persistent ) iter->second.persistent = true;
+                    return iter->second.resource;
+                }
+                T* ret = loadResource(filename);
+                if(ret){
+                    iter = resources.find(filename);
+                    if( persistent && iter != resources.end() ) iter->second.persistent = true;
+                    return ret;
+                }
+                return defaultResource;
+            }
+
+            void evict( typename ResourceContainer::iterator iter )
+            {
+                LOG_DEBUG("Evicting resource " << iter->first << " (" << iter->second.memorySize << " bytes)");
+                memoryUsage -= iter->second.memorySize;
+                ++evictionCount;
+                T* resource = iter->second.resource;
+                resources.erase(iter);
+                delete resource;
+            }
+
         protected:
             //Must be implemented by subclass and use addResource to add the resource
             virtual T* loadResource( std::string filename )=0;
 
+            //Must return true when nothing references the resource anymore
+            virtual bool isEvictable( T* resource ){ return false; }
+
             T* defaultResource;
 
-            void addResource( std::string name, T* res ){
-                resources.insert( ResourceContainer::value_type( name, res ) );
+            //Persistent resources are never evicted
+            void addResource( std::string name, T* res, unsigned int memorySize = 0, bool persistent = false ){
+                ResourceInfo info;
+                info.resource = res;
+                info.memorySize = memorySize;
+                info.lastUsed = ++useCounter;
+                info.persistent = persistent;
+                resources.insert( typename ResourceContainer::value_type( name, info ) );
+                memoryUsage += memorySize;
             }
     };
 }
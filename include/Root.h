@@ -51,9 +51,17 @@ namespace Arya
 
             //Usage: checkForErrors("root initialization")
             bool checkForErrors(const char* stateInfo = 0);
+
+            bool handleCommand(string command);
         private:
             bool initGLFW();
             bool initGLEW();
+
+            //Resource residency: budgets come from the
+            //texturebudget and modelbudget cvars (in MB)
+            void applyResourceBudgets();
+            void trimResources();
+            void logResidency();
             Scene* scene;
             Interface* interface;
 			SettingsManager* settingsManager;
@@ -67,6 +75,10 @@ namespace Arya
 
             double oldTime;
 
+            //GL state cache counts of the last frame
+            unsigned int stateChangesIssued;
+            unsigned int stateChangesSkipped;
+
             //IMPORTANT: These have to be lists
             //instead of vectors because we need the
             //possibility to add and erase elements
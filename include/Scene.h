@@ -7,6 +7,9 @@
 
 #include "Materials.h"
 #include "Root.h"
+#include "RenderQueue.h"
+#include "AnimationSystem.h"
+#include "TransformSystem.h"
 
 using std::string;
 using std::vector;
@@ -21,10 +24,14 @@ namespace Arya
     class Camera;
     class Shader;
     class ShaderProgram;
+    class UniformBuffer;
 	class FogMap;
 	class MiniMap;
+    class StaticBatcher;
 
-    class Scene : public FrameListener
+    class Mesh;
+
+    class Scene : public FrameListener, public RenderQueueListener
     {
         public:
             Scene();
@@ -36,6 +43,7 @@ namespace Arya
             void render();
 
             void onFrame(float elapsedTime);
+            void renderItem(const RenderItem& item);
 
             bool setTerrain(char* heightData, int terrainSize, const char* waterMap, const vector<Material*>& tileSet, Texture* cloudMap, Texture* splatMap);
             Terrain* getTerrain() const { return currentTerrain; };
@@ -46,21 +54,43 @@ namespace Arya
 
             Object* createObject();
 
-            mat4 getLightOrthoMatrix() const { return lightOrthoMatrix; }
+            //Light view projection of a shadow cascade
+            const mat4& getShadowCascadeMatrix(int cascade) const { return cascades[cascade].lightMatrix; }
+            //GL_TEXTURE_2D_ARRAY with one layer per cascade
             GLuint getShadowDepthTextureHandle() const { return shadowDepthTextureHandle; }
 
+            //Objects get the coarsest level of detail of their model
+            //with a simplification error below this number of pixels
+            void setModelPixelError(float pixels) { modelPixelError = pixels; }
+            float getModelPixelError() const { return modelPixelError; }
+
         private:
             bool initialized;
 			
-            //TODO: think about whether we
-            //want to make this into a linked list
-            //since we will be removing objects
-            //a lot (units dying)
-            //Not a std::list though because this adds
-            //overhead. We can do the trick where
-            //we subclass Object in a clever way
-            //so no extra space is needed.
+            // Objects
+            // Objects are constructed in blocks that never move, so an
+            // Object pointer stays valid until the object is deleted.
+            // Deleted objects go to a free list and their memory is reused.
+            // The list of live objects has no fixed order: obsolete objects
+            // are removed by moving the last object into their place. Before
+            // culling it is grouped by model again, so the culling results
+            // are already grouped for instancing.
+            enum
+            {
+                OBJECT_BLOCK_SIZE = 256
+            };
+            Object* allocateObject();
+            void freeObject(Object* obj);
+            void groupObjectsByModel();
             vector<Object*> objects;
+            vector<char*> objectBlocks;
+            vector<Object*> freeObjects;
+
+            //Animation state of all objects
+            AnimationSystem animationSystem;
+            //Positions and move matrices of all objects,
+            //the matrices are computed once per frame in render
+            TransformSystem transformSystem;
 
             //lightDirection points TO the light
             //it should always be normalized
@@ -73,15 +103,156 @@ namespace Arya
             bool initShaders();
 
             // Shadows
+            // The camera frustum is split into cascades, every cascade
+            // has its own layer in the shadow map. The light box of a
+            // cascade is fitted with some margin around its split and is
+            // kept until the split no longer fits or the light moves.
+            // Static objects are drawn into a separate cached layer that
+            // is only redrawn when the box or the static casters change.
+            // Every frame the cached layer is copied and only the other
+            // objects are drawn on top of it.
+            // SHADOW_CASCADES must match the shaders
+            enum
+            {
+                SHADOW_CASCADES = 3,
+                SHADOW_MAP_SIZE = 2048
+            };
+            struct ShadowCascade
+            {
+                mat4 lightMatrix; //light view projection
+                vec3 center; //center of the box in light view space
+                float halfSize; //0 when the box has not been fitted
+                float splitFar; //view space distance where the cascade ends
+                unsigned int staticSignature; //of the static casters in the cached layer
+                bool staticValid;
+            };
             bool initShadowSupport();
-            GLuint shadowFBOHandle;
+            void updateShadowCascades();
+            void renderShadowCascades();
+            //Draws the objects into the bound shadow layer, and the
+            //static batches when the light matrix is given
+            void renderShadowCasters(const vector<Object*>& casters, const mat4* batchLightMatrix);
+            GLuint shadowFBOHandles[SHADOW_CASCADES];
+            GLuint staticShadowFBOHandles[SHADOW_CASCADES];
             GLuint shadowDepthTextureHandle;
-            mat4 orthoShadowCubeMatrix;
+            GLuint staticShadowTextureHandle;
+            ShadowCascade cascades[SHADOW_CASCADES];
             mat4 rotateToLightDirMatrix;
-            mat4 lightOrthoMatrix;
+            vec3 cascadeLightDirection; //the light direction the boxes were fitted for
+            vector<Object*> shadowCasters;
+            vector<Object*> staticCasters;
+            vector<Object*> dynamicCasters;
 
             ShaderProgram* basicProgram;
+            GLint parametersLocation;
+            GLint positionOffsetLocation;
+            GLint positionScaleLocation;
+            GLint octNormalsLocation;
+            GLint animatedLocation;
+            GLint vertexCountLocation;
+            GLint skinnedLocation;
+            GLint batchedLocation;
+
+            // Constants shared by all shaders, see the
+            // SceneConstants block in the shaders.
+            // There is one copy for every pass
+            struct SceneConstants
+            {
+                mat4 vpMatrix;
+                mat4 viewMatrix;
+                mat4 lightMatrix[SHADOW_CASCADES];
+                vec4 lightDirection;
+                vec4 cascadeSplits; //splitFar of every cascade
+            };
+            enum
+            {
+                CONSTANTS_CAMERA = 0,
+                CONSTANTS_SHADOW, //one for every cascade
+                CONSTANTS_COUNT = CONSTANTS_SHADOW + SHADOW_CASCADES
+            };
+            bool initSceneConstants();
+            void updateSceneConstants();
+            UniformBuffer* sceneConstants;
 			FogMap* fm;
 			MiniMap* minimap;
+
+            // Instancing
+            // Objects that share a model are drawn with a single
+            // instanced call per mesh, the animation frames are
+            // part of the instance data. For bone animated models
+            // the frame is replaced by the start of its pose in the palette.
+            // The per-object data is streamed into instanceBuffer
+            // every pass, matching the attributes in staticmodel.vert
+            struct InstanceData
+            {
+                mat4 mMatrix;
+                vec4 tintAndInterpolation; //xyz tint, w interpolation
+                int frame;
+                int nextFrame;
+                int padding[2];
+            };
+            struct InstanceBatch
+            {
+                Model* model;
+                int lodLevel;
+                int firstInstance;
+                int instanceCount;
+            };
+            //One instanced draw of a single mesh
+            struct InstanceDraw
+            {
+                Mesh* mesh;
+                Material* material;
+                int lodLevel;
+                int firstInstance;
+                int instanceCount;
+            };
+            bool initInstancing();
+            //Groups the objects and uploads the instance data
+            void buildInstanceBatches(const vector<Object*>& visibleObjects);
+            //Adds a render item for every mesh of every batch
+            void queueInstanceBatches(RenderPass pass);
+            GLuint instanceBuffer;
+            //Skinning matrices of all bone animated instances of a pass,
+            //3 rows per bone, in a buffer texture. See Model::evaluatePose
+            GLuint paletteBuffer;
+            GLuint paletteTexture;
+            vector<vec4> paletteData;
+            vector<InstanceData> instanceData;
+            vector<InstanceBatch> instanceBatches;
+            vector<InstanceDraw> instanceDraws;
+
+            RenderQueue renderQueue;
+
+            //Static objects are merged into world space batches
+            //and skipped by the per object culling and instancing
+            StaticBatcher* staticBatcher;
+
+            // Culling
+            // Once per frame the object bounds are gathered into
+            // contiguous arrays (one per component) and tested against
+            // the planes of the camera frustum and of every
+            // shadow cascade.
+            void cullObjects();
+            void cullAgainstFrustum(const mat4& vpMatrix, vector<Object*>& visibleList);
+            vector<Object*> cullCandidates;
+            //Fog of war is tested for all objects in one batch
+            vector<Object*> fogCandidates;
+            vector<vec2> fogPositions;
+            vector<unsigned int> fogVisibleMask;
+            vector<float> boundsX, boundsY, boundsZ; //world space center
+            vector<float> extentX, extentY, extentZ; //world space AABB half size
+            vector<float> boundsRadius; //bounding sphere
+            vector<unsigned char> cullResult;
+            vector<Object*> visibleForCamera;
+
+            // Level of detail
+            // Chosen once per frame for all culling candidates, so the
+            // shadow passes use the same level as the camera. An object
+            // moves to a coarser level only when the error of that level
+            // is clearly below the limit, so it does not switch back and
+            // forth when the camera stays around one distance.
+            void selectLODs();
+            float modelPixelError;
     };
 }
@@ -38,6 +38,14 @@ namespace Arya
         GEOMETRY
     };
 
+    //Binding points of the shared uniform blocks.
+    //ShaderProgram::link connects a block to its binding
+    //point when the program uses a block with that name
+    enum UniformBlockBinding
+    {
+        SCENE_CONSTANTS_BINDING = 0 //"SceneConstants"
+    };
+
     class Shader
     {
         public:
@@ -81,7 +89,11 @@ namespace Arya
             GLuint getHandle() { return handle; };
 			bool isValid() const { return valid; }
 
-            GLuint getUniformLocation(const char* name);
+            //The locations of all active uniforms are resolved once
+            //when the program is linked. Returns -1 for unknown names.
+            //Code that sets a uniform often should store the location
+            //and use the setUniform versions that take a location
+            GLint getUniformLocation(const char* name);
             void setUniform1i(const char* name, int val);
             void setUniform1f(const char* name, float val);
             void setUniform2fv(const char* name, vec2 values);
@@ -89,8 +101,18 @@ namespace Arya
             void setUniform4fv(const char* name, vec4 values);
             void setUniformMatrix4fv(const char* name, mat4 matrix);
 
+            void setUniform1i(GLint location, int val);
+            void setUniform1f(GLint location, float val);
+            void setUniform2fv(GLint location, const vec2& values);
+            void setUniform3fv(GLint location, const vec3& values);
+            void setUniform4fv(GLint location, const vec4& values);
+            void setUniformMatrix4fv(GLint location, const mat4& matrix);
+
         private:
             bool init();
+            void resolveUniforms();
+
+            map<string, GLint> uniformLocations;
 
             GLuint handle;
             bool linked;
@@ -99,4 +121,28 @@ namespace Arya
 
             vector<Shader*> shaders;
     };
+
+    //A buffer with a number of copies of one uniform block,
+    //for example one per render pass. The data is kept in
+    //memory and uploaded in one call, after that every copy
+    //can be bound to a binding point
+    class UniformBuffer
+    {
+        public:
+            UniformBuffer();
+            ~UniformBuffer();
+
+            bool init(unsigned int blockSize, unsigned int blockCount);
+
+            void setBlock(unsigned int index, const void* blockData);
+            void upload();
+            void bindBlock(unsigned int index, GLuint bindingPoint);
+
+        private:
+            GLuint handle;
+            unsigned int blockSize;
+            unsigned int blockStride; //blockSize rounded up to the offset alignment
+            unsigned int blockCount;
+            vector<char> data;
+    };
 }
@@ -0,0 +1,149 @@
+//Static geometry batching
+//
+//Objects that never move (buildings placed by the map) are merged
+//into a few large vertex buffers, with their vertices already in
+//world space. The map is divided into square cells and every cell
+//gets one chunk per material, so a chunk is a single draw call and
+//is culled with its bounding box instead of per object.
+//
+//Every vertex knows the object it belongs to. The tint and the fog
+//of war visibility of the objects are read by the shader from a
+//buffer texture that is updated every frame, hidden objects are
+//collapsed there. Objects tell the batcher when they become static,
+//get another model, move or are deleted, and only the chunks of the
+//cells they were and are in are built again. The vertices come from
+//the MeshGeometry that the model keeps on the CPU.
+#pragma once
+
+#include <map>
+#include <vector>
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+
+#include "RenderQueue.h"
+
+using std::vector;
+using glm::vec3;
+using glm::vec4;
+using glm::mat4;
+
+namespace Arya
+{
+    class Object;
+    class Model;
+    class Material;
+    class ShaderProgram;
+
+    class StaticBatcher : public RenderQueueListener
+    {
+        public:
+            StaticBatcher();
+            ~StaticBatcher();
+
+            //Looks up the uniforms of the object program, see staticmodel.vert
+            bool init(ShaderProgram* program);
+            void cleanup();
+
+            //Static objects with a model without animations,
+            //of which every mesh has its geometry on the CPU
+            static bool canBatch(Object* obj);
+
+            //Called by Object when it becomes static or not, gets another
+            //model or moves while it is static. The object is merged or
+            //taken out of the batches on the next update
+            void objectChanged(Object* obj);
+            //Called by Object when it is deleted
+            void removeObject(Object* obj);
+
+            //Handles the changed objects and builds the chunks of the
+            //cells that changed again. Must be called before the objects
+            //are used for the frame
+            void update();
+
+            //Fog of war visibility of a batched object, see Object::batchSlot
+            void setObjectVisible(int slot, bool visible);
+            //Uploads the tint and visibility of all batched objects
+            void updateObjectData();
+            //Changes when chunks are built again or the visibility
+            //of a batched object changes, for the cached shadow layers
+            unsigned int getSignature() const { return signature; }
+
+            //Adds a render item for every chunk in the frustum
+            void queueRender(const mat4& vpMatrix, RenderPass pass, RenderQueue& queue);
+            void renderItem(const RenderItem& item);
+
+            int getChunkCount() const { return chunks.size() - freeChunks.size(); }
+            int getObjectCount() const { return batchedObjects.size() - freeSlots.size(); }
+
+        private:
+            //Vertex layout of the chunks
+            struct BatchVertex
+            {
+                float position[3];
+                float texCoord[2];
+                float normal[3];
+                int object; //batch slot
+            };
+
+            //All meshes of one material in one cell.
+            //Unused entries have a vaoHandle of 0
+            struct Chunk
+            {
+                Material* material;
+                GLuint vaoHandle;
+                GLuint vertexBuffer;
+                GLuint indexBuffer;
+                GLsizei indexCount;
+                vec3 boundsMin; //world space AABB
+                vec3 boundsMax;
+            };
+
+            //The batched objects in one square of the map
+            struct Cell
+            {
+                vector<int> slots;
+                vector<int> chunks; //indices into StaticBatcher::chunks
+                bool dirty;
+            };
+            typedef std::map<std::pair<int, int>, Cell> CellMap;
+
+            //Free slots have no object
+            struct BatchedObject
+            {
+                Object* object;
+                CellMap::iterator cell;
+            };
+
+            void addToCell(int slot);
+            void removeFromCell(int slot);
+            void freeSlot(int slot);
+            void buildCell(Cell& cell);
+            void deleteChunks(Cell& cell);
+            bool createChunk(Chunk& chunk, const vector<BatchVertex>& vertices, const vector<GLuint>& indices);
+
+            CellMap cells;
+            vector<Chunk> chunks;
+            vector<int> freeChunks;
+            vector<BatchedObject> batchedObjects;
+            vector<int> freeSlots;
+            //Objects that called objectChanged since the last update
+            vector<Object*> changedObjects;
+            bool cellsDirty;
+
+            //Per batched object: xyz tint, w 1 when visible
+            vector<vec4> objectData;
+            GLuint objectBuffer;
+            GLuint objectTexture; //GL_TEXTURE_BUFFER, GL_RGBA32F
+            unsigned int buildCount;
+            unsigned int signature;
+
+            ShaderProgram* program;
+            GLint parametersLocation;
+            GLint positionOffsetLocation;
+            GLint positionScaleLocation;
+            GLint octNormalsLocation;
+            GLint animatedLocation;
+            GLint skinnedLocation;
+            GLint batchedLocation;
+    };
+}
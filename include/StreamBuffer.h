@@ -0,0 +1,46 @@
+//A buffer that gets new data every frame, like pixel data for
+//glTexSubImage2D (GL_PIXEL_UNPACK_BUFFER) or dynamic vertices (GL_ARRAY_BUFFER)
+//
+//Data is appended behind the previous data with unsynchronized maps,
+//so the driver never has to wait for the GPU to finish reading it.
+//When the buffer is full it is orphaned: the driver hands out new
+//storage and frees the old storage when the GPU is done with it.
+//
+//Usage:
+//  void* data = buffer->map(bytes);
+//  ... write bytes to data ...
+//  unsigned int offset = buffer->unmap();
+//  ... GL call that reads from the bound buffer at offset ...
+//  buffer->unbind(); //for GL_PIXEL_UNPACK_BUFFER, or other uploads read from it
+#pragma once
+
+#include <GL/glew.h>
+
+namespace Arya
+{
+    class StreamBuffer
+    {
+        public:
+            StreamBuffer();
+            ~StreamBuffer();
+
+            bool init(GLenum target, unsigned int size);
+
+            //Binds the buffer and returns memory for the given number of bytes.
+            //Returns 0 when it is larger than the buffer or mapping failed
+            void* map(unsigned int bytes);
+            //Returns the offset of the mapped data in the buffer,
+            //which is 16 byte aligned. The buffer stays bound
+            unsigned int unmap();
+            void unbind();
+
+            GLuint getHandle() const { return handle; }
+
+        private:
+            GLenum target;
+            GLuint handle;
+            unsigned int size;
+            unsigned int position;
+            unsigned int mappedOffset;
+    };
+}
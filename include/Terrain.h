@@ -4,6 +4,7 @@
 #include <glm/glm.hpp>
 
 #include "Materials.h"
+#include "RenderQueue.h"
 #include <vector>
 
 using glm::vec2;
@@ -25,31 +26,59 @@ namespace Arya
         vec2 position;
         vec2 offset;
         int lod;
+        float cameraDistance;
+        float minHeight; //in [0,1], from the heightmap
+        float maxHeight;
+        vec3 boundsMin; //world space AABB
+        vec3 boundsMax;
     } Patch;
 
-    class Terrain
+    //Heightmaps larger than 1025x1025 (of the form 1024*2^n + 1) are paged:
+    //the terrain is split into pages of 1024x1024 quads. Only the pages
+    //around the camera are uploaded at full resolution into a pool of
+    //texture layers. All other pages are drawn from an overview texture
+    //that holds every n-th sample, with a LOD that does not need more.
+    //heightData is only read for the pages that are uploaded, so it can
+    //be a mapped file (FileSystem::getMappedFile)
+    class Terrain : public RenderQueueListener
     {
         public:
             // Tileset needs to have 4 elements
             // heightData is considered to be terrainSize*terrainSize unsigned shorts, with no padding
+            // and has to stay valid as long as the terrain exists
             Terrain(const char* heightData, int terrainSize, const char* wm, vector<Material*> ts, Texture* cm, Texture* sm);
             ~Terrain(); 
 			
-            void render(Camera* cam);
+            //Sets the terrain wide uniforms and textures
+            //and adds a render item for every visible patch
+            void queueRender(Camera* cam, RenderQueue& queue);
+            void renderItem(const RenderItem& item);
             void update(float dt, Scene* curScene);
 
             bool init();
 
+            //For paged terrains this is the overview texture
             GLuint getHeightMapHandle() const { return heightMapHandle; }
+            bool isPaged() const { return paged; }
 
             //By default the terrain is [-0.5,0.5]x[0,1]x[-0.5,0.5] multiplied by the scale matrix
-            void setScaleMatrix(const mat4& newMat) { scaleMatrix = newMat; }
+            void setScaleMatrix(const mat4& newMat) { scaleMatrix = newMat; boundsChanged = true; }
             const mat4& getScaleMatrix() const { return scaleMatrix; }
 
+            //A patch gets the coarsest LOD that has a projected
+            //height error below this number of pixels
+            void setMaxPixelError(float pixels) { maxPixelError = pixels; boundsChanged = true; }
+            float getMaxPixelError() const { return maxPixelError; }
+
         private:
             bool generate();
             bool generateIndices();
             bool generateVAO();
+            //Height range and per LOD height error of every patch
+            void computePatchErrors();
+            //World space bounds, after the scale matrix changed
+            void updatePatchBounds();
+            float getHeight(int x, int y) const;
 
             const char* heightData;
 			const char* waterMapName;
@@ -62,15 +91,82 @@ namespace Arya
 
             mat4 scaleMatrix;
 
+            //Edges of a patch, used to pick the stitched index variant
+            enum
+            {
+                EDGE_BOTTOM = 1,
+                EDGE_TOP = 2,
+                EDGE_LEFT = 4,
+                EDGE_RIGHT = 8,
+                EDGE_VARIANTS = 16
+            };
+            GLuint stitchedIndex(int i, int j, int level, int edgeMask) const;
+            int getNeighbourLOD(int px, int py) const;
+            void restrictLODs();
+            void buildDrawList();
+
+            int gridSize; //vertices per row of one page
             GLuint vertexBuffer;
-            GLuint* indexBuffer;
-            GLuint* indexCount;
-            GLuint* vaoHandles;
+            GLuint indexBuffer;
+            GLuint vaoHandle;
+            vector<GLuint> variantOffset; //levelMax * EDGE_VARIANTS
+            vector<GLsizei> variantCount;
+
+            //Arguments for glMultiDrawElementsBaseVertex
+            vector<GLsizei> drawCounts;
+            vector<GLvoid*> drawOffsets;
+            vector<GLint> drawBaseVertices;
+
+            //The draw list is grouped per page, every
+            //group is a separate render item
+            typedef struct
+            {
+                int page;
+                int first;
+                int count;
+            } PageDraw;
+            vector<PageDraw> pageDraws;
+
+            //Paging
+            enum
+            {
+                PAGE_QUADS = 1024,
+                PATCHES_PER_PAGE = 16,
+                PAGE_POOL_SIZE = 9
+            };
+            bool generatePages();
+            //Uploads at most one missing page near the camera.
+            //Returns true when the resident pages changed
+            bool updateResidency(const vec3& camPos);
+            void uploadPage(int page, int layer);
+
+            bool paged;
+            int pageCount; //pages per row, 1 when not paged
+            int overviewLOD; //finest LOD that can be drawn from the overview
+            GLuint pagePoolHandle;
+            vector<int> patchPage;
+            vector<int> pageLayer; //-1 when the page is not resident
+            vector<int> lodFloor; //per patch, see restrictLODs
+            int layerPage[PAGE_POOL_SIZE];
+            unsigned int layerLastUsed[PAGE_POOL_SIZE];
+            unsigned int pageFrame;
 
             ShaderProgram* terrainProgram;
 			ShaderProgram* waterProgram;
+            GLint scaleMatrixLocation;
+            GLint parametersLocation[4];
+            GLint pageLayerLocation;
+            GLint pageOffsetLocation;
+            GLint pageScaleLocation;
 
             vector<Patch> patches;
+            //For every patch levelMax entries: the largest height
+            //difference (in [0,1]) between the LOD and the full heightmap
+            vector<float> lodErrors;
+            float maxPixelError;
+            //LOD selection is skipped when the camera did not change
+            mat4 lastVPMatrix;
+            bool boundsChanged;
             int patchCount;
             int patchSizeMax;
             int levelMax;
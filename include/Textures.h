@@ -14,12 +14,20 @@ namespace Arya
             GLuint height;
             //we could add more info about
             //bit depths and mipmap info and so on
+
+            //Used by Material. A texture that is not referenced
+            //and not persistent can be evicted by TextureManager
+            void addRef(){ refCount++; }
+            void release(){ refCount--; }
+            int getRefCount() const { return refCount; }
         private:
             //Only TextureManager can create Textures
             friend class TextureManager;
             friend class ResourceManager<Texture>;
-            Texture(){ handle = 0; width = 0; height = 0; }
+            Texture(){ handle = 0; width = 0; height = 0; refCount = 0; }
             ~Texture(){ if( handle ) glDeleteTextures(1, &handle); }
+
+            int refCount;
     };
 
     class TextureManager : public Singleton<TextureManager>, public ResourceManager<Texture> {
@@ -31,12 +39,16 @@ namespace Arya
             void cleanup();
 
             //If no texture found it will return 0
+            //The texture stays loaded until cleanup
             Texture* getTexture( std::string filename ){ return getResource(filename); }
+            //The texture can be evicted when its refcount drops to zero
+            Texture* getUnpinnedTexture( std::string filename ){ return getUnpinnedResource(filename); }
 
             Texture* createTextureFromHandle(std::string name, GLuint handle);
 
         private:
             Texture* loadResource( std::string filename );
+            bool isEvictable( Texture* texture ){ return texture->getRefCount() <= 0; }
 
             void loadDefaultTexture(); //Generates default texture
             void loadWhiteTexture(); //Generates white texture for overlay
@@ -0,0 +1,77 @@
+//World transforms of all objects
+//
+//The position and yaw of every object are stored as arrays with one
+//entry per object (structure of arrays), like AnimationSystem.
+//setPosition and setYaw only put the slot on the dirty list. Once per
+//frame update computes the move matrices of all dirty slots in one
+//batch, four at a time with SSE when it is available. Culling and
+//instancing read the matrices directly from getMatrices.
+//The slots are kept dense: when an object is removed the last slot
+//is moved into its place.
+#pragma once
+
+#include <vector>
+#include <glm/glm.hpp>
+
+using std::vector;
+using glm::vec3;
+using glm::mat4;
+
+namespace Arya
+{
+    class Object;
+
+    class TransformSystem
+    {
+        public:
+            TransformSystem();
+            ~TransformSystem();
+
+            //Returns the slot of the object, at the origin without rotation
+            int add(Object* owner);
+            void remove(int slot);
+
+            void setPosition(int slot, const vec3& position){ positions[slot] = position; markDirty(slot); }
+            const vec3& getPosition(int slot) const { return positions[slot]; }
+
+            //Rotation around the y axis in degrees
+            void setYaw(int slot, float yaw){ yaws[slot] = yaw; markDirty(slot); }
+            float getYaw(int slot) const { return yaws[slot]; }
+
+            //Computes the matrices of all dirty slots
+            void update();
+
+            //Up to date after update. getMatrix also computes
+            //the matrix of a single slot when it is dirty
+            const mat4& getMatrix(int slot);
+            const mat4* getMatrices() const { return matrices.empty() ? 0 : &matrices[0]; }
+
+            unsigned int getCount() const { return owners.size(); }
+            //Matrices computed by the last update
+            unsigned int getUpdatedCount() const { return updatedCount; }
+
+        private:
+            void markDirty(int slot)
+            {
+                if(dirty[slot]) return;
+                dirty[slot] = 1;
+                dirtySlots.push_back(slot);
+            }
+            void computeMatrix(int slot);
+
+            vector<Object*> owners;
+            vector<vec3> positions;
+            vector<float> yaws;
+            vector<mat4> matrices;
+            vector<unsigned char> dirty;
+            //Can contain slots that were removed or are not dirty
+            //anymore, update skips them
+            vector<int> dirtySlots;
+            unsigned int updatedCount;
+
+            //Gathered dirty slots of update, one array per component
+            vector<int> batchSlots;
+            vector<float> batchX, batchY, batchZ;
+            vector<float> batchSin, batchCos;
+    };
+}
@@ -3,19 +3,26 @@
 
 uniform sampler2D tex;
 uniform vec4 parameters;//specAmp, specPow, ambient, diffuse
-uniform vec3 tintColor;
+
+layout(std140) uniform SceneConstants
+{
+    mat4 vpMatrix;
+    mat4 viewMatrix;
+    mat4 lightMatrix[3]; //biased light matrix of every shadow cascade, maps to shadow map coordinates
+    vec4 lightDirection; //points to the light
+    vec4 cascadeSplits; //view space distance where every cascade ends
+};
 
 in vec2 texCoo;
 in vec3 normal;
 in float spec;
+in vec3 tintColor;
 
 layout (location = 0) out vec4 fragColor;
 
 void main()
 {
-	vec3 lightDirection=vec3(0.7,0.7,0.0);//MUST BE REPLACED
-
-	float lightFraction = max(0.0,dot(normalize(normal), lightDirection));
+	float lightFraction = max(0.0,dot(normalize(normal), lightDirection.xyz));
 	fragColor = texture(tex, texCoo);
 	if(fragColor.xyz == vec3(1.0, 0.0, 1.0))
         fragColor.xyz = tintColor;
@@ -4,35 +4,142 @@
 layout (location = 0) in vec3 position;
 layout (location = 1) in vec2 texCooIn;
 layout (location = 2) in vec3 normalIn;
-layout (location = 3) in vec3 posNext;
-layout (location = 4) in vec3 normalNext;
+//Skinned meshes
+layout (location = 3) in uvec4 boneIndices;
+layout (location = 4) in vec4 boneWeights;
+//Per instance attributes
+layout (location = 5) in mat4 mMatrix;
+layout (location = 9) in vec4 instanceData; //xyz tint color, w interpolation
+layout (location = 10) in ivec2 frameIn; //current and next animation frame
+//Static batches, see StaticBatcher.h
+layout (location = 11) in int objectIndex;
 
 out vec2 texCoo;
 out vec3 normal;
 out float spec;
+out vec3 tintColor;
+
+layout(std140) uniform SceneConstants
+{
+    mat4 vpMatrix;
+    mat4 viewMatrix;
+    mat4 lightMatrix[3]; //biased light matrix of every shadow cascade, maps to shadow map coordinates
+    vec4 lightDirection; //points to the light
+    vec4 cascadeSplits; //view space distance where every cascade ends
+};
 
-uniform mat4 mMatrix;
-uniform mat4 viewMatrix;
-uniform mat4 vpMatrix;
-uniform float interpolation;
 uniform vec4 parameters;//specAmp, specPow, ambient, diffuse
 
+//Decoding of compressed meshes, see Mesh.h
+//For other meshes the offset is 0, the scale 1 and octNormals false
+uniform vec3 positionOffset;
+uniform vec3 positionScale;
+uniform bool octNormals;
+
+//Animated meshes have no position and normal attributes. Their
+//frames are read from a buffer texture, per vertex one texel of
+//compressed data: xyz position, w the two bytes of the normal
+uniform bool animated;
+uniform usamplerBuffer frames;
+uniform int vertexCount; //per frame
+
+//Skinned meshes read the skinning matrices of the instance pose
+//from the palette: 3 texels (the rows of a 3x4 matrix) per bone,
+//starting at the bone in frameIn.x
+uniform bool skinned;
+uniform samplerBuffer palette;
+
+//Static batches have no instance attributes, their vertices are in
+//world space. The tint and fog of war visibility of the object are
+//read from objectData: xyz tint, w 1 when visible
+uniform bool batched;
+uniform samplerBuffer objectData;
+
+mat4 boneMatrix(int bone)
+{
+    vec4 row0 = texelFetch(palette, 3 * bone);
+    vec4 row1 = texelFetch(palette, 3 * bone + 1);
+    vec4 row2 = texelFetch(palette, 3 * bone + 2);
+    return transpose(mat4(row0, row1, row2, vec4(0.0, 0.0, 0.0, 1.0)));
+}
+
+//Octahedral normal, with xy in [-1,1]
+vec3 octDecode(vec2 e)
+{
+    vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+    if(n.z < 0.0)
+        n.xy = (1.0 - abs(n.yx)) * vec2(n.x >= 0.0 ? 1.0 : -1.0, n.y >= 0.0 ? 1.0 : -1.0);
+    return normalize(n);
+}
+
+//Two signed normalized bytes, as GL_BYTE attributes are decoded
+vec2 unpackOct(uint bits)
+{
+    ivec2 b = ivec2(int(bits & 0xffu), int(bits >> 8u));
+    b -= ivec2(greaterThan(b, ivec2(127))) * 256;
+    return max(vec2(b) / 127.0, vec2(-1.0));
+}
+
 void main()
 {
-	vec3 lightDirection=vec3(0.7,0.7,0.0);//MUST BE REPLACED
+    float interpolation = instanceData.w;
+    tintColor = instanceData.xyz;
+    mat4 modelMatrix = mMatrix;
+    if(batched)
+    {
+        vec4 object = texelFetch(objectData, objectIndex);
+        interpolation = 0.0;
+        tintColor = object.xyz;
+        modelMatrix = mat4(1.0);
+        //Hidden objects are collapsed to a point outside the view
+        if(object.w < 0.5)
+        {
+            texCoo = vec2(0.0);
+            normal = vec3(0.0, 1.0, 0.0);
+            spec = 0.0;
+            gl_Position = vec4(2.0, 2.0, 2.0, 1.0);
+            return;
+        }
+    }
 
     texCoo = texCooIn;
-	vec3 norm=normalize((mMatrix*vec4( (1.0 - interpolation)*normalIn + interpolation*normalNext , 0.0)).xyz);
-    
+    vec3 position0, position1, normal0, normal1;
+    if(animated)
+    {
+        //For indexed draws gl_VertexID is the index
+        uvec4 current = texelFetch(frames, frameIn.x * vertexCount + gl_VertexID);
+        uvec4 next = texelFetch(frames, frameIn.y * vertexCount + gl_VertexID);
+        position0 = vec3(current.xyz) / 65535.0;
+        position1 = vec3(next.xyz) / 65535.0;
+        normal0 = octDecode(unpackOct(current.w));
+        normal1 = octDecode(unpackOct(next.w));
+    }
+    else
+    {
+        position0 = position1 = position;
+        normal0 = normal1 = (octNormals ? octDecode(normalIn.xy) : normalIn);
+    }
+    vec3 localNormal = (1.0 - interpolation)*normal0 + interpolation*normal1;
+    vec3 pos = positionOffset + positionScale * ((1.0 - interpolation) * position0 + interpolation*position1);
+
+    if(skinned)
+    {
+        mat4 skin = boneWeights.x * boneMatrix(frameIn.x + int(boneIndices.x))
+                  + boneWeights.y * boneMatrix(frameIn.x + int(boneIndices.y))
+                  + boneWeights.z * boneMatrix(frameIn.x + int(boneIndices.z))
+                  + boneWeights.w * boneMatrix(frameIn.x + int(boneIndices.w));
+        pos = (skin * vec4(pos, 1.0)).xyz;
+        localNormal = (skin * vec4(localNormal, 0.0)).xyz;
+    }
 
-    vec3 pos = (1.0 - interpolation) * position + interpolation*posNext;
+	vec3 norm=normalize((modelMatrix*vec4(localNormal, 0.0)).xyz);
 
 	if(parameters[0] > 0.001) {
 		vec4 camNormal=normalize(viewMatrix*vec4(norm,0.0));
-		vec4 camLight=normalize(viewMatrix*vec4(lightDirection,0.0));
+		vec4 camLight=normalize(viewMatrix*vec4(lightDirection.xyz,0.0));
 		vec4 camReflection=2.0*camNormal*dot(camLight,camNormal)-camLight;
 		spec=max(dot(camReflection,-1.0*normalize(viewMatrix*vec4(pos,0.0))),0);
 	} else spec=0.0;
 	normal = norm;
-    gl_Position = vpMatrix * mMatrix * vec4(pos,1.0);
+    gl_Position = vpMatrix * modelMatrix * vec4(pos,1.0);
 }
@@ -6,17 +6,23 @@ uniform sampler2D texture1;
 uniform sampler2D texture2;
 uniform sampler2D texture3;
 uniform sampler2D texture4;
-uniform sampler2D shadowMap;
+uniform sampler2DArray shadowMap; //one layer per cascade
 uniform sampler2D fogMap;
 
-uniform vec3 lightDirection;
+layout(std140) uniform SceneConstants
+{
+    mat4 vpMatrix;
+    mat4 viewMatrix;
+    mat4 lightMatrix[3]; //biased light matrix of every shadow cascade, maps to shadow map coordinates
+    vec4 lightDirection; //points to the light
+    vec4 cascadeSplits; //view space distance where every cascade ends
+};
+
 uniform vec4 parameters1; //specAmp, specPow, ambient, diffuse
 uniform vec4 parameters2;
 uniform vec4 parameters3;
 uniform vec4 parameters4;
 
-uniform mat4 lightOrthoMatrix;
-
 in float spec;
 in vec2 texCoo;
 in vec4 posOut;
@@ -25,7 +31,7 @@ out vec4 FragColor;
 
 void main()
 {
-    float lightFraction = max(0.0,dot(normalize(normalOut), lightDirection));
+    float lightFraction = max(0.0,dot(normalize(normalOut), lightDirection.xyz));
 
 	vec4 tColor = vec4(0.0);
     vec4 splatSample = vec4(0.0);
@@ -53,12 +59,21 @@ void main()
 	FragColor.xyz *= texture(fogMap, texCoo).r;
 	FragColor.a=1.0;
 
-    vec4 posOnShadowTex = lightOrthoMatrix * posOut;
+    //Pick the first cascade that covers this distance
+    float viewDistance = -(viewMatrix * posOut).z;
+    int cascade = 0;
+    if(viewDistance > cascadeSplits.x) cascade = 1;
+    if(viewDistance > cascadeSplits.y) cascade = 2;
+
+    if(viewDistance <= cascadeSplits.z)
+    {
+        vec4 posOnShadowTex = lightMatrix[cascade] * posOut;
 
-    if(!(posOnShadowTex.x < 0.0 || posOnShadowTex.x > 1.0))
-        if(!(posOnShadowTex.y < 0.0 || posOnShadowTex.y > 1.0)) 
-            if(!(posOnShadowTex.z < 0.0 || posOnShadowTex.z > 1.0)) 
-                if(texture(shadowMap, posOnShadowTex.xy).r < posOnShadowTex.z)
-                    FragColor *= 0.5;
+        if(!(posOnShadowTex.x < 0.0 || posOnShadowTex.x > 1.0))
+            if(!(posOnShadowTex.y < 0.0 || posOnShadowTex.y > 1.0)) 
+                if(!(posOnShadowTex.z < 0.0 || posOnShadowTex.z > 1.0)) 
+                    if(texture(shadowMap, vec3(posOnShadowTex.xy, float(cascade))).r < posOnShadowTex.z)
+                        FragColor *= 0.5;
+    }
 
 }
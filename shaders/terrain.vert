@@ -4,42 +4,65 @@
 uniform sampler2D splatTexture;
 uniform sampler2D heightMap;
 uniform sampler2D fogMap;
-uniform mat4 vpMatrix;
 uniform mat4 scaleMatrix;
-uniform mat4 viewMatrix;
 
-uniform vec3 lightDirection;
-uniform vec2 patchOffset;
+layout(std140) uniform SceneConstants
+{
+    mat4 vpMatrix;
+    mat4 viewMatrix;
+    mat4 lightMatrix[3]; //biased light matrix of every shadow cascade, maps to shadow map coordinates
+    vec4 lightDirection; //points to the light
+    vec4 cascadeSplits; //view space distance where every cascade ends
+};
+
+uniform float oneOverGridSize;
+
+//Paged terrains: the page that is drawn, in terrain texture coordinates.
+//When the page is resident its heights come from layer pageLayer,
+//otherwise (and for unpaged terrains) from heightMap
+uniform sampler2DArray heightPages;
+uniform int pageLayer;
+uniform vec2 pageOffset;
+uniform float pageScale;
 
-layout (location = 0) in vec2 texCooPatch;
+layout (location = 0) in vec2 gridPosition;
 out vec2 texCoo;
 out vec4 posOut;
 out vec3 normalOut;
 out float spec;
 
+//tco is relative to the page
 float height(vec2 tco)
 {
     vec4 h = vec4(0.0);
-    h = texture(heightMap, tco);
+    if(pageLayer >= 0)
+        h = texture(heightPages, vec3(tco, float(pageLayer)));
+    else
+        h = texture(heightMap, pageOffset + tco * pageScale);
     return h.r;
 }
 
 void main()
 {
-    texCoo = patchOffset + texCooPatch;
-    vec4 pos = scaleMatrix * vec4(texCoo.x-0.5, height(texCoo), texCoo.y-0.5, 1.0);
+    vec2 pageCoo = gridPosition * oneOverGridSize;
+    texCoo = pageOffset + pageCoo * pageScale;
+    vec4 pos = scaleMatrix * vec4(texCoo.x-0.5, height(pageCoo), texCoo.y-0.5, 1.0);
 
-    float textureDelta = 0.001953125; // 1/512
-    float A = height(texCoo + vec2(0.0,textureDelta));
-    float B = height(texCoo + vec2(textureDelta,0.0));
-    float C = height(texCoo + vec2(0.0,-textureDelta));
-    float D = height(texCoo + vec2(-textureDelta,0.0));
+    // two samples of the texture that is used
+    float textureDelta = 2.0 * oneOverGridSize;
+    if(pageLayer < 0) textureDelta /= pageScale;
+    // the normals were tuned for a delta of 1/512 of the whole terrain
+    float deltaScale = textureDelta * pageScale * 512.0;
+    float A = height(pageCoo + vec2(0.0,textureDelta));
+    float B = height(pageCoo + vec2(textureDelta,0.0));
+    float C = height(pageCoo + vec2(0.0,-textureDelta));
+    float D = height(pageCoo + vec2(-textureDelta,0.0));
 
-    vec4 normal = vec4( (D-B), 2.0/scaleMatrix[1][1], (C-A), 0.0 );
+    vec4 normal = vec4( (D-B), 2.0*deltaScale/scaleMatrix[1][1], (C-A), 0.0 );
 	normalOut = normalize( normal.xyz );
 
 	vec4 camNormal=normalize(viewMatrix*vec4(normal.xyz,0.0));
-	vec4 camLight=normalize(viewMatrix*vec4(lightDirection,0.0));
+	vec4 camLight=normalize(viewMatrix*vec4(lightDirection.xyz,0.0));
 	vec4 camReflection=2.0*camNormal*dot(camLight,camNormal)-camLight;
 	spec=max(dot(camReflection,-1.0*normalize(viewMatrix*pos)),0);
 
@@ -1,9 +1,17 @@
 #version 400
 #extension GL_ARB_explicit_attrib_location : require
 
-uniform mat4 vpMatrix;
 uniform vec2 oneOverTerrainSize;
 
+layout(std140) uniform SceneConstants
+{
+    mat4 vpMatrix;
+    mat4 viewMatrix;
+    mat4 lightMatrix[3]; //biased light matrix of every shadow cascade, maps to shadow map coordinates
+    vec4 lightDirection; //points to the light
+    vec4 cascadeSplits; //view space distance where every cascade ends
+};
+
 uniform sampler2D heightMap;
 layout (location = 0) in vec2 posIn;
 out vec2 texcoo;
@@ -0,0 +1,134 @@
+#include <glm/glm.hpp>
+#include "AnimationSystem.h"
+#include "Objects.h"
+#include "Models.h"
+
+namespace Arya
+{
+    AnimationSystem::AnimationSystem()
+    {
+    }
+
+    AnimationSystem::~AnimationSystem()
+    {
+    }
+
+    int AnimationSystem::add(Object* owner, const Model* model)
+    {
+        owners.push_back(owner);
+        models.push_back(model);
+        clipIds.push_back(-1);
+        clips.push_back(0);
+        time.push_back(0.0f);
+        speed.push_back(0.0f);
+        length.push_back(0.0f);
+        inverseLength.push_back(0.0f);
+        clipFrame.push_back(0);
+        frame.push_back(0);
+        interpolation.push_back(0.0f);
+        return owners.size() - 1;
+    }
+
+    void AnimationSystem::remove(int slot)
+    {
+        int last = owners.size() - 1;
+        if(slot < 0 || slot > last) return;
+        if(slot != last)
+        {
+            owners[slot] = owners[last];
+            models[slot] = models[last];
+            clipIds[slot] = clipIds[last];
+            clips[slot] = clips[last];
+            time[slot] = time[last];
+            speed[slot] = speed[last];
+            length[slot] = length[last];
+            inverseLength[slot] = inverseLength[last];
+            clipFrame[slot] = clipFrame[last];
+            frame[slot] = frame[last];
+            interpolation[slot] = interpolation[last];
+            owners[slot]->animationSlot = slot;
+        }
+        owners.pop_back();
+        models.pop_back();
+        clipIds.pop_back();
+        clips.pop_back();
+        time.pop_back();
+        speed.pop_back();
+        length.pop_back();
+        inverseLength.pop_back();
+        clipFrame.pop_back();
+        frame.pop_back();
+        interpolation.pop_back();
+    }
+
+    void AnimationSystem::play(int slot, int clipId)
+    {
+        if(clipIds[slot] == clipId) return;
+        const AnimationClip* clip = models[slot]->getAnimation(clipId);
+        if(!clip) return;
+
+        clipIds[slot] = clipId;
+        clips[slot] = clip;
+        time[slot] = 0.0f;
+        speed[slot] = 1.0f;
+        length[slot] = clip->length;
+        inverseLength[slot] = 1.0f / clip->length;
+        clipFrame[slot] = 0;
+        resolveFrame(slot);
+    }
+
+    void AnimationSystem::setDuration(int slot, float newTime)
+    {
+        if(clips[slot] && newTime > 0.0001f)
+            speed[slot] = length[slot] / newTime;
+    }
+
+    void AnimationSystem::update(float elapsedTime)
+    {
+        const int count = owners.size();
+        if(count == 0) return;
+
+        float* t = &time[0];
+        const float* s = &speed[0];
+        const float* l = &length[0];
+        const float* il = &inverseLength[0];
+
+        //Advance and loop, without branches so the compiler can vectorize it.
+        //Slots without a clip have speed and inverse length 0 and stay at 0
+        for(int i = 0; i < count; ++i)
+        {
+            float advanced = t[i] + elapsedTime * s[i];
+            t[i] = advanced - l[i] * glm::floor(advanced * il[i]);
+        }
+
+        for(int i = 0; i < count; ++i)
+            resolveFrame(i);
+    }
+
+    void AnimationSystem::resolveFrame(int slot)
+    {
+        const AnimationClip* clip = clips[slot];
+        if(!clip)
+        {
+            frame[slot] = 0;
+            interpolation[slot] = 0.0f;
+            return;
+        }
+
+        //The time usually advances less than a frame, so search from
+        //the previous frame. Rounding can put the time just outside
+        //the clip, then it is kept in the first or last frame
+        const int lastFrame = clip->frameTimes.size() - 1;
+        const float t = time[slot];
+        int f = clipFrame[slot];
+        if(f > lastFrame || t < clip->frameStarts[f]) f = 0;
+        while(f < lastFrame && t >= clip->frameStarts[f + 1]) ++f;
+        clipFrame[slot] = f;
+
+        float fraction = (t - clip->frameStarts[f]) / clip->frameTimes[f];
+        if(fraction < 0.0f) fraction = 0.0f;
+        if(fraction > 1.0f) fraction = 1.0f;
+        frame[slot] = clip->startFrame + f;
+        interpolation[slot] = fraction;
+    }
+}
@@ -7,6 +7,22 @@ const float PI = 3.14159265358979323846264338327950288f;
 
 namespace Arya
 {
+    void getFrustumPlanes(const mat4& vpMatrix, vec4 planes[6])
+    {
+        //The planes are the sums and differences
+        //of the last row of the matrix with the other rows
+        for(int p = 0; p < 6; ++p)
+        {
+            int row = p/2;
+            float sign = (p % 2 == 0 ? 1.0f : -1.0f);
+            vec4 plane(vpMatrix[0][3] + sign*vpMatrix[0][row],
+                       vpMatrix[1][3] + sign*vpMatrix[1][row],
+                       vpMatrix[2][3] + sign*vpMatrix[2][row],
+                       vpMatrix[3][3] + sign*vpMatrix[3][row]);
+            planes[p] = plane / glm::length(vec3(plane.x, plane.y, plane.z));
+        }
+    }
+
     Camera::Camera()
     {
         updateMatrix = true;
@@ -42,6 +42,12 @@ namespace Arya
 		setCvarWithoutSave("goingupgame","X", TYPE_STRING);
 		setCvarWithoutSave("synchronizegame","!", TYPE_STRING);
 
+		//Resource residency budgets in megabytes, 0 means unlimited
+		setCvarWithoutSave("texturebudget", "256", TYPE_INTEGER);
+		setCvarWithoutSave("modelbudget", "128", TYPE_INTEGER);
+		//Verify the checksum of every model file on load, this reads the whole file
+		setCvarWithoutSave("modelvalidate", "false", TYPE_BOOL);
+
         loadConfigFile("config.txt");
         return true;
     }
@@ -35,6 +35,9 @@ namespace Arya
 	Decals::Decals()
 	{
 		decalProgram = 0;
+		decalColorLocation = -1;
+		scaleFactorLocation = -1;
+		offsetLocation = -1;
 		decalVao = 0;
 		indexCount = 0;
 	}
@@ -73,6 +76,15 @@ namespace Arya
 		decalProgram->attach(decalFragment);
 		if(!(decalProgram->link())) return false;
 
+		decalProgram->use();
+		decalProgram->setUniform1i("heightMap", 0);
+		decalProgram->setUniform1i("decalTexture", 1);
+		decalProgram->setUniform2fv("oneOverTerrainSize", vec2(1.0/2048.0, 1.0/2048.0));
+
+		decalColorLocation = decalProgram->getUniformLocation("decalColor");
+		scaleFactorLocation = decalProgram->getUniformLocation("scaleFactor");
+		offsetLocation = decalProgram->getUniformLocation("offset");
+
 		return true;
 	}
 
@@ -160,38 +172,38 @@ namespace Arya
 		return true;
 	}
 
-	void Decals::render()
+	void Decals::queueRender(RenderQueue& queue)
 	{
-		glEnable(GL_BLEND);
-		glDisable(GL_CULL_FACE);
-		glDisable(GL_DEPTH_TEST);
-
-		decalProgram->use();
-		glBindVertexArray(decalVao);
-
-		decalProgram->setUniformMatrix4fv("vpMatrix", Root::shared().getScene()->getCamera()->getVPMatrix());
-		decalProgram->setUniform1i("heightMap", 0);
-		glActiveTexture(GL_TEXTURE0);
-		glBindTexture(GL_TEXTURE_2D, Root::shared().getScene()->getTerrain()->getHeightMapHandle());
-
-		decalProgram->setUniform2fv("oneOverTerrainSize", vec2(1.0/2048.0, 1.0/2048.0));
-
-		glBindVertexArray(decalVao);
-
-		for(int i = 0; i < decals.size(); ++i)
+		//Decals are blended without depth test, so they have to be drawn
+		//in the order in which they were added. The texture is left out
+		//of the sort key, it is above the depth that keeps that order
+		RenderItem item;
+		item.owner = this;
+		item.program = decalProgram->getHandle();
+		item.vertexArray = decalVao;
+		item.textureUnit = 1;
+		for(unsigned int i = 0; i < decals.size(); ++i)
 		{
-			decalProgram->setUniform1i("decalTexture", 1);
-			glActiveTexture(GL_TEXTURE1);
-			glBindTexture(GL_TEXTURE_2D, decals[i]->texture->handle);
-			decalProgram->setUniform3fv("decalColor", decals[i]->color);
-			decalProgram->setUniform1f("scaleFactor", decals[i]->scale);
-			decalProgram->setUniform2fv("offset", decals[i]->pos);
-
-            glDrawElements(GL_TRIANGLE_STRIP, indexCount, GL_UNSIGNED_INT, (void*)0);
+			item.texture = decals[i]->texture->handle;
+			item.index = i;
+			item.sortKey = queue.makeSortKey(PASS_DECALS, item.program, 0, item.vertexArray, i / (float)decals.size());
+			queue.addItem(item);
 		}
+	}
 
-		glEnable(GL_CULL_FACE);
-		glEnable(GL_DEPTH_TEST);
-		glDisable(GL_BLEND);
+	void Decals::renderItem(const RenderItem& item)
+	{
+		GLStateCache& stateCache = GLStateCache::shared();
+		stateCache.setBlend(true);
+		stateCache.setCullFace(false);
+		stateCache.setDepthTest(false);
+		stateCache.bindTexture(0, Root::shared().getScene()->getTerrain()->getHeightMapHandle());
+
+		Decal* decal = decals[item.index];
+		decalProgram->setUniform3fv(decalColorLocation, decal->color);
+		decalProgram->setUniform1f(scaleFactorLocation, decal->scale);
+		decalProgram->setUniform2fv(offsetLocation, decal->pos);
+
+		glDrawElements(GL_TRIANGLE_STRIP, indexCount, GL_UNSIGNED_INT, (void*)0);
 	}
 }
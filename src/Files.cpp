@@ -3,6 +3,12 @@
 #include <algorithm>
 #include <iostream>
 #include "common/Logger.h"
+#if defined(__linux__) || defined(__APPLE__)
+#include <sys/mman.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#endif
 
 using std::ifstream;
 
@@ -108,12 +114,73 @@ namespace Arya
 		filestream.read(newFile->data, newFile->size);
 
 		newFile->refcount = 1;
+		newFile->mapped = false;
 
 		//Add to loadedFiles
 		loadedFiles.insert( _fileValueType(filename, newFile) );
 		return newFile;
 	}
 
+#if defined(__linux__) || defined(__APPLE__)
+	File* FileSystem::getMappedFile(string filename)
+	{
+		fileIterator loadedFile = loadedFiles.find(filename);
+		if( loadedFile != loadedFiles.end() ){
+			loadedFile->second->refcount++;
+			return loadedFile->second;
+		}
+
+		string path(applicationPath);
+		path.append(filename);
+		int fd = open(path.c_str(), O_RDONLY);
+		if( fd < 0 ){
+            LOG_WARNING("File: " << path << " not found!");
+			return 0;
+		}
+
+		struct stat fileInfo;
+		if( fstat(fd, &fileInfo) != 0 || fileInfo.st_size == 0 ){
+			close(fd);
+			//Empty files can not be mapped
+			return getFile(filename);
+		}
+
+		void* mappedData = mmap(0, fileInfo.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		//The mapping stays valid after closing the descriptor
+		close(fd);
+		if( mappedData == MAP_FAILED ){
+			LOG_WARNING("Unable to map " << path << ", loading it instead");
+			return getFile(filename);
+		}
+
+		File* newFile = new File;
+		newFile->data = static_cast<char*>(mappedData);
+		newFile->size = (unsigned int)fileInfo.st_size;
+		newFile->refcount = 1;
+		newFile->mapped = true;
+
+		loadedFiles.insert( _fileValueType(filename, newFile) );
+		return newFile;
+	}
+
+	void FileSystem::freeFileData(File* file)
+	{
+		if( !file->data ) return;
+		if( file->mapped ) munmap(file->data, file->size);
+		else delete[] file->data;
+	}
+#else
+	File* FileSystem::getMappedFile(string filename)
+	{
+		return getFile(filename);
+	}
+
+	void FileSystem::freeFileData(File* file)
+	{
+		if( file->data ) delete[] file->data;
+	}
+#endif
+
 	void FileSystem::releaseFile(File* file)
 	{
 		file->refcount--;
@@ -125,7 +192,7 @@ namespace Arya
 		for( fileIterator fileIter = loadedFiles.begin(); fileIter != loadedFiles.end(); ++fileIter ){
 			if( file == fileIter->second ){
 				loadedFiles.erase(fileIter);
-				if( file->data ) delete[] file->data;
+				freeFileData(file);
 				delete file;
 				break;
 			}
@@ -135,7 +202,7 @@ namespace Arya
 	void FileSystem::unloadAllFiles()
 	{
 		for( fileIterator file = loadedFiles.begin(); file != loadedFiles.end(); ++file ){
-			if( file->second->data ) delete[] file->second->data;
+			freeFileData(file->second);
 			delete file->second;
 		}
 		loadedFiles.clear();
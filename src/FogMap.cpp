@@ -1,5 +1,11 @@
 #include "FogMap.h"
 #include <string.h>
+#include <math.h>
+#include <algorithm>
+#include <SFML/System.hpp>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include <iostream>
 using std::cout;
@@ -8,12 +14,162 @@ using std::endl;
 #include "common/Logger.h"
 #include "Interface.h"
 #include "Textures.h"
+#include "StreamBuffer.h"
+#include "LineOfSight.h"
 
-#define MAX_CIRCLE_SIZE 40
 #define UPDATE_TIME 0.1f
+#define BLUR_RADIUS 2
+// Dirty regions closer than this are merged. At this distance the
+// blur of one region does not read the pixels of the other, so the
+// regions can be updated one after the other
+#define DIRTY_MERGE_DISTANCE (2*BLUR_RADIUS)
+#define MAX_DIRTY_RECTS 8
+#define BLUR_THREADS 4
+#define BLUR_THREAD_MIN_PIXELS (128*128)
+// in world units, above the terrain
+#define VISION_EYE_HEIGHT 5.0f
 
 namespace Arya
 {
+	// Rows [firstRow, endRow) and columns [firstColumn, endColumn) of the blurred map
+	struct FogBlurBand
+	{
+		const unsigned char* source;
+		unsigned char* destination;
+		int size;
+		int firstRow;
+		int endRow;
+		int firstColumn;
+		int endColumn;
+
+		// Horizontal sums of the band and BLUR_RADIUS rows around it
+		vector<unsigned short> rowSums;
+		vector<unsigned short> columnSums;
+		// Per pixel of a row 2^22 / (number of pixels in the filter), rounded up
+		vector<unsigned int> reciprocals;
+
+		void run();
+	};
+
+	// Number of pixels of [i - BLUR_RADIUS, i + BLUR_RADIUS] inside [0, size)
+	static inline int blurWidth(int i, int size)
+	{
+		int first = (i - BLUR_RADIUS < 0 ? 0 : i - BLUR_RADIUS);
+		int last = (i + BLUR_RADIUS > size - 1 ? size - 1 : i + BLUR_RADIUS);
+		return last - first + 1;
+	}
+
+	void FogBlurBand::run()
+	{
+		if(firstRow >= endRow || firstColumn >= endColumn) return;
+
+		int width = endColumn - firstColumn;
+		int firstSumRow = (firstRow - BLUR_RADIUS < 0 ? 0 : firstRow - BLUR_RADIUS);
+		int endSumRow = (endRow + BLUR_RADIUS > size ? size : endRow + BLUR_RADIUS);
+		if(rowSums.size() < (unsigned int)((endSumRow - firstSumRow) * width))
+			rowSums.resize((endSumRow - firstSumRow) * width);
+		if(columnSums.size() < (unsigned int)width)
+		{
+			columnSums.resize(width);
+			reciprocals.resize(width);
+		}
+
+		// Horizontal pass, with a running sum
+		int firstSumColumn = (firstColumn - BLUR_RADIUS < 0 ? 0 : firstColumn - BLUR_RADIUS);
+		for(int y = firstSumRow; y < endSumRow; ++y)
+		{
+			const unsigned char* in = source + y*size;
+			unsigned short* out = &rowSums[(y - firstSumRow)*width];
+			int sum = 0;
+			for(int x = firstSumColumn; x < firstColumn + BLUR_RADIUS && x < size; ++x)
+				sum += in[x];
+			for(int x = firstColumn; x < endColumn; ++x)
+			{
+				if(x + BLUR_RADIUS < size) sum += in[x + BLUR_RADIUS];
+				if(x > firstColumn && x - BLUR_RADIUS > 0) sum -= in[x - BLUR_RADIUS - 1];
+				out[x - firstColumn] = sum;
+			}
+		}
+
+		// Vertical pass, with a running sum over the columns
+		unsigned short* columns = &columnSums[0];
+		memset(columns, 0, sizeof(unsigned short) * width);
+		for(int y = firstSumRow; y < firstRow + BLUR_RADIUS && y < endSumRow; ++y)
+		{
+			const unsigned short* row = &rowSums[(y - firstSumRow)*width];
+			for(int x = 0; x < width; ++x)
+				columns[x] += row[x];
+		}
+
+		for(int y = firstRow; y < endRow; ++y)
+		{
+			int x;
+			if(y + BLUR_RADIUS < size)
+			{
+				const unsigned short* row = &rowSums[(y + BLUR_RADIUS - firstSumRow)*width];
+				x = 0;
+#ifdef __SSE2__
+				for(; x + 8 <= width; x += 8)
+				{
+					__m128i c = _mm_loadu_si128((const __m128i*)(columns + x));
+					__m128i r = _mm_loadu_si128((const __m128i*)(row + x));
+					_mm_storeu_si128((__m128i*)(columns + x), _mm_add_epi16(c, r));
+				}
+#endif
+				for(; x < width; ++x)
+					columns[x] += row[x];
+			}
+			if(y > firstRow && y - BLUR_RADIUS > 0)
+			{
+				const unsigned short* row = &rowSums[(y - BLUR_RADIUS - 1 - firstSumRow)*width];
+				x = 0;
+#ifdef __SSE2__
+				for(; x + 8 <= width; x += 8)
+				{
+					__m128i c = _mm_loadu_si128((const __m128i*)(columns + x));
+					__m128i r = _mm_loadu_si128((const __m128i*)(row + x));
+					_mm_storeu_si128((__m128i*)(columns + x), _mm_sub_epi16(c, r));
+				}
+#endif
+				for(; x < width; ++x)
+					columns[x] -= row[x];
+			}
+
+			// Average: (sum * 2^22/count) >> 22, so no division is needed.
+			// With the reciprocal rounded up the error is below sum/2^22,
+			// which is less than 1/count, so this equals sum/count.
+			// The product is below 255 * (2^22 + count) and fits 32 bits
+			int height = blurWidth(y, size);
+			unsigned int* scale = &reciprocals[0];
+			for(x = 0; x < width; ++x)
+			{
+				unsigned int count = blurWidth(firstColumn + x, size) * height;
+				scale[x] = ((1u << 22) + count - 1) / count;
+			}
+
+			unsigned char* out = destination + y*size + firstColumn;
+			x = 0;
+#ifdef __SSE2__
+			const __m128i zero = _mm_setzero_si128();
+			for(; x + 4 <= width; x += 4)
+			{
+				__m128i c = _mm_unpacklo_epi16(_mm_loadl_epi64((const __m128i*)(columns + x)), zero);
+				__m128i r = _mm_loadu_si128((const __m128i*)(scale + x));
+				// 32 bit products of lanes 0 and 2, then of lanes 1 and 3
+				__m128i even = _mm_srli_epi64(_mm_mul_epu32(c, r), 22);
+				__m128i odd = _mm_srli_epi64(_mm_mul_epu32(_mm_srli_epi64(c, 32), _mm_srli_epi64(r, 32)), 22);
+				__m128i average = _mm_or_si128(even, _mm_slli_epi64(odd, 32));
+				average = _mm_packs_epi32(average, average);
+				average = _mm_packus_epi16(average, average);
+				int packed = _mm_cvtsi128_si32(average);
+				memcpy(out + x, &packed, 4);
+			}
+#endif
+			for(; x < width; ++x)
+				out[x] = (unsigned char)((columns[x] * scale[x]) >> 22);
+		}
+	}
+
 	FogMap::FogMap(int _fogMapSize, float _representedSize)
 	{
 		fogMapSize = _fogMapSize;
@@ -21,7 +177,13 @@ namespace Arya
 
 		fogData = 0;
 		fogDeltaData = 0;
-        bresenhemCircles = 0;
+		uploadBuffer = 0;
+		lineOfSight = 0;
+		fogMapTextureHandle = 0;
+		visibleBits = 0;
+		exploredBits = 0;
+		bitplaneWords = (fogMapSize + 31) / 32;
+		fogUpdateTime = 0.0f;
 	}
 
 	FogMap::~FogMap()
@@ -30,13 +192,19 @@ namespace Arya
 			delete[] fogDeltaData;
 		if(fogData)
 			delete[] fogData;
-
-        if(bresenhemCircles)
-        {
-            for(int i = 0; i < MAX_CIRCLE_SIZE; ++i)
-                delete[] bresenhemCircles[i];
-            delete[] bresenhemCircles;
-        }
+		if(uploadBuffer)
+			delete uploadBuffer;
+		if(fogMapTextureHandle)
+			glDeleteTextures(1, &fogMapTextureHandle);
+		if(visibleBits)
+			delete[] visibleBits;
+		if(exploredBits)
+			delete[] exploredBits;
+
+		for(unsigned int i = 0; i < blurThreads.size(); ++i)
+			delete blurThreads[i];
+		for(unsigned int i = 0; i < blurBands.size(); ++i)
+			delete blurBands[i];
 	}
 
 	void FogMap::positionToIndex(vec2 pos, int& centerX, int& centerY)
@@ -47,11 +215,32 @@ namespace Arya
 		centerY = (int)(fogMapSize * (shiftedPosition.y / representedSize));
 	}
 
-	bool FogMap::isVisible(vec2 pos)
+	bool FogMap::isVisible(vec2 pos) const
+	{
+		unsigned int mask;
+		queryVisibility(&pos, 1, &mask);
+		return mask & 1;
+	}
+
+	void FogMap::queryVisibility(const vec2* positions, int count, unsigned int* visibleMask) const
 	{
-		int centerX, centerY;
-		positionToIndex(pos, centerX, centerY);
-		return fogData[centerY*fogMapSize + centerX] > 63;
+		if(count <= 0) return;
+		memset(visibleMask, 0, sizeof(unsigned int) * ((count + 31) / 32));
+		if(!visibleBits) return;
+
+		float scale = fogMapSize / representedSize;
+		float offset = 0.5f * representedSize;
+		for(int i = 0; i < count; ++i)
+		{
+			float fx = (positions[i].x + offset) * scale;
+			float fy = (positions[i].y + offset) * scale;
+			if(!(fx >= 0.0f && fy >= 0.0f && fx < fogMapSize && fy < fogMapSize))
+				continue;
+			int x = (int)fx;
+			int y = (int)fy;
+			unsigned int bit = (visibleBits[y*bitplaneWords + (x >> 5)] >> (x & 31)) & 1;
+			visibleMask[i >> 5] |= bit << (i & 31);
+		}
 	}
 
 	bool FogMap::init()
@@ -59,9 +248,33 @@ namespace Arya
 		fogData = new unsigned char[fogMapSize * fogMapSize];
 		fogDeltaData = new unsigned char[fogMapSize * fogMapSize];
 
+		visibleBits = new unsigned int[bitplaneWords * fogMapSize];
+		exploredBits = new unsigned int[bitplaneWords * fogMapSize];
+
         memset(fogData, 0, sizeof(unsigned char)*fogMapSize*fogMapSize);
+        memset(fogDeltaData, 0, sizeof(unsigned char)*fogMapSize*fogMapSize);
+        memset(visibleBits, 0, sizeof(unsigned int)*bitplaneWords*fogMapSize);
+        memset(exploredBits, 0, sizeof(unsigned int)*bitplaneWords*fogMapSize);
+
+		// The buffers of the bands grow when they are used
+		for(int i = 0; i < BLUR_THREADS; ++i)
+		{
+			FogBlurBand* band = new FogBlurBand;
+			band->source = fogData;
+			band->destination = fogDeltaData;
+			band->size = fogMapSize;
+			band->firstRow = band->endRow = 0;
+			band->firstColumn = band->endColumn = 0;
+			blurBands.push_back(band);
+			if(i > 0)
+				blurThreads.push_back(new sf::Thread(&FogBlurBand::run, band));
+		}
+
+		// Room for a few full updates before it is orphaned
+		uploadBuffer = new StreamBuffer;
+		if(!uploadBuffer->init(GL_PIXEL_UNPACK_BUFFER, 3 * fogMapSize * fogMapSize))
+			return false;
 
-		precalculateBresenhemCircles();
 		initTexture();
 		return true;
 	}
@@ -69,11 +282,6 @@ namespace Arya
 	void FogMap::initTexture()
 	{
         glGenTextures(1, &fogMapTextureHandle);
-		updateTexture();
-	}
-
-	void FogMap::updateTexture()
-	{
         glBindTexture(GL_TEXTURE_2D, fogMapTextureHandle);
 
         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
@@ -81,8 +289,94 @@ namespace Arya
         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
 
-        glPixelStorei(GL_UNPACK_ALIGNMENT, 2);
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_R16, fogMapSize, fogMapSize, 0, GL_RED, GL_UNSIGNED_BYTE, fogDeltaData);
+        // Allocated once, after this it is only updated
+        if(GLEW_ARB_texture_storage)
+            glTexStorage2D(GL_TEXTURE_2D, 1, GL_R8, fogMapSize, fogMapSize);
+        else
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_R8, fogMapSize, fogMapSize, 0, GL_RED, GL_UNSIGNED_BYTE, 0);
+
+		updateTexture(0, 0, fogMapSize, fogMapSize);
+	}
+
+	void FogMap::updateTexture(int minX, int minY, int maxX, int maxY)
+	{
+		if(minX >= maxX || minY >= maxY) return;
+
+		// The region is copied into the stream buffer so the
+		// driver can copy it to the texture asynchronously
+		int width = maxX - minX;
+		int height = maxY - minY;
+		unsigned char* pixels = (unsigned char*)uploadBuffer->map(width * height);
+		if(!pixels) return;
+		for(int y = 0; y < height; ++y)
+			memcpy(pixels + y*width, fogDeltaData + (minY + y)*fogMapSize + minX, width);
+		unsigned int offset = uploadBuffer->unmap();
+
+        glBindTexture(GL_TEXTURE_2D, fogMapTextureHandle);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+        glTexSubImage2D(GL_TEXTURE_2D, 0, minX, minY, width, height, GL_RED, GL_UNSIGNED_BYTE, reinterpret_cast<GLvoid*>(offset));
+        uploadBuffer->unbind();
+	}
+
+	// Number of pixels between two regions along the axis where they
+	// are furthest apart, 0 when they touch or overlap
+	static inline int rectDistance(int minX, int minY, int maxX, int maxY,
+			int otherMinX, int otherMinY, int otherMaxX, int otherMaxY)
+	{
+		int dx = std::max(otherMinX - maxX, minX - otherMaxX);
+		int dy = std::max(otherMinY - maxY, minY - otherMaxY);
+		int d = std::max(dx, dy);
+		return (d < 0 ? 0 : d);
+	}
+
+	void FogMap::markDirty(int minX, int minY, int maxX, int maxY)
+	{
+		if(minX >= maxX || minY >= maxY) return;
+
+		// Merging can make the region close to a region
+		// that was checked before, so start over after a merge
+		for(unsigned int i = 0; i < dirtyRects.size(); )
+		{
+			const DirtyRect& r = dirtyRects[i];
+			if(rectDistance(minX, minY, maxX, maxY, r.minX, r.minY, r.maxX, r.maxY) > DIRTY_MERGE_DISTANCE)
+			{
+				++i;
+				continue;
+			}
+			minX = std::min(minX, r.minX); minY = std::min(minY, r.minY);
+			maxX = std::max(maxX, r.maxX); maxY = std::max(maxY, r.maxY);
+			dirtyRects[i] = dirtyRects.back();
+			dirtyRects.pop_back();
+			i = 0;
+		}
+
+		// With too many regions the new one is merged with the closest
+		if(dirtyRects.size() >= MAX_DIRTY_RECTS)
+		{
+			unsigned int closest = 0;
+			int closestDistance = fogMapSize;
+			for(unsigned int i = 0; i < dirtyRects.size(); ++i)
+			{
+				const DirtyRect& r = dirtyRects[i];
+				int d = rectDistance(minX, minY, maxX, maxY, r.minX, r.minY, r.maxX, r.maxY);
+				if(d < closestDistance)
+				{
+					closest = i;
+					closestDistance = d;
+				}
+			}
+			DirtyRect r = dirtyRects[closest];
+			dirtyRects[closest] = dirtyRects.back();
+			dirtyRects.pop_back();
+			markDirty(std::min(minX, r.minX), std::min(minY, r.minY),
+					std::max(maxX, r.maxX), std::max(maxY, r.maxY));
+			return;
+		}
+
+		DirtyRect rect;
+		rect.minX = minX; rect.minY = minY;
+		rect.maxX = maxX; rect.maxY = maxY;
+		dirtyRects.push_back(rect);
 	}
 
 	void FogMap::addVisionary(Visionary* visionary)
@@ -95,6 +389,9 @@ namespace Arya
 		for(int i = 0; i < visionaries.size(); ++i)
 			if(visionaries[i] == visionary)
 			{
+				// What it saw becomes explored on the next update
+				if(visionary->stampRadius > 0)
+					markStampDirty(visionary);
 				visionaries.erase(visionaries.begin() + i);
 				return;
 			}
@@ -102,117 +399,104 @@ namespace Arya
 		LOG_INFO("Deleting visionary that is not registered");
 	}
 
-	inline int indexInArray(int x, int y, int r)
+	void FogMap::setLineOfSight(LineOfSight* los)
 	{
-		return ((r -y)*(2*r+1) + x + r);
-	}
-
-	void FogMap::precalculateBresenhemCircles()
-	{
-		// we want to save arrays for different sizes
-		// of width nxn that represent the circles.. 
-		// we then can change the fogmap per line.
-		//
-		// the ith bresenhemcircle will have size
-		// (2*i+1)*(2*i+1)
-		// As an example the first bresenhemcircle
-		// is given by
-		//
-		// 0 1 0
-		// 1 0 1
-		// 0 1 0
-		//
-		// which is then filled up such that it becomes
-		//		
-		// 0 1 0
-		// 1 1 1
-		// 0 1 0
-		//
-		// etc... 
-
-		bresenhemCircles = new unsigned char*[MAX_CIRCLE_SIZE];
-
-		for(int r = 1; r <= MAX_CIRCLE_SIZE; ++r)
+		if(los && (los->getGridSize() != fogMapSize || los->getWorldSize() != representedSize))
 		{
-			bresenhemCircles[r-1] = new unsigned char[(2*r+1)*(2*r+1)];
-			memset(bresenhemCircles[r-1], 0, sizeof(unsigned char) * (2*r+1)*(2*r+1));
-			// fill it
-			int x = r;
-			int y = 0;
-			while(x >= y)
-			{
-				bresenhemCircles[r-1][indexInArray(x, y, r)] = 1;
-				bresenhemCircles[r-1][indexInArray(y, x, r)] = 1;
-
-				bresenhemCircles[r-1][indexInArray(-x, y, r)] = 1;
-				bresenhemCircles[r-1][indexInArray(y, -x, r)] = 1;
+			LOG_WARNING("Line of sight grid does not match the fog map");
+			los = 0;
+		}
+		lineOfSight = los;
 
-				bresenhemCircles[r-1][indexInArray(x, -y, r)] = 1;
-				bresenhemCircles[r-1][indexInArray(-y, x, r)] = 1;
+		// All vision has to be stamped again
+		if(visibleBits)
+			memset(visibleBits, 0, sizeof(unsigned int)*bitplaneWords*fogMapSize);
+		markDirty(0, 0, fogMapSize, fogMapSize);
+	}
 
-				bresenhemCircles[r-1][indexInArray(-x, -y, r)] = 1;
-				bresenhemCircles[r-1][indexInArray(-y, -x, r)] = 1;
+	const vector<int>& FogMap::getCircleSpans(int radius)
+	{
+		if(radius >= (int)circleSpans.size())
+			circleSpans.resize(radius + 1);
 
-				y++;
-				if((2*((x*x + y*y - r*r) + (2*y + 1)) + (1 - 2*x)) > 0)
-					x--;
-			}
+		vector<int>& spans = circleSpans[radius];
+		if(spans.empty())
+		{
+			// Same shape as a filled midpoint circle: x^2 + y^2 <= r^2 + r
+			spans.resize(radius + 1);
+			for(int y = 0; y <= radius; ++y)
+				spans[y] = (int)sqrt((double)(radius*radius + radius - y*y));
+		}
+		return spans;
+	}
 
-			// scanline
-			for(int y = r; y >= -r; --y)
-			{
-				int p = 0;
-				for(int x = -r; x <= 0; ++x)
-					if(bresenhemCircles[r-1][indexInArray(x, y, r)] == 1)
-					{
-						p = x;
-						break;
-					}
-
-				for(int x = p+1; x < r + (-r-p); ++x)
-					bresenhemCircles[r-1][indexInArray(x, y, r)] = 1;
-			}
+	// Sets or clears bits [first, end) of a bitplane row
+	static inline void setBits(unsigned int* row, int first, int end)
+	{
+		int firstWord = first >> 5;
+		int lastWord = (end - 1) >> 5;
+		unsigned int firstMask = ~0u << (first & 31);
+		unsigned int lastMask = ~0u >> (31 - ((end - 1) & 31));
+		if(firstWord == lastWord)
+		{
+			row[firstWord] |= (firstMask & lastMask);
+			return;
+		}
+		row[firstWord] |= firstMask;
+		memset(row + firstWord + 1, 0xff, sizeof(unsigned int) * (lastWord - firstWord - 1));
+		row[lastWord] |= lastMask;
+	}
 
-			// for debug: 
-			/* cout << "------------ CIRCLE " << r << " -------------" << endl;
-			for(int i = 0; i < 2*r + 1; ++i)
-			{
-				for(int j = 0; j < 2*r + 1; ++j)
-					cout << (int)bresenhemCircles[r-1][i*(2*r+1) + j] << " ";
-				cout << endl;
-			} */
+	static inline void clearBits(unsigned int* row, int first, int end)
+	{
+		int firstWord = first >> 5;
+		int lastWord = (end - 1) >> 5;
+		unsigned int firstMask = ~0u << (first & 31);
+		unsigned int lastMask = ~0u >> (31 - ((end - 1) & 31));
+		if(firstWord == lastWord)
+		{
+			row[firstWord] &= ~(firstMask & lastMask);
+			return;
 		}
+		row[firstWord] &= ~firstMask;
+		memset(row + firstWord + 1, 0, sizeof(unsigned int) * (lastWord - firstWord - 1));
+		row[lastWord] &= ~lastMask;
 	}
 
 	void FogMap::clear()
 	{
-		//TODO: THIS IS VERY SLOW AND SUBUPTIMAL
-		//memset(fogData, 0, fogMapSize * fogMapSize);
-		for(int i = 0; i < fogMapSize * fogMapSize; ++i)
-			fogData[i] = fogData[i] > 0 ? 63 : 0;
+		// Everything that was visible becomes explored
+        memset(visibleBits, 0, sizeof(unsigned int)*bitplaneWords*fogMapSize);
+		markDirty(0, 0, fogMapSize, fogMapSize);
 	}
 
-	void FogMap::blur()
+	void FogMap::blur(int minX, int minY, int maxX, int maxY)
 	{
-		// 5 px gaussian blur
-		int px = 2;
-		for(int i = 0; i < fogMapSize; ++i)
-			for(int j = 0; j < fogMapSize; ++j)
-			{
-				int sum = 0;
-				int num = 0;
-				for(int dx = -px; dx <= px; ++dx)
-					for(int dy = -px; dy <= px; ++dy)
-					{
-						if((i + dy) * fogMapSize + (j + dx) < 0 ||
-							(i + dy) * fogMapSize + (j + dx) > fogMapSize * fogMapSize - 1)
-							continue;
-						num++;
-						sum += fogData[(i + dy) * fogMapSize + (j + dx)];
-					}
-				int average = sum / num;
-				fogDeltaData[i * fogMapSize + j] = (char)average;
-			}
+		if(minX >= maxX || minY >= maxY) return;
+
+		// Small regions are not worth waking the threads for
+		int bandCount = blurBands.size();
+		if((maxX - minX) * (maxY - minY) < BLUR_THREAD_MIN_PIXELS)
+			bandCount = 1;
+
+		// The bands only read fogData and write their own rows
+		int rowsPerBand = (maxY - minY + bandCount - 1) / bandCount;
+		for(int i = 0; i < bandCount; ++i)
+		{
+			FogBlurBand* band = blurBands[i];
+			band->firstRow = minY + i * rowsPerBand;
+			band->endRow = band->firstRow + rowsPerBand;
+			if(band->firstRow > maxY) band->firstRow = maxY;
+			if(band->endRow > maxY) band->endRow = maxY;
+			band->firstColumn = minX;
+			band->endColumn = maxX;
+		}
+
+		for(int i = 1; i < bandCount; ++i)
+			blurThreads[i-1]->launch();
+		blurBands[0]->run();
+		for(int i = 1; i < bandCount; ++i)
+			blurThreads[i-1]->wait();
 	}
 
 	void FogMap::update(float elapsedTime)
@@ -221,37 +505,112 @@ namespace Arya
 		if(fogUpdateTime < UPDATE_TIME)
 			return;
 		fogUpdateTime -= UPDATE_TIME;
-		clear();
-		for(int i = 0; i < visionaries.size(); ++i)
-			colorize(*visionaries[i]->pos, *visionaries[i]->radius);
 
-		blur();
-		updateTexture();
+		// Only visionaries that moved to another cell or
+		// changed their radius make a region dirty
+		for(unsigned int i = 0; i < visionaries.size(); ++i)
+		{
+			Visionary* v = visionaries[i];
+			int centerX, centerY;
+			positionToIndex(*v->pos, centerX, centerY);
+			int fogRadius = radiusToCells(*v->radius);
+			if(v->stampRadius == fogRadius && v->stampX == centerX && v->stampY == centerY)
+				continue;
+
+			if(v->stampRadius > 0)
+				markStampDirty(v);
+			v->stampX = centerX;
+			v->stampY = centerY;
+			v->stampRadius = fogRadius;
+			markStampDirty(v);
+		}
+
+		for(unsigned int i = 0; i < dirtyRects.size(); ++i)
+			updateRegion(dirtyRects[i]);
+		dirtyRects.clear();
 	}
 
-	void FogMap::colorize(vec2 position, float radius)
+	void FogMap::updateRegion(const DirtyRect& rect)
+	{
+		// The dirty region is cleared and every
+		// visionary that overlaps it is stamped again
+		for(int y = rect.minY; y < rect.maxY; ++y)
+			clearBits(visibleBits + y*bitplaneWords, rect.minX, rect.maxX);
+		for(unsigned int i = 0; i < visionaries.size(); ++i)
+			stamp(visionaries[i], rect.minX, rect.minY, rect.maxX, rect.maxY);
+		// Everything that is visible is explored
+		for(int y = rect.minY; y < rect.maxY; ++y)
+			for(int w = rect.minX >> 5; w <= (rect.maxX - 1) >> 5; ++w)
+				exploredBits[y*bitplaneWords + w] |= visibleBits[y*bitplaneWords + w];
+		updateShade(rect.minX, rect.minY, rect.maxX, rect.maxY);
+
+		// The blur reaches BLUR_RADIUS pixels out of the changed pixels
+		int minX = (rect.minX - BLUR_RADIUS < 0 ? 0 : rect.minX - BLUR_RADIUS);
+		int minY = (rect.minY - BLUR_RADIUS < 0 ? 0 : rect.minY - BLUR_RADIUS);
+		int maxX = (rect.maxX + BLUR_RADIUS > fogMapSize ? fogMapSize : rect.maxX + BLUR_RADIUS);
+		int maxY = (rect.maxY + BLUR_RADIUS > fogMapSize ? fogMapSize : rect.maxY + BLUR_RADIUS);
+		blur(minX, minY, maxX, maxY);
+		updateTexture(minX, minY, maxX, maxY);
+	}
+
+	int FogMap::radiusToCells(float radius)
 	{
-		int centerX, centerY;
-		positionToIndex(position, centerX, centerY);
 		int fogRadius = (int)(fogMapSize * (radius / representedSize));
+		if(fogRadius > fogMapSize)
+			fogRadius = fogMapSize;
+		if(fogRadius < 1)
+			fogRadius = 1;
+		return fogRadius;
+	}
+
+	void FogMap::markStampDirty(const Visionary* v)
+	{
+		int minX = (v->stampX - v->stampRadius < 0 ? 0 : v->stampX - v->stampRadius);
+		int minY = (v->stampY - v->stampRadius < 0 ? 0 : v->stampY - v->stampRadius);
+		int maxX = (v->stampX + v->stampRadius + 1 > fogMapSize ? fogMapSize : v->stampX + v->stampRadius + 1);
+		int maxY = (v->stampY + v->stampRadius + 1 > fogMapSize ? fogMapSize : v->stampY + v->stampRadius + 1);
+		markDirty(minX, minY, maxX, maxY);
+	}
+
+	void FogMap::stamp(const Visionary* v, int minX, int minY, int maxX, int maxY)
+	{
+		if(v->stampRadius <= 0) return;
+		int radius = v->stampRadius;
+		if(v->stampY + radius < minY || v->stampY - radius >= maxY) return;
+		if(v->stampX + radius < minX || v->stampX - radius >= maxX) return;
 
-		if(fogRadius > MAX_CIRCLE_SIZE)
+		if(lineOfSight)
 		{
-			LOG_WARNING("Radius not precalculated for r = " << fogRadius << " max value is " << MAX_CIRCLE_SIZE);
-			fogRadius = MAX_CIRCLE_SIZE;
+			lineOfSight->markVisible(v->stampX, v->stampY, radius, VISION_EYE_HEIGHT,
+					visibleBits, bitplaneWords, minX, minY, maxX, maxY);
+			return;
 		}
 
-		// update fog map per line
-		for(int j = centerY - fogRadius; j < centerY + fogRadius; ++j)
+		// Every row of the circle is one span of bits
+		const vector<int>& spans = getCircleSpans(radius);
+		for(int dy = -radius; dy <= radius; ++dy)
+		{
+			int y = v->stampY + dy;
+			if(y < minY || y >= maxY) continue;
+			int halfWidth = spans[dy < 0 ? -dy : dy];
+			int first = (v->stampX - halfWidth < minX ? minX : v->stampX - halfWidth);
+			int end = (v->stampX + halfWidth + 1 > maxX ? maxX : v->stampX + halfWidth + 1);
+			if(first >= end) continue;
+			setBits(visibleBits + y*bitplaneWords, first, end);
+		}
+	}
+
+	void FogMap::updateShade(int minX, int minY, int maxX, int maxY)
+	{
+		for(int y = minY; y < maxY; ++y)
 		{
-			if(j < 0 || j >= fogMapSize) continue;
-			for(int i = centerX - fogRadius; i < centerX + fogRadius; ++i)
+			const unsigned int* visible = visibleBits + y*bitplaneWords;
+			const unsigned int* explored = exploredBits + y*bitplaneWords;
+			unsigned char* shade = fogData + y*fogMapSize;
+			for(int x = minX; x < maxX; ++x)
 			{
-				if(i < 0 || i >= fogMapSize) continue;
-				if(bresenhemCircles[fogRadius-1][indexInArray(i - centerX, j - centerY, fogRadius)])
-					fogData[j*fogMapSize + i] = 255;
-//				fogData[j*fogMapSize + i] |= 
-//					bresenhemCircles[fogRadius-1][indexInArray(i - centerX, j - centerY, fogRadius)];
+				unsigned int bit = 1u << (x & 31);
+				shade[x] = (visible[x >> 5] & bit) ? 255 : ((explored[x >> 5] & bit) ? 63 : 0);
 			}
 		}
 	}
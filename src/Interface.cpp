@@ -6,6 +6,7 @@
 #include "Textures.h"
 #include "Overlay.h"
 #include "Shaders.h"
+#include "RenderQueue.h"
 #include "DrawableText.h"
 #include "common/Logger.h"
 #include <sstream>
@@ -210,11 +211,10 @@ namespace Arya
 		GLuint v = Interface::shared().getOnePxRectVAO();
 
 		p->use();
-		glBindVertexArray(v);
+		GLStateCache::shared().bindVertexArray(v);
 
 		p->setUniform1i("texture1", 0);
-		glActiveTexture(GL_TEXTURE0);
-		glBindTexture(GL_TEXTURE_2D, texture->handle);
+		GLStateCache::shared().bindTexture(0, texture->handle);
 		p->setUniform4fv("uColor", colorMask);
 
 		p->setUniform2fv("screenSize", screenSize);
@@ -248,11 +248,10 @@ namespace Arya
 
 		// font texture
 		p->setUniform1i("texture1", 0);
-		glActiveTexture(GL_TEXTURE0);
-		glBindTexture(GL_TEXTURE_2D, dt->getFont()->textureHandle);
+		GLStateCache::shared().bindTexture(0, dt->getFont()->textureHandle);
 
 		// vao
-		glBindVertexArray(dt->getVAO());
+		GLStateCache::shared().bindVertexArray(dt->getVAO());
 		glDrawArrays(GL_TRIANGLES, 0, dt->getVertexCount());
 	}
 
@@ -507,16 +506,16 @@ namespace Arya
 
 	void Interface::render()
 	{
-		glDisable(GL_DEPTH_TEST);
-		glEnable(GL_BLEND);
+		GLStateCache::shared().setDepthTest(false);
+		GLStateCache::shared().setBlend(true);
 
 		for(int i = 0; i < windowStack.size(); ++i)
 			windowStack[i]->draw();
 
 		overlay->render();
 
-		glDisable(GL_BLEND);
-		glEnable(GL_DEPTH_TEST);
+		GLStateCache::shared().setBlend(false);
+		GLStateCache::shared().setDepthTest(true);
 
 	}
 
@@ -0,0 +1,160 @@
+#include "LineOfSight.h"
+#include <math.h>
+
+namespace Arya
+{
+    LineOfSight::LineOfSight()
+    {
+        gridSize = 0;
+        worldSize = 1.0f;
+    }
+
+    LineOfSight::~LineOfSight()
+    {
+    }
+
+    void LineOfSight::init(const unsigned short* heights, int heightMapSize,
+            float terrainWidth, float terrainDepth, float heightScale,
+            int _gridSize, float _worldSize)
+    {
+        gridSize = _gridSize;
+        worldSize = _worldSize;
+        cellHeights.assign(gridSize * gridSize, 0.0f);
+        if(!heights || heightMapSize < 2 || gridSize <= 0) return;
+
+        //Heightmap sample per world unit
+        float samplesX = (heightMapSize - 1) / terrainWidth;
+        float samplesZ = (heightMapSize - 1) / terrainDepth;
+        float cellSize = worldSize / gridSize;
+
+        for(int cy = 0; cy < gridSize; ++cy)
+        {
+            //Samples covered by the cell, clamped to the terrain
+            float z0 = -0.5f*worldSize + cy*cellSize + 0.5f*terrainDepth;
+            int firstY = (int)floor(z0 * samplesZ);
+            int lastY = (int)floor((z0 + cellSize) * samplesZ);
+            if(firstY < 0) firstY = 0;
+            if(lastY > heightMapSize - 1) lastY = heightMapSize - 1;
+
+            for(int cx = 0; cx < gridSize; ++cx)
+            {
+                float x0 = -0.5f*worldSize + cx*cellSize + 0.5f*terrainWidth;
+                int firstX = (int)floor(x0 * samplesX);
+                int lastX = (int)floor((x0 + cellSize) * samplesX);
+                if(firstX < 0) firstX = 0;
+                if(lastX > heightMapSize - 1) lastX = heightMapSize - 1;
+
+                unsigned short highest = 0;
+                for(int y = firstY; y <= lastY; ++y)
+                    for(int x = firstX; x <= lastX; ++x)
+                        if(heights[y*heightMapSize + x] > highest)
+                            highest = heights[y*heightMapSize + x];
+                cellHeights[cy*gridSize + cx] = heightScale * (highest / 65535.0f);
+            }
+        }
+    }
+
+    bool LineOfSight::positionToCell(float x, float z, int& cellX, int& cellY) const
+    {
+        float fx = (x / worldSize + 0.5f) * gridSize;
+        float fy = (z / worldSize + 0.5f) * gridSize;
+        if(!(fx >= 0.0f && fy >= 0.0f && fx < gridSize && fy < gridSize))
+            return false;
+        cellX = (int)fx;
+        cellY = (int)fy;
+        return true;
+    }
+
+    void LineOfSight::markVisible(int centerX, int centerY, int radius, float eyeHeight,
+            unsigned int* bits, int wordsPerRow, int minX, int minY, int maxX, int maxY)
+    {
+        if(radius < 0) return;
+        if(minX < 0) minX = 0;
+        if(minY < 0) minY = 0;
+        if(maxX > gridSize) maxX = gridSize;
+        if(maxY > gridSize) maxY = gridSize;
+
+        int side = 2*radius + 1;
+        if(horizon.size() < (unsigned int)(side*side))
+            horizon.resize(side*side);
+        //Horizon of cell (dx, dy) relative to the center
+        float* h = &horizon[radius*side + radius];
+
+        float eye = getCellHeight(centerX, centerY) + eyeHeight;
+        int limit = radius*radius + radius; //same circle as the flat fog of war
+
+        if(centerX >= minX && centerX < maxX && centerY >= minY && centerY < maxY)
+            bits[centerY*wordsPerRow + (centerX >> 5)] |= 1u << (centerX & 31);
+
+        for(int ring = 1; ring <= radius; ++ring)
+        {
+            for(int dy = -ring; dy <= ring; ++dy)
+            {
+                //Only the first and last row of a ring are complete
+                int step = (dy == -ring || dy == ring ? 1 : 2*ring);
+                for(int dx = -ring; dx <= ring; dx += step)
+                {
+                    if(dx*dx + dy*dy > limit) continue;
+
+                    float slope = (getCellHeight(centerX + dx, centerY + dy) - eye) / sqrtf((float)(dx*dx + dy*dy));
+
+                    //Interpolate the horizon where the line to the center crosses the previous ring
+                    float previous = -1e30f;
+                    if(ring > 1)
+                    {
+                        int adx = (dx < 0 ? -dx : dx);
+                        int ady = (dy < 0 ? -dy : dy);
+                        if(adx >= ady)
+                        {
+                            int px = dx + (dx < 0 ? 1 : -1);
+                            float py = dy * (float)(adx - 1) / adx;
+                            int y0 = (int)floor(py);
+                            float f = py - y0;
+                            previous = h[y0*side + px];
+                            if(f > 0.0f) previous = (1.0f - f)*previous + f*h[(y0 + 1)*side + px];
+                        }
+                        else
+                        {
+                            int py = dy + (dy < 0 ? 1 : -1);
+                            float px = dx * (float)(ady - 1) / ady;
+                            int x0 = (int)floor(px);
+                            float f = px - x0;
+                            previous = h[py*side + x0];
+                            if(f > 0.0f) previous = (1.0f - f)*previous + f*h[py*side + x0 + 1];
+                        }
+                    }
+
+                    h[dy*side + dx] = (slope > previous ? slope : previous);
+                    if(slope < previous) continue;
+
+                    int x = centerX + dx;
+                    int y = centerY + dy;
+                    if(x >= minX && x < maxX && y >= minY && y < maxY)
+                        bits[y*wordsPerRow + (x >> 5)] |= 1u << (x & 31);
+                }
+            }
+        }
+    }
+
+    bool LineOfSight::canSee(int fromX, int fromY, float eyeHeight, int toX, int toY, float targetHeight) const
+    {
+        int dx = toX - fromX;
+        int dy = toY - fromY;
+        int steps = (dx < 0 ? -dx : dx);
+        if((dy < 0 ? -dy : dy) > steps) steps = (dy < 0 ? -dy : dy);
+        if(steps <= 1) return true;
+
+        float eye = getCellHeight(fromX, fromY) + eyeHeight;
+        float target = getCellHeight(toX, toY) + targetHeight - eye;
+
+        //The terrain at step i blocks when its slope is above the slope to the target
+        for(int i = 1; i < steps; ++i)
+        {
+            int x = fromX + (int)floor(dx * (float)i / steps + 0.5f);
+            int y = fromY + (int)floor(dy * (float)i / steps + 0.5f);
+            if((getCellHeight(x, y) - eye) * steps > target * i)
+                return false;
+        }
+        return true;
+    }
+}
@@ -27,8 +27,9 @@ namespace Arya
 			str >> type >> a >> b >> c >> d;
 			FileSystem::shared().releaseFile(mattyfile);
 		}
-		Material* result=new Material(name , TextureManager::shared().getTexture(filename), type, a, b, c, d);
-		addResource(filename, result);
+		//Unpinned: the texture is unloaded together with the last material that uses it
+		Material* result=new Material(name , TextureManager::shared().getUnpinnedTexture(filename), type, a, b, c, d);
+		addResource(filename, result, sizeof(Material));
 		return result;
 	}
 
@@ -6,40 +6,61 @@ namespace Arya
     Mesh::Mesh()
     {
         frameCount = 0;
-        vaoHandles = 0;
+        vaoHandle = 0;
         vertexBuffer = 0;
+        frameBuffer = 0;
+        frameTexture = 0;
         vertexCount = 0;
         indexBuffer = 0;
         indexCount = 0;
         primitiveType = 0;
         refCount = 0;
         materialIndex = 0;
+        compressed = false;
+        positionOffset = vec3(0.0f);
+        positionScale = vec3(1.0f);
+        skinned = false;
+        vertexFormat = -1;
+        geometry = 0;
     }
 
     Mesh::~Mesh()
     {
-        if(vaoHandles)
-        {
-            glDeleteVertexArrays(frameCount, vaoHandles);
-            delete[] vaoHandles;
-        }
+        if(vaoHandle)
+            glDeleteVertexArrays(1, &vaoHandle);
         if(indexBuffer)
             glDeleteBuffers(1, &indexBuffer);
         if(vertexBuffer)
             glDeleteBuffers(1, &vertexBuffer);
+        if(frameTexture)
+            glDeleteTextures(1, &frameTexture);
+        if(frameBuffer)
+            glDeleteBuffers(1, &frameBuffer);
+        if(geometry)
+            delete geometry;
     }
 
-    void Mesh::createVAOs(int count)
+    void Mesh::createVAO()
     {
-        //Delete old handles if they existed
-        if(vaoHandles)
-        {
-            glDeleteVertexArrays(frameCount, vaoHandles);
-            delete[] vaoHandles;
-        }
-        frameCount = count;
-        vaoHandles = new GLuint[frameCount];
+        //Delete old handle if it existed
+        if(vaoHandle)
+            glDeleteVertexArrays(1, &vaoHandle);
+        glGenVertexArrays(1, &vaoHandle);
+    }
+
+    void Mesh::createFrameTexture(const void* data, int size)
+    {
+        if(frameTexture) glDeleteTextures(1, &frameTexture);
+        if(frameBuffer) glDeleteBuffers(1, &frameBuffer);
+
+        glGenBuffers(1, &frameBuffer);
+        glBindBuffer(GL_TEXTURE_BUFFER, frameBuffer);
+        glBufferData(GL_TEXTURE_BUFFER, size, data, GL_STATIC_DRAW);
+        glBindBuffer(GL_TEXTURE_BUFFER, 0);
 
-        glGenVertexArrays(frameCount, vaoHandles);
+        glGenTextures(1, &frameTexture);
+        glBindTexture(GL_TEXTURE_BUFFER, frameTexture);
+        glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA16UI, frameBuffer);
+        glBindTexture(GL_TEXTURE_BUFFER, 0);
     }
 }
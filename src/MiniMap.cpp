@@ -7,6 +7,7 @@
 #include "Terrain.h"
 #include "FogMap.h"
 #include "Camera.h"
+#include "StreamBuffer.h"
 
 #include <glm/glm.hpp>
 using glm::vec2;
@@ -19,7 +20,8 @@ namespace Arya
 {
 	MiniMap::MiniMap()
 	{
-		cameraCornersVBO = 0;
+		cameraCornersBuffer = 0;
+		cameraCornersFirst = 0;
 		cameraCornersVAO = 0;
 		screenVAO = 0;
 		mmFrameBufferObject = 0;
@@ -37,6 +39,7 @@ namespace Arya
 		if(mmWindow) delete mmWindow;
 		if(mmProgram) delete mmProgram;
 		if(mmCameraLinesProgram) delete mmCameraLinesProgram;
+		if(cameraCornersBuffer) delete cameraCornersBuffer;
 	}
 
 	GLuint MiniMap::getMMTextureHandle() const
@@ -147,16 +150,16 @@ namespace Arya
 			 0.5f, -0.5f
 		};
 
-		glGenBuffers(1, &cameraCornersVBO);
-		glBindBuffer(GL_ARRAY_BUFFER, cameraCornersVBO);
-		glBufferData(GL_ARRAY_BUFFER,
-				sizeof(cameraVertices),
-				cameraVertices,
-				GL_DYNAMIC_DRAW);
+		// New corners are appended every update
+		cameraCornersBuffer = new StreamBuffer;
+		if(!cameraCornersBuffer->init(GL_ARRAY_BUFFER, 64 * sizeof(cameraVertices)))
+			return false;
+		setCameraCorners(cameraVertices);
 
 		glGenVertexArrays(1, &cameraCornersVAO);
 		glBindVertexArray(cameraCornersVAO);
 		glEnableVertexAttribArray(0);
+		glBindBuffer(GL_ARRAY_BUFFER, cameraCornersBuffer->getHandle());
 		glVertexAttribPointer(0, 2, GL_FLOAT, false, 0, (void*)0);
 
 		glBindVertexArray(0);
@@ -185,15 +188,21 @@ namespace Arya
 			relativePos.x + 0.1f, relativePos.y - 0.1f
 		};
 
-		glBindBuffer(GL_ARRAY_BUFFER, cameraCornersVBO);
-		glBufferData(GL_ARRAY_BUFFER,
-				sizeof(cameraVertices),
-				cameraVertices,
-				GL_DYNAMIC_DRAW);
+		setCameraCorners(cameraVertices);
 
 		render(scene);
 	}
 
+	void MiniMap::setCameraCorners(const GLfloat* cameraVertices)
+	{
+		GLfloat* data = (GLfloat*)cameraCornersBuffer->map(8 * sizeof(GLfloat));
+		if(!data) return;
+		for(int i = 0; i < 8; ++i)
+			data[i] = cameraVertices[i];
+		// The offset is 16 byte aligned, so a whole number of vertices
+		cameraCornersFirst = cameraCornersBuffer->unmap() / (2 * sizeof(GLfloat));
+	}
+
 	void MiniMap::render(Scene* scene)
 	{
         glBindFramebuffer(GL_FRAMEBUFFER, mmFrameBufferObject);
@@ -218,7 +227,7 @@ namespace Arya
 
 		mmCameraLinesProgram->use();
 		glBindVertexArray(cameraCornersVAO);
-		glDrawArrays(GL_LINE_LOOP, 0, 4);
+		glDrawArrays(GL_LINE_LOOP, cameraCornersFirst, 4);
 
         glBindFramebuffer(GL_FRAMEBUFFER, 0);
         glViewport(0, 0, Root::shared().getWindowWidth(), Root::shared().getWindowHeight());
@@ -3,14 +3,18 @@
 #include "Files.h"
 #include "Materials.h"
 #include "common/Logger.h"
+#include "RenderQueue.h"
+#include "ModelFormat.h"
 #include <string>
+#include <string.h>
 #include <map>
 
+//Version 1 files, see ModelManager::parseLegacyModel
 typedef struct{
     int materialIndex;
     int primitiveType;
     int vertexCount; //per frame
-    int hasNormals;
+    int vertexFormat; //see ModelVertexFormat. Was hasNormals, so 0 and 1 keep their meaning
     int indexCount;
     int bufferOffset;
     int indexbufferOffset;
@@ -27,114 +31,58 @@ typedef struct{
 
 #define ARYAMAGICINT (('A' << 0) | ('r' << 8) | ('M' << 16) | ('o' << 24))
 
+//Bone animated version 1 models (modeltype 3) have a skeleton after the bounding box:
+//  int boneCount
+//  boneCount ints: the parent of every bone, -1 for a root.
+//      Parents come before their children
+//  boneCount times 16 floats: the inverse bind matrix (column major)
+//  frameCount times boneCount times 7 floats: translation xyz and
+//      rotation quaternion xyzw of the bone relative to its parent
+//The frames in the header and the animations refer to these key frames
+#define MAX_BONES 256
+
 namespace Arya
 {
-    //The different animation states
-    //These classes are declared here
-    //so that the rest of the engine
-    //only has to know the base class
-
-    struct VertexAnim
+    class VertexAnimationData : public AnimationData
     {
-        int startFrame; //inclusive
-        int endFrame; //inclusive
-        vector<float> frameTimes; //size = end - start + 1
+        public:
+            vector<AnimationClip> clips;
+            map<string, int> clipIds;
     };
+    typedef std::map<string,int>::const_iterator clipIdIterator;
 
-    class VertexAnimationData : public AnimationData
+    struct BoneKey
     {
-        public:
-            map<string, VertexAnim> animations;
+        vec3 translation;
+        glm::vec4 rotation; //quaternion xyzw
     };
-    typedef std::pair<string,VertexAnim> animMapType;
-    typedef std::map<string,VertexAnim>::iterator animMapIterator;
 
-    class VertexAnimationState : public AnimationState
+    class BoneAnimationData : public VertexAnimationData
     {
         public:
-            VertexAnimationState(VertexAnimationData* data)
-            {
-                animData = data;
-                curAnim = 0;
-                startFrame = 0;
-                curFrame = 0;
-                timer = 0.0f;
-                interpolation = 0.0f;
-                speedFactor = 1.0f;
-            }
-            ~VertexAnimationState() {}
-
-            //Base class overloads
-            void setAnimation(std::string name)
-            {
-                if(!animData) return;
-                animMapIterator anim = animData->animations.find(name);
-                if(anim == animData->animations.end())
-                {
-                    LOG_WARNING("Animation not found: " << name);
-                    return;
-                }
-                if(curAnim == &anim->second) return;
-                curAnim = &anim->second;
-                startFrame = curAnim->startFrame;
-                curFrame = 0;
-                timer = 0.0f;
-                interpolation = 0.0f;
-                speedFactor = 1.0f;
-            }
-
-            void updateAnimation(float elapsedTime)
-            {
-                if(!curAnim) return;
-
-                timer += elapsedTime * speedFactor;
-
-                //Advance frames
-                //It is a loop because it is possible to skip more
-                //frames if frametimes are short, or the update is
-                //over a large time
-                while(timer > curAnim->frameTimes[curFrame])
-                {
-                    timer -= curAnim->frameTimes[curFrame];
-                    curFrame++;
-                    if(curFrame > (curAnim->endFrame - curAnim->startFrame)) curFrame = 0;
-                }
-                interpolation = timer / curAnim->frameTimes[curFrame];
-            }
-
-            int getCurFrame(){ return startFrame + curFrame; }
-            float getInterpolation(){ return interpolation; }
-
-            float getAnimationTime()
-            {
-                if(!curAnim) return 0.0f;
-
-                float time = 0.0f;
-                for(int i = 0; i <= (curAnim->endFrame - curAnim->startFrame); ++i)
-                {
-                    time += curAnim->frameTimes[i];
-                }
-                return time;
-            }
-
-            void setAnimationTime(float newTime)
-            {
-                if(newTime > 0.0001)
-                    speedFactor = getAnimationTime() / newTime;
-            }
-
-        private:
-            VertexAnimationData* animData;
-
-            VertexAnim* curAnim; //one of the animations in animData
+            int boneCount;
+            int frameCount;
+            vector<int> parents;
+            vector<mat4> inverseBind;
+            vector<BoneKey> keys; //frameCount * boneCount
+    };
 
-            int startFrame;
-            int curFrame; //current frame RELATIVE TO STARTFRAME
-            float timer;
-            float interpolation; //in range [0,1]
-            float speedFactor;
+    struct SubmeshSource
+    {
+        int materialIndex;
+        int primitiveType;
+        int vertexCount; //per frame
+        int vertexFormat; //ModelVertexFormat
+        int frameCount; //1 for skinned meshes
+        int indexCount;
+        const char* vertexData; //in the model file
+        const char* indexData; //0 when indexCount is 0
+        //Simplified levels, from fine to coarse
+        vector<const char*> lodIndexData;
+        vector<int> lodIndexCount;
     };
 
+
     Model::Model()
     {
 		minX = 0.0f;
@@ -145,6 +93,7 @@ namespace Arya
 		maxZ = 0.0f;
         refCount = 0;
         animationData = 0;
+        lodErrors.push_back(0.0f);
     }
 
     Model::~Model()
@@ -157,16 +106,82 @@ namespace Arya
                 delete meshes[i];
             }
         }
+        for(unsigned int i = 0; i < materials.size(); ++i)
+        {
+            if(materials[i]) materials[i]->release();
+        }
+        if(animationData) delete animationData;
     }
 
-    AnimationState* Model::createAnimationState()
+    int Model::getAnimationCount() const
     {
-        if(animationData == 0) return 0;
-        //If bone, create BoneAnimationState
-        //If vertex, create VertexAnimationState
-        //else return 0
-        if(modelType == VertexAnimated) return new VertexAnimationState((VertexAnimationData*)animationData);
-        return 0;
+        if(!animationData) return 0;
+        return ((VertexAnimationData*)animationData)->clips.size();
+    }
+
+    int Model::getAnimationId(const std::string& name) const
+    {
+        if(!animationData) return -1;
+        const VertexAnimationData* data = (const VertexAnimationData*)animationData;
+        clipIdIterator iter = data->clipIds.find(name);
+        if(iter == data->clipIds.end()) return -1;
+        return iter->second;
+    }
+
+    const AnimationClip* Model::getAnimation(int id) const
+    {
+        if(!animationData) return 0;
+        const VertexAnimationData* data = (const VertexAnimationData*)animationData;
+        if(id < 0 || id >= (int)data->clips.size()) return 0;
+        return &data->clips[id];
+    }
+
+    int Model::getBoneCount() const
+    {
+        if(modelType != BoneAnimated || !animationData) return 0;
+        return ((BoneAnimationData*)animationData)->boneCount;
+    }
+
+    void Model::evaluatePose(int frame, int nextFrame, float interpolation, vec4* palette) const
+    {
+        if(modelType != BoneAnimated || !animationData) return;
+        const BoneAnimationData* data = (const BoneAnimationData*)animationData;
+        const int boneCount = data->boneCount;
+        if(frame < 0 || frame >= data->frameCount) frame = 0;
+        if(nextFrame < 0 || nextFrame >= data->frameCount) nextFrame = frame;
+
+        const BoneKey* keys0 = &data->keys[frame * boneCount];
+        const BoneKey* keys1 = &data->keys[nextFrame * boneCount];
+
+        static vector<mat4> globalPose;
+        globalPose.resize(boneCount);
+        for(int b = 0; b < boneCount; ++b)
+        {
+            vec3 t = keys0[b].translation + (keys1[b].translation - keys0[b].translation) * interpolation;
+
+            //Normalized lerp along the shortest path
+            vec4 q0 = keys0[b].rotation;
+            vec4 q1 = keys1[b].rotation;
+            if(q0.x*q1.x + q0.y*q1.y + q0.z*q1.z + q0.w*q1.w < 0.0f) q1 *= -1.0f;
+            vec4 q = q0 + (q1 - q0) * interpolation;
+            float length = glm::sqrt(q.x*q.x + q.y*q.y + q.z*q.z + q.w*q.w);
+            if(length > 0.0f) q /= length;
+            else q = vec4(0.0f, 0.0f, 0.0f, 1.0f);
+
+            mat4 local(
+                1.0f - 2.0f*(q.y*q.y + q.z*q.z), 2.0f*(q.x*q.y + q.w*q.z), 2.0f*(q.x*q.z - q.w*q.y), 0.0f,
+                2.0f*(q.x*q.y - q.w*q.z), 1.0f - 2.0f*(q.x*q.x + q.z*q.z), 2.0f*(q.y*q.z + q.w*q.x), 0.0f,
+                2.0f*(q.x*q.z + q.w*q.y), 2.0f*(q.y*q.z - q.w*q.x), 1.0f - 2.0f*(q.x*q.x + q.y*q.y), 0.0f,
+                t.x, t.y, t.z, 1.0f);
+
+            int parent = data->parents[b];
+            globalPose[b] = (parent >= 0 ? globalPose[parent] * local : local);
+
+            //The rows of the top 3x4 part of the skinning matrix
+            mat4 skin = globalPose[b] * data->inverseBind[b];
+            for(int r = 0; r < 3; ++r)
+                palette[3*b + r] = vec4(skin[0][r], skin[1][r], skin[2][r], skin[3][r]);
+        }
     }
 
     void Model::addMesh(Mesh* mesh)
@@ -198,7 +213,7 @@ namespace Arya
         //to put it in the array because
         //Meshes refer to this array by index!
         materials.push_back(mat);
-        //if(mat) mat->addRef();
+        if(mat) mat->addRef();
     }
 
     Mesh* Model::createAndAddMesh()
@@ -212,6 +227,7 @@ namespace Arya
 
     ModelManager::ModelManager()
     {
+        validateFiles = false;
     }
 
     ModelManager::~ModelManager()
@@ -221,8 +237,8 @@ namespace Arya
 
     bool ModelManager::initialize()
     {
-        addResource("triangle", new Triangle);
-        addResource("quad", new Quad);
+        addResource("triangle", new Triangle, 0, true);
+        addResource("quad", new Quad, 0, true);
         return true;
     }
 
@@ -231,228 +247,996 @@ namespace Arya
         unloadAll();
     }
 
-    Model* ModelManager::loadResource(std::string filename)
+    //Octahedral encoding of a unit normal into two signed bytes
+    static void octEncode(float x, float y, float z, signed char* out)
     {
-        File* modelfile = FileSystem::shared().getFile(string("models/") + filename);
-        if( modelfile == 0 ) return 0;
-
-        //Note: except for the first magic int
-        //this loader does not check the integrity of the data
-        //This means that it could crash on invalid files
+        float length = glm::abs(x) + glm::abs(y) + glm::abs(z);
+        if(length <= 0.0f){ out[0] = out[1] = 0; return; }
+        float u = x / length;
+        float v = y / length;
+        if(z < 0.0f)
+        {
+            float foldedU = (1.0f - glm::abs(v)) * (u >= 0.0f ? 1.0f : -1.0f);
+            float foldedV = (1.0f - glm::abs(u)) * (v >= 0.0f ? 1.0f : -1.0f);
+            u = foldedU;
+            v = foldedV;
+        }
+        out[0] = (signed char)glm::floor(u * 127.0f + 0.5f);
+        out[1] = (signed char)glm::floor(v * 127.0f + 0.5f);
+    }
 
-        char* pointer = modelfile->getData();
+    //Converts the frames of an animated mesh in one of the float
+    //formats to the compressed format. Positions are quantized
+    //to the bounding box of the mesh, which is returned
+    static void compressFrames(const GLfloat* data, int vertexCount, int frameCount, bool hasNormals,
+            vector<GLfloat>& texCoords, vector<GLushort>& frames, vec3& boxMin, vec3& boxMax)
+    {
+        const int floatCount = hasNormals ? 8 : 5;
+        const int totalCount = vertexCount * frameCount;
 
-        AryaHeader* header = (AryaHeader*)pointer;
+        boxMin = vec3(data[0], data[1], data[2]);
+        boxMax = boxMin;
+        for(int i = 0; i < totalCount; ++i)
+        {
+            const GLfloat* v = data + i * floatCount;
+            boxMin = vec3(glm::min(boxMin.x, v[0]), glm::min(boxMin.y, v[1]), glm::min(boxMin.z, v[2]));
+            boxMax = vec3(glm::max(boxMax.x, v[0]), glm::max(boxMax.y, v[1]), glm::max(boxMax.z, v[2]));
+        }
+        vec3 boxSize = boxMax - boxMin;
+        vec3 quantScale(boxSize.x > 0.0f ? 65535.0f / boxSize.x : 0.0f,
+                boxSize.y > 0.0f ? 65535.0f / boxSize.y : 0.0f,
+                boxSize.z > 0.0f ? 65535.0f / boxSize.z : 0.0f);
+
+        //The texture coordinates of the first frame are used for all frames
+        texCoords.resize(vertexCount * 2);
+        for(int i = 0; i < vertexCount; ++i)
+        {
+            texCoords[2*i + 0] = data[i * floatCount + 3];
+            texCoords[2*i + 1] = data[i * floatCount + 4];
+        }
 
-        Model* model = 0;
+        frames.resize(totalCount * 4);
+        for(int i = 0; i < totalCount; ++i)
+        {
+            const GLfloat* v = data + i * floatCount;
+            GLushort* out = &frames[4*i];
+            out[0] = (GLushort)((v[0] - boxMin.x) * quantScale.x + 0.5f);
+            out[1] = (GLushort)((v[1] - boxMin.y) * quantScale.y + 0.5f);
+            out[2] = (GLushort)((v[2] - boxMin.z) * quantScale.z + 0.5f);
+            if(hasNormals)
+                octEncode(v[5], v[6], v[7], reinterpret_cast<signed char*>(out + 3));
+            else
+                out[3] = 0; //decodes to (0,0,1)
+        }
+    }
 
-        do{ //for easy break on errors
+    //Inverse of octEncode, as in staticmodel.vert
+    static vec3 octDecode(signed char ex, signed char ey)
+    {
+        float x = glm::max(ex / 127.0f, -1.0f);
+        float y = glm::max(ey / 127.0f, -1.0f);
+        vec3 n(x, y, 1.0f - glm::abs(x) - glm::abs(y));
+        if(n.z < 0.0f)
+        {
+            float nx = (1.0f - glm::abs(y)) * (x >= 0.0f ? 1.0f : -1.0f);
+            float ny = (1.0f - glm::abs(x)) * (y >= 0.0f ? 1.0f : -1.0f);
+            n.x = nx;
+            n.y = ny;
+        }
+        return glm::normalize(n);
+    }
 
-            if( (modelfile->getSize() < sizeof(AryaHeader) + sizeof(SubmeshInfo)) || header->magic != ARYAMAGICINT )
+    //Decodes the vertices and the level 0 indices of a static mesh
+    //in one of the plain vertex formats. The positionOffset and
+    //positionScale of compressed meshes have to be set
+    static MeshGeometry* createMeshGeometry(const Mesh* mesh, const SubmeshSource& submesh)
+    {
+        const int vertexCount = mesh->vertexCount;
+        MeshGeometry* geometry = new MeshGeometry;
+        geometry->positions.resize(vertexCount);
+        geometry->texCoords.resize(vertexCount);
+        //Meshes without normals get the same normal as from
+        //the disabled attribute in the instanced path
+        geometry->normals.assign(vertexCount, vec3(0.0f));
+        if(submesh.vertexFormat == VERTEX_FORMAT_COMPRESSED)
+        {
+            const char* texCoords = submesh.vertexData;
+            const char* packed = texCoords + vertexCount * 2 * sizeof(GLfloat);
+            for(int v = 0; v < vertexCount; ++v)
             {
-                LOG_ERROR("Not a valid Arya model file: " << filename);
-                break;
+                GLfloat uv[2];
+                GLushort p[4];
+                memcpy(uv, texCoords + v * sizeof(uv), sizeof(uv));
+                memcpy(p, packed + v * sizeof(p), sizeof(p));
+                geometry->texCoords[v] = vec2(uv[0], uv[1]);
+                geometry->positions[v] = mesh->positionOffset + mesh->positionScale * (vec3(p[0], p[1], p[2]) / 65535.0f);
+                geometry->normals[v] = octDecode((signed char)(p[3] & 0xff), (signed char)(p[3] >> 8));
             }
+        }
+        else
+        {
+            const int floats = (submesh.vertexFormat == VERTEX_FORMAT_FLOAT ? 5 : 8);
+            for(int v = 0; v < vertexCount; ++v)
+            {
+                GLfloat f[8];
+                memcpy(f, submesh.vertexData + v * floats * sizeof(GLfloat), floats * sizeof(GLfloat));
+                geometry->positions[v] = vec3(f[0], f[1], f[2]);
+                geometry->texCoords[v] = vec2(f[3], f[4]);
+                if(floats == 8)
+                    geometry->normals[v] = vec3(f[5], f[6], f[7]);
+            }
+        }
 
-            if( header->modeltype < 1 || header->modeltype > 2 )
+        //The indices were checked by the parser
+        if(submesh.indexCount > 0)
+        {
+            geometry->indices.resize(submesh.indexCount);
+            memcpy(&geometry->indices[0], submesh.indexData, submesh.indexCount * sizeof(GLuint));
+        }
+        else
+        {
+            geometry->indices.resize(vertexCount);
+            for(int v = 0; v < vertexCount; ++v)
+                geometry->indices[v] = v;
+        }
+        return geometry;
+    }
+
+    //Bytes of vertex data of a submesh, 0 for unknown formats
+    static unsigned long long vertexDataSize(int vertexFormat, int vertexCount, int frameCount)
+    {
+        const unsigned long long vertices = (unsigned long long)vertexCount;
+        switch(vertexFormat)
+        {
+            case VERTEX_FORMAT_FLOAT: return vertices * frameCount * 5 * sizeof(GLfloat);
+            case VERTEX_FORMAT_FLOAT_NORMALS: return vertices * frameCount * 8 * sizeof(GLfloat);
+            case VERTEX_FORMAT_COMPRESSED: return vertices * 2 * sizeof(GLfloat) + vertices * frameCount * 4 * sizeof(GLushort);
+            case VERTEX_FORMAT_SKINNED: return vertices * (8 * sizeof(GLfloat) + 8);
+            default: break;
+        }
+        return 0;
+    }
+
+    //Checks the submesh fields that do not depend on the file version
+    static bool checkSubmesh(const SubmeshSource& submesh, int materialCount, bool hasSkeleton, const string& filename)
+    {
+        if(submesh.vertexFormat < VERTEX_FORMAT_FLOAT || submesh.vertexFormat > VERTEX_FORMAT_SKINNED)
+        {
+            LOG_ERROR("Arya model with unknown vertex format " << submesh.vertexFormat << ": " << filename);
+            return false;
+        }
+        if(submesh.vertexFormat == VERTEX_FORMAT_SKINNED && !hasSkeleton)
+        {
+            LOG_ERROR("Arya model with skinned mesh but without skeleton: " << filename);
+            return false;
+        }
+        if(submesh.vertexCount < 0 || submesh.indexCount < 0
+                || submesh.primitiveType < GL_POINTS || submesh.primitiveType > GL_TRIANGLE_FAN
+                || submesh.materialIndex < 0 || submesh.materialIndex >= materialCount)
+        {
+            LOG_ERROR("Arya model with invalid submesh: " << filename);
+            return false;
+        }
+        return true;
+    }
+
+    //Adds a clip, unless its frames are invalid or the name is already used
+    static void addAnimation(VertexAnimationData* animData, const string& name, int startFrame, int endFrame,
+            const float* frameTimes, int frameCount)
+    {
+        if( startFrame < 0 || startFrame >= frameCount || endFrame < startFrame || endFrame >= frameCount )
+        {
+            AryaLogger << "(not enough frames) ";
+            return;
+        }
+        if( animData->clipIds.find(name) != animData->clipIds.end() ) return;
+
+        AnimationClip newAnim;
+        newAnim.startFrame = startFrame;
+        newAnim.endFrame = endFrame;
+        newAnim.length = 0.0f;
+        for(int i = 0; i <= endFrame - startFrame; ++i)
+        {
+            //Zero length frames would never be left
+            float frameTime = frameTimes[i];
+            if(!(frameTime >= 0.0001f)) frameTime = 0.0001f;
+            newAnim.frameTimes.push_back(frameTime);
+            newAnim.frameStarts.push_back(newAnim.length);
+            newAnim.length += frameTime;
+        }
+        animData->clipIds.insert(std::make_pair(name, (int)animData->clips.size()));
+        animData->clips.push_back(newAnim);
+    }
+
+    //parents is boneCount ints, inverseBind boneCount times 16 floats and
+    //keys frameCount times boneCount times 7 floats. They do not have to be aligned
+    static bool readSkeleton(BoneAnimationData* boneData, int boneCount, int frameCount,
+            const char* parents, const char* inverseBind, const char* keys, const string& filename)
+    {
+        if(boneCount < 1 || boneCount > MAX_BONES)
+        {
+            LOG_ERROR("Arya model with invalid number of bones: " << boneCount);
+            return false;
+        }
+        boneData->boneCount = boneCount;
+        boneData->frameCount = frameCount;
+
+        boneData->parents.resize(boneCount);
+        memcpy(&boneData->parents[0], parents, boneCount * sizeof(int));
+        for(int b = 0; b < boneCount; ++b)
+        {
+            if(boneData->parents[b] >= b || boneData->parents[b] < -1)
             {
-                LOG_ERROR("Arya model with unkown modeltype: " << header->modeltype);
-                break;
+                LOG_ERROR("Arya model with bones that come before their parent: " << filename);
+                return false;
             }
+        }
+
+        boneData->inverseBind.resize(boneCount);
+        for(int b = 0; b < boneCount; ++b)
+        {
+            float m[16];
+            memcpy(m, inverseBind + b * sizeof(m), sizeof(m));
+            boneData->inverseBind[b] = mat4(m[0], m[1], m[2], m[3], m[4], m[5], m[6], m[7],
+                    m[8], m[9], m[10], m[11], m[12], m[13], m[14], m[15]);
+        }
+
+        boneData->keys.resize(frameCount * boneCount);
+        for(unsigned int k = 0; k < boneData->keys.size(); ++k)
+        {
+            float key[7];
+            memcpy(key, keys + k * sizeof(key), sizeof(key));
+            boneData->keys[k].translation = vec3(key[0], key[1], key[2]);
+            boneData->keys[k].rotation = vec4(key[3], key[4], key[5], key[6]);
+        }
+        LOG_INFO("Model has " << boneCount << " bones");
+        return true;
+    }
 
-            if( header->frameCount < 1 )
+    //The frame that follows every frame. Normally that is the
+    //next one, but the endFrame of an animation is followed by its startFrame
+    static void computeNextFrames(const VertexAnimationData* animData, int frameCount, vector<int>& nextFrames)
+    {
+        nextFrames.resize(frameCount);
+        for(int f = 0; f < frameCount; ++f)
+        {
+            int nextf = (f+1)%frameCount;
+            if(animData)
             {
-                LOG_ERROR("Arya model with invalid number of frames: " << header->frameCount);
-                break;
+                for(unsigned int c = 0; c < animData->clips.size(); ++c)
+                {
+                    if( animData->clips[c].endFrame == f )
+                    {
+                        nextf = animData->clips[c].startFrame;
+                        break;
+                    }
+                }
             }
+            nextFrames[f] = nextf;
+        }
+    }
 
-            model = new Model;
+    static unsigned int sectionElementSize(unsigned int type)
+    {
+        switch(type)
+        {
+            case MODEL_SECTION_STRINGS: return 1;
+            case MODEL_SECTION_MATERIALS: return sizeof(ModelFileName);
+            case MODEL_SECTION_ANIMATIONS: return sizeof(ModelFileAnimation);
+            case MODEL_SECTION_FRAME_TIMES: return sizeof(float);
+            case MODEL_SECTION_SUBMESHES: return sizeof(ModelFileSubmesh);
+            case MODEL_SECTION_VERTICES: return 1;
+            case MODEL_SECTION_INDICES: return sizeof(GLuint);
+            case MODEL_SECTION_BONE_PARENTS: return sizeof(int);
+            case MODEL_SECTION_BONE_INVERSE_BIND: return 16 * sizeof(float);
+            case MODEL_SECTION_BONE_KEYS: return 7 * sizeof(float);
+            case MODEL_SECTION_LODS: return sizeof(ModelFileLOD);
+            default: break;
+        }
+        return 0; //unknown, not checked
+    }
 
-            model->modelType = (ModelType)header->modeltype;
-            LOG_INFO("Loading model " << filename << " with " << header->submeshCount << " meshes.");
-            //Parse all materials
-            pointer += sizeof(AryaHeader);
-            pointer += header->submeshCount*sizeof(SubmeshInfo);
+    //Out of range indices would make the GPU read outside the buffer
+    static bool checkIndices(const char* indexData, int indexCount, int vertexCount)
+    {
+        const GLuint* indices = reinterpret_cast<const GLuint*>(indexData);
+        GLuint maxIndex = 0;
+        for(int i = 0; i < indexCount; ++i)
+            if(indices[i] > maxIndex) maxIndex = indices[i];
+        return (indexCount == 0 || maxIndex < (GLuint)vertexCount);
+    }
+
+    //Returns 0 when the name is not inside the string section
+    static const char* getSectionName(const ModelFileName& name, const char* strings, unsigned int stringsSize)
+    {
+        if(!strings || name.length >= stringsSize || name.offset > stringsSize - name.length - 1) return 0;
+        if(strings[name.offset + name.length] != 0) return 0;
+        return strings + name.offset;
+    }
+
+    bool ModelManager::parseModel(const string& filename, const char* data, unsigned int size,
+            Model* model, vector<SubmeshSource>& submeshes)
+    {
+        ModelFileHeader header;
+        if(size < sizeof(header))
+        {
+            LOG_ERROR("Arya model file is too small: " << filename);
+            return false;
+        }
+        memcpy(&header, data, sizeof(header));
+
+        if(header.version != MODEL_FILE_VERSION)
+        {
+            LOG_ERROR("Arya model with unsupported version " << header.version << ": " << filename);
+            return false;
+        }
+        if(header.fileSize != size || size % 4 != 0 || header.headerSize < sizeof(header)
+                || header.headerSize % 4 != 0 || header.headerSize > size)
+        {
+            LOG_ERROR("Arya model file is truncated: " << filename);
+            return false;
+        }
+        if( header.modelType < 1 || header.modelType > 3 )
+        {
+            LOG_ERROR("Arya model with unkown modeltype: " << header.modelType);
+            return false;
+        }
+        if( header.frameCount < 1 )
+        {
+            LOG_ERROR("Arya model with invalid number of frames: " << header.frameCount);
+            return false;
+        }
+        if( header.sectionCount < 0
+                || (unsigned int)header.sectionCount > (size - header.headerSize) / sizeof(ModelFileSection) )
+        {
+            LOG_ERROR("Arya model with invalid table of contents: " << filename);
+            return false;
+        }
+        //Hashing the whole file would touch every page of the mapping,
+        //the bounds checks below are what make the data safe to use
+        if(modelFileChecksum(data, header.headerSize + header.sectionCount * sizeof(ModelFileSection)) != header.tocChecksum
+                || (validateFiles && modelFileChecksum(data, size) != header.checksum))
+        {
+            LOG_ERROR("Arya model file is corrupt (checksum mismatch): " << filename);
+            return false;
+        }
 
-            char* nameBuf = new char[512];
-            for(int m = 0; m < header->materialCount; ++m)
+        //Check the bounds of all sections once, after this
+        //the data can be used without further checks
+        const ModelFileSection* sections = reinterpret_cast<const ModelFileSection*>(data + header.headerSize);
+        const unsigned int dataStart = header.headerSize + header.sectionCount * sizeof(ModelFileSection);
+        const ModelFileSection* found[MODEL_SECTION_LODS + 1];
+        for(int t = 0; t <= MODEL_SECTION_LODS; ++t) found[t] = 0;
+        for(int i = 0; i < header.sectionCount; ++i)
+        {
+            const ModelFileSection& section = sections[i];
+            unsigned int elementSize = sectionElementSize(section.type);
+            if( section.offset % MODEL_SECTION_ALIGNMENT != 0 || section.offset < dataStart
+                    || section.offset > size || section.size > size - section.offset
+                    || (elementSize && (unsigned long long)section.count * elementSize != section.size) )
             {
-                //Get string
-                int count = 0;
-                nameBuf[0] = *pointer++;
-                while(nameBuf[count]){ ++count; nameBuf[count] = *pointer++; }
-                nameBuf[count++] = '.';
-                nameBuf[count++] = 't';
-                nameBuf[count++] = 'g';
-                nameBuf[count++] = 'a';
-                nameBuf[count++] = 0;
-                
-                Material* mat = MaterialManager::shared().getMaterial(nameBuf);
-                model->addMaterial(mat);
+                LOG_ERROR("Arya model with invalid section " << i << ": " << filename);
+                return false;
             }
+            //Vertex and index sections are referenced by the submeshes
+            if( section.type <= MODEL_SECTION_LODS && !found[section.type] )
+                found[section.type] = &section;
+        }
 
-            //Parse animations
-            VertexAnimationData* animData = 0;
+        model->modelType = (ModelType)header.modelType;
+        model->minX = header.boundsMin[0];
+        model->maxX = header.boundsMax[0];
+        model->minY = header.boundsMin[1];
+        model->maxY = header.boundsMax[1];
+        model->minZ = header.boundsMin[2];
+        model->maxZ = header.boundsMax[2];
+
+        const char* strings = 0;
+        unsigned int stringsSize = 0;
+        if(found[MODEL_SECTION_STRINGS])
+        {
+            strings = data + found[MODEL_SECTION_STRINGS]->offset;
+            stringsSize = found[MODEL_SECTION_STRINGS]->size;
+        }
 
-            int animationCount = *(int*)pointer; pointer += 4;
-            if(!animationCount)
+        //Materials
+        if(found[MODEL_SECTION_MATERIALS])
+        {
+            const ModelFileName* names = reinterpret_cast<const ModelFileName*>(data + found[MODEL_SECTION_MATERIALS]->offset);
+            for(unsigned int m = 0; m < found[MODEL_SECTION_MATERIALS]->count; ++m)
             {
-                model->animationData = 0;
-                LOG_INFO("Model has no animations");
+                const char* name = getSectionName(names[m], strings, stringsSize);
+                if(!name)
+                {
+                    LOG_ERROR("Arya model with invalid material name: " << filename);
+                    return false;
+                }
+                string textureName(name, names[m].length);
+                textureName.append(".tga");
+                model->addMaterial(MaterialManager::shared().getUnpinnedMaterial(textureName));
             }
-            else
+        }
+
+        //Animations
+        //Bone animated models always get animation data, for the skeleton
+        VertexAnimationData* animData = 0;
+        BoneAnimationData* boneData = 0;
+        if(model->modelType == BoneAnimated)
+        {
+            boneData = new BoneAnimationData;
+            animData = boneData;
+            model->animationData = animData;
+        }
+
+        if(found[MODEL_SECTION_ANIMATIONS] && found[MODEL_SECTION_ANIMATIONS]->count > 0)
+        {
+            const ModelFileAnimation* animations = reinterpret_cast<const ModelFileAnimation*>(data + found[MODEL_SECTION_ANIMATIONS]->offset);
+            const unsigned int animationCount = found[MODEL_SECTION_ANIMATIONS]->count;
+            const float* frameTimes = 0;
+            unsigned int frameTimeCount = 0;
+            if(found[MODEL_SECTION_FRAME_TIMES])
             {
-                AryaLogger << Logger::L_INFO << "Model has " << animationCount << " animations in " << header->frameCount << " frames: ";
+                frameTimes = reinterpret_cast<const float*>(data + found[MODEL_SECTION_FRAME_TIMES]->offset);
+                frameTimeCount = found[MODEL_SECTION_FRAME_TIMES]->count;
+            }
 
+            if(!animData)
+            {
                 animData = new VertexAnimationData;
                 model->animationData = animData;
+            }
 
-                VertexAnim newAnim;
-                for(int anim = 0; anim < animationCount; ++anim)
+            AryaLogger << Logger::L_INFO << "Model has " << animationCount << " animations in " << header.frameCount << " frames: ";
+            for(unsigned int a = 0; a < animationCount; ++a)
+            {
+                const ModelFileAnimation& anim = animations[a];
+                const char* name = getSectionName(anim.name, strings, stringsSize);
+                if( !name || (anim.endFrame >= anim.startFrame && (anim.firstFrameTime < 0
+                        || (long long)anim.firstFrameTime + anim.endFrame - anim.startFrame >= (long long)frameTimeCount)) )
                 {
-                    //Get string
-                    int count = 0;
-                    nameBuf[0] = *pointer++;
-                    while(nameBuf[count]){ ++count; nameBuf[count] = *pointer++; }
+                    AryaLogger << endLog;
+                    LOG_ERROR("Arya model with invalid animation " << a << ": " << filename);
+                    return false;
+                }
+                AryaLogger << name << " ";
+                addAnimation(animData, string(name, anim.name.length), anim.startFrame, anim.endFrame,
+                        (anim.endFrame >= anim.startFrame ? frameTimes + anim.firstFrameTime : frameTimes), header.frameCount);
+            }
+            AryaLogger << endLog;
+        }
+        else
+        {
+            LOG_INFO("Model has no animations");
+        }
 
-                    AryaLogger << nameBuf << " ";
+        //Skeleton
+        if(boneData)
+        {
+            const ModelFileSection* parents = found[MODEL_SECTION_BONE_PARENTS];
+            const ModelFileSection* inverseBind = found[MODEL_SECTION_BONE_INVERSE_BIND];
+            const ModelFileSection* keys = found[MODEL_SECTION_BONE_KEYS];
+            if( !parents || !inverseBind || !keys || inverseBind->count != parents->count
+                    || (unsigned long long)keys->count != (unsigned long long)parents->count * header.frameCount )
+            {
+                LOG_ERROR("Arya model with an invalid skeleton: " << filename);
+                return false;
+            }
+            if( !readSkeleton(boneData, (int)parents->count, header.frameCount,
+                        data + parents->offset, data + inverseBind->offset, data + keys->offset, filename) )
+                return false;
+        }
 
-                    newAnim.frameTimes.clear();
-                    newAnim.startFrame = *(int*)pointer; pointer += 4;
-                    newAnim.endFrame = *(int*)pointer; pointer += 4;
-                    for(int i = 0; i <= (newAnim.endFrame-newAnim.startFrame); ++i)
-                    {
-                        newAnim.frameTimes.push_back( *(float*)pointer );
-                        pointer += 4;
-                    }
+        //Submeshes
+        if(!found[MODEL_SECTION_SUBMESHES])
+        {
+            LOG_ERROR("Arya model without submeshes: " << filename);
+            return false;
+        }
+        const ModelFileSubmesh* fileSubmeshes = reinterpret_cast<const ModelFileSubmesh*>(data + found[MODEL_SECTION_SUBMESHES]->offset);
+        const unsigned int submeshCount = found[MODEL_SECTION_SUBMESHES]->count;
+        submeshes.resize(submeshCount);
+        for(unsigned int s = 0; s < submeshCount; ++s)
+        {
+            const ModelFileSubmesh& fileSubmesh = fileSubmeshes[s];
+            SubmeshSource& submesh = submeshes[s];
+            submesh.materialIndex = fileSubmesh.materialIndex;
+            submesh.primitiveType = fileSubmesh.primitiveType;
+            submesh.vertexCount = fileSubmesh.vertexCount;
+            submesh.vertexFormat = fileSubmesh.vertexFormat;
+            //The frames of bone animated models are skeleton poses
+            submesh.frameCount = (boneData ? 1 : header.frameCount);
+            submesh.indexCount = fileSubmesh.indexCount;
+            submesh.vertexData = 0;
+            submesh.indexData = 0;
+            if(!checkSubmesh(submesh, (int)model->materials.size(), boneData != 0, filename))
+                return false;
+
+            int vertexSection = fileSubmesh.vertexSection;
+            if( vertexSection < 0 || vertexSection >= header.sectionCount
+                    || sections[vertexSection].type != MODEL_SECTION_VERTICES
+                    || sections[vertexSection].size != vertexDataSize(submesh.vertexFormat, submesh.vertexCount, submesh.frameCount) )
+            {
+                LOG_ERROR("Arya model with invalid vertex data in submesh " << s << ": " << filename);
+                return false;
+            }
+            submesh.vertexData = data + sections[vertexSection].offset;
 
-                    //Only add the animation if there are actually enough frames
-                    if( newAnim.startFrame < header->frameCount && newAnim.endFrame < header->frameCount )
-                        animData->animations.insert(animMapType(nameBuf, newAnim));
-                    else
-                        AryaLogger << "(not enough frames) ";
+            if(submesh.indexCount > 0)
+            {
+                int indexSection = fileSubmesh.indexSection;
+                if( indexSection < 0 || indexSection >= header.sectionCount
+                        || sections[indexSection].type != MODEL_SECTION_INDICES
+                        || sections[indexSection].count != (unsigned int)submesh.indexCount )
+                {
+                    LOG_ERROR("Arya model with invalid index data in submesh " << s << ": " << filename);
+                    return false;
+                }
+                submesh.indexData = data + sections[indexSection].offset;
+                if(!checkIndices(submesh.indexData, submesh.indexCount, submesh.vertexCount))
+                {
+                    LOG_ERROR("Arya model with out of range indices in submesh " << s << ": " << filename);
+                    return false;
                 }
+            }
+        }
+
+        //Levels of detail, they use the vertices of their submesh
+        if(found[MODEL_SECTION_LODS])
+        {
+            const ModelFileLOD* lods = reinterpret_cast<const ModelFileLOD*>(data + found[MODEL_SECTION_LODS]->offset);
+            for(unsigned int l = 0; l < found[MODEL_SECTION_LODS]->count; ++l)
+            {
+                const ModelFileLOD& lod = lods[l];
+                if( lod.submesh < 0 || lod.submesh >= (int)submeshCount || submeshes[lod.submesh].indexCount <= 0
+                        || lod.indexSection < 0 || lod.indexSection >= header.sectionCount
+                        || sections[lod.indexSection].type != MODEL_SECTION_INDICES
+                        || sections[lod.indexSection].count == 0 || !(lod.error >= 0.0f) )
+                {
+                    LOG_ERROR("Arya model with invalid level of detail " << l << ": " << filename);
+                    return false;
+                }
+                SubmeshSource& submesh = submeshes[lod.submesh];
+                const char* indexData = data + sections[lod.indexSection].offset;
+                int indexCount = (int)sections[lod.indexSection].count;
+                if(!checkIndices(indexData, indexCount, submesh.vertexCount))
+                {
+                    LOG_ERROR("Arya model with out of range indices in level of detail " << l << ": " << filename);
+                    return false;
+                }
+                submesh.lodIndexData.push_back(indexData);
+                submesh.lodIndexCount.push_back(indexCount);
 
-                AryaLogger << endLog;
+                //The error of a model level is the largest one of its meshes
+                unsigned int level = submesh.lodIndexData.size();
+                if(model->lodErrors.size() <= level) model->lodErrors.resize(level + 1, 0.0f);
+                if(lod.error > model->lodErrors[level]) model->lodErrors[level] = lod.error;
             }
+            //Coarser levels can not have a smaller error
+            for(unsigned int level = 1; level < model->lodErrors.size(); ++level)
+                if(model->lodErrors[level] < model->lodErrors[level - 1])
+                    model->lodErrors[level] = model->lodErrors[level - 1];
+            if(model->lodErrors.size() > 1)
+                LOG_INFO("Model has " << model->lodErrors.size() << " levels of detail");
+        }
 
-            delete[] nameBuf;
+        computeNextFrames(animData, header.frameCount, model->nextFrames);
+        return true;
+    }
 
-			float* boundingBoxData = (float*)pointer;
-			pointer += 6*sizeof(float);
-			model->minX = boundingBoxData[0];
-			model->maxX = boundingBoxData[1];
-			model->minY = boundingBoxData[2];
-			model->maxY = boundingBoxData[3];
-			model->minZ = boundingBoxData[4];
-			model->maxZ = boundingBoxData[5];
+    //Bounds checked reading of version 1 files,
+    //reads zeros after the end of the data
+    class LegacyReader
+    {
+        public:
+            LegacyReader(const char* data, unsigned int size) : pointer(data), end(data + size), failed(false) {}
 
-            //Parse all meshes
-            for(int s = 0; s < header->submeshCount; ++s)
+            //Returns the start of the next bytes, 0 if they are not in the file
+            const char* skip(unsigned int bytes)
+            {
+                if(failed || bytes > (unsigned int)(end - pointer)){ failed = true; return 0; }
+                const char* start = pointer;
+                pointer += bytes;
+                return start;
+            }
+            int readInt()
+            {
+                int value = 0;
+                const char* bytes = skip(sizeof(value));
+                if(bytes) memcpy(&value, bytes, sizeof(value));
+                return value;
+            }
+            //0 terminated string
+            const char* readName()
             {
-                Mesh* mesh = model->createAndAddMesh();
-
-                mesh->primitiveType = header->submesh[s].primitiveType;
-                mesh->vertexCount = header->submesh[s].vertexCount;
-                mesh->frameCount = header->frameCount;
-                mesh->materialIndex = header->submesh[s].materialIndex;
-
-                int floatCount = header->submesh[s].hasNormals ? 8 : 5;
-                int frameBytes = mesh->vertexCount * floatCount * sizeof(GLfloat);
-
-                glGenBuffers(1, &mesh->vertexBuffer);
-                glBindBuffer(GL_ARRAY_BUFFER, mesh->vertexBuffer);
-                glBufferData(GL_ARRAY_BUFFER,
-                        mesh->frameCount * frameBytes,
-                        modelfile->getData() + header->submesh[s].bufferOffset,
-                        GL_STATIC_DRAW);
-                if( header->submesh[s].indexCount > 0 )
+                const char* terminator = failed ? 0 : static_cast<const char*>(memchr(pointer, 0, end - pointer));
+                if(!terminator){ failed = true; return 0; }
+                return skip(terminator - pointer + 1);
+            }
+            void fail(){ failed = true; }
+            bool hasFailed() const { return failed; }
+
+        private:
+            const char* pointer;
+            const char* end;
+            bool failed;
+    };
+
+    bool ModelManager::parseLegacyModel(const string& filename, const char* data, unsigned int size,
+            Model* model, vector<SubmeshSource>& submeshes)
+    {
+        LegacyReader reader(data, size);
+        AryaHeader header;
+        const char* headerData = reader.skip(sizeof(AryaHeader));
+        if(!headerData)
+        {
+            LOG_ERROR("Not a valid Arya model file: " << filename);
+            return false;
+        }
+        memcpy(&header, headerData, sizeof(AryaHeader));
+
+        if( header.modeltype < 1 || header.modeltype > 3 )
+        {
+            LOG_ERROR("Arya model with unkown modeltype: " << header.modeltype);
+            return false;
+        }
+        if( header.frameCount < 1 )
+        {
+            LOG_ERROR("Arya model with invalid number of frames: " << header.frameCount);
+            return false;
+        }
+        if( header.submeshCount < 1 || header.materialCount < 0
+                || (unsigned int)header.submeshCount > size / sizeof(SubmeshInfo) )
+        {
+            LOG_ERROR("Not a valid Arya model file: " << filename);
+            return false;
+        }
+        LOG_WARNING("Model " << filename << " uses the old file format, convert it again for faster loading");
+
+        model->modelType = (ModelType)header.modeltype;
+        vector<SubmeshInfo> submeshInfo(header.submeshCount);
+        const char* submeshData = reader.skip(header.submeshCount * sizeof(SubmeshInfo));
+        if(submeshData) memcpy(&submeshInfo[0], submeshData, header.submeshCount * sizeof(SubmeshInfo));
+
+        //Parse all materials
+        for(int m = 0; m < header.materialCount && !reader.hasFailed(); ++m)
+        {
+            const char* name = reader.readName();
+            if(!name) break;
+            string textureName(name);
+            textureName.append(".tga");
+            model->addMaterial(MaterialManager::shared().getUnpinnedMaterial(textureName));
+        }
+
+        //Parse animations
+        //Bone animated models always get animation data, for the skeleton
+        VertexAnimationData* animData = 0;
+        BoneAnimationData* boneData = 0;
+        if(model->modelType == BoneAnimated)
+        {
+            boneData = new BoneAnimationData;
+            animData = boneData;
+            model->animationData = animData;
+        }
+
+        int animationCount = reader.readInt();
+        if(animationCount <= 0)
+        {
+            LOG_INFO("Model has no animations");
+        }
+        else
+        {
+            AryaLogger << Logger::L_INFO << "Model has " << animationCount << " animations in " << header.frameCount << " frames: ";
+
+            if(!animData)
+            {
+                animData = new VertexAnimationData;
+                model->animationData = animData;
+            }
+
+            vector<float> frameTimes;
+            for(int anim = 0; anim < animationCount && !reader.hasFailed(); ++anim)
+            {
+                const char* name = reader.readName();
+                int startFrame = reader.readInt();
+                int endFrame = reader.readInt();
+                //There are no frame times when endFrame < startFrame
+                int frameTimeCount = (endFrame >= startFrame ? endFrame - startFrame + 1 : 0);
+                if(!name || frameTimeCount > header.frameCount) reader.fail();
+                frameTimes.resize(frameTimeCount + 1);
+                const char* timeData = reader.skip(frameTimeCount * sizeof(float));
+                if(!timeData)
                 {
-                    mesh->indexCount = header->submesh[s].indexCount;
-                    glGenBuffers(1, &mesh->indexBuffer);
-                    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh->indexBuffer);
-                    glBufferData(GL_ELEMENT_ARRAY_BUFFER,
-                            sizeof(GLuint) * mesh->indexCount,
-                            modelfile->getData() + header->submesh[s].indexbufferOffset,
-                            GL_STATIC_DRAW);
+                    AryaLogger << endLog;
+                    LOG_ERROR("Arya model with invalid animation " << anim << ": " << filename);
+                    return false;
                 }
-                else
+                memcpy(&frameTimes[0], timeData, frameTimeCount * sizeof(float));
+
+                AryaLogger << name << " ";
+                addAnimation(animData, name, startFrame, endFrame, &frameTimes[0], header.frameCount);
+            }
+
+            AryaLogger << endLog;
+        }
+
+        float boundingBoxData[6] = {0.0f};
+        const char* boundsData = reader.skip(sizeof(boundingBoxData));
+        if(boundsData) memcpy(boundingBoxData, boundsData, sizeof(boundingBoxData));
+        model->minX = boundingBoxData[0];
+        model->maxX = boundingBoxData[1];
+        model->minY = boundingBoxData[2];
+        model->maxY = boundingBoxData[3];
+        model->minZ = boundingBoxData[4];
+        model->maxZ = boundingBoxData[5];
+
+        if(boneData)
+        {
+            int boneCount = reader.readInt();
+            if(boneCount < 1 || boneCount > MAX_BONES)
+            {
+                LOG_ERROR("Arya model with invalid number of bones: " << boneCount);
+                return false;
+            }
+            const char* parents = reader.skip(boneCount * sizeof(int));
+            const char* inverseBind = reader.skip(boneCount * 16 * sizeof(float));
+            const char* keys = ((unsigned int)header.frameCount > size / (boneCount * 7 * sizeof(float)) ? 0 :
+                    reader.skip(header.frameCount * boneCount * 7 * sizeof(float)));
+            if(!parents || !inverseBind || !keys)
+            {
+                LOG_ERROR("Arya model file is truncated: " << filename);
+                return false;
+            }
+            if(!readSkeleton(boneData, boneCount, header.frameCount, parents, inverseBind, keys, filename))
+                return false;
+        }
+
+        if(reader.hasFailed())
+        {
+            LOG_ERROR("Arya model file is truncated: " << filename);
+            return false;
+        }
+
+        submeshes.resize(header.submeshCount);
+        for(int s = 0; s < header.submeshCount; ++s)
+        {
+            const SubmeshInfo& info = submeshInfo[s];
+            SubmeshSource& submesh = submeshes[s];
+            submesh.materialIndex = info.materialIndex;
+            submesh.primitiveType = info.primitiveType;
+            submesh.vertexCount = info.vertexCount;
+            submesh.vertexFormat = info.vertexFormat;
+            //The frames of bone animated models are skeleton poses
+            submesh.frameCount = (boneData ? 1 : header.frameCount);
+            submesh.indexCount = info.indexCount;
+            submesh.vertexData = 0;
+            submesh.indexData = 0;
+            if(!checkSubmesh(submesh, (int)model->materials.size(), boneData != 0, filename))
+                return false;
+
+            unsigned long long vertexBytes = vertexDataSize(submesh.vertexFormat, submesh.vertexCount, submesh.frameCount);
+            unsigned long long indexBytes = (unsigned long long)submesh.indexCount * sizeof(GLuint);
+            if( info.bufferOffset < 0 || (unsigned int)info.bufferOffset > size || vertexBytes > size - info.bufferOffset
+                    || (submesh.indexCount > 0 && (info.indexbufferOffset < 0 || (unsigned int)info.indexbufferOffset > size
+                            || indexBytes > size - info.indexbufferOffset)) )
+            {
+                LOG_ERROR("Arya model file is truncated: " << filename);
+                return false;
+            }
+            submesh.vertexData = data + info.bufferOffset;
+            if(submesh.indexCount > 0)
+            {
+                submesh.indexData = data + info.indexbufferOffset;
+                if(!checkIndices(submesh.indexData, submesh.indexCount, submesh.vertexCount))
                 {
-                    mesh->indexCount = 0;
-                    mesh->indexBuffer = 0;
+                    LOG_ERROR("Arya model with out of range indices in submesh " << s << ": " << filename);
+                    return false;
                 }
+            }
+        }
 
-                //Create a VAO for every frame
-                mesh->createVAOs(mesh->frameCount);
-                int stride = floatCount * sizeof(GLfloat);
+        computeNextFrames(animData, header.frameCount, model->nextFrames);
+        return true;
+    }
+
+    unsigned int ModelManager::createMeshes(Model* model, const vector<SubmeshSource>& submeshes)
+    {
+        //GPU memory used by this model, for the residency budget
+        unsigned int memorySize = 0;
 
-                if( mesh->frameCount == 1 )
+        for(unsigned int s = 0; s < submeshes.size(); ++s)
+        {
+            const SubmeshSource& submesh = submeshes[s];
+            Mesh* mesh = model->createAndAddMesh();
+
+            mesh->primitiveType = submesh.primitiveType;
+            mesh->vertexCount = submesh.vertexCount;
+            mesh->frameCount = submesh.frameCount;
+            mesh->materialIndex = submesh.materialIndex;
+
+            const int vertexFormat = submesh.vertexFormat;
+            bool hasNormals = (vertexFormat != VERTEX_FORMAT_FLOAT);
+            const char* vertexData = submesh.vertexData;
+            //Animated meshes are converted, see below
+            if(!mesh->isAnimated())
+                mesh->vertexFormat = vertexFormat;
+
+            mesh->createVAO();
+            glBindVertexArray(mesh->vaoHandle);
+            glGenBuffers(1, &mesh->vertexBuffer);
+            glBindBuffer(GL_ARRAY_BUFFER, mesh->vertexBuffer);
+
+            if(mesh->isAnimated())
+            {
+                //Texture coordinates in the vertex buffer, the frames
+                //in a buffer texture in the compressed format
+                const int texCoordBytes = mesh->vertexCount * 2 * sizeof(GLfloat);
+                const int frameBytes = mesh->vertexCount * 4 * sizeof(GLushort);
+                if(vertexFormat == VERTEX_FORMAT_COMPRESSED)
                 {
-                    //Not animated
-                    glBindVertexArray(mesh->vaoHandles[0]);
-                    glBindBuffer(GL_ARRAY_BUFFER, mesh->vertexBuffer);
-
-                    glEnableVertexAttribArray(0); //pos
-                    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, stride, reinterpret_cast<GLubyte*>(0));
-                    glEnableVertexAttribArray(1); //tex
-                    glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, stride, reinterpret_cast<GLubyte*>(12));
-                    if(header->submesh[s].hasNormals)
-                    {
-                        glEnableVertexAttribArray(2); //norm
-                        glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, stride, reinterpret_cast<GLubyte*>(20));
-                    }
-                    if(mesh->indexCount > 0)
-                        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh->indexBuffer);
+                    glBufferData(GL_ARRAY_BUFFER, texCoordBytes, vertexData, GL_STATIC_DRAW);
+                    mesh->createFrameTexture(vertexData + texCoordBytes, mesh->frameCount * frameBytes);
+
+                    mesh->positionOffset = vec3(model->minX, model->minY, model->minZ);
+                    mesh->positionScale = vec3(model->maxX - model->minX, model->maxY - model->minY, model->maxZ - model->minZ);
                 }
                 else
                 {
-                    //Animated
-                    //We actually have to parse the list of animations here
-                    //because the endFrame of one animation should have startFrame as 'nextFrame'
-                    for(int f = 0; f < mesh->frameCount; ++f)
-                    {
-                        int nextf = (f+1)%mesh->frameCount;
-                        if(animData)
-                        {
-                            animMapIterator iter;
-                            for(iter = animData->animations.begin(); iter != animData->animations.end(); ++iter)
-                            {
-                                if( iter->second.endFrame == f )
-                                {
-                                    nextf = iter->second.startFrame;
-                                    break;
-                                }
-                            }
-                        }
-
-                        glBindVertexArray(mesh->vaoHandles[f]);
-                        glBindBuffer(GL_ARRAY_BUFFER, mesh->vertexBuffer);
-
-                        glEnableVertexAttribArray(0); //pos
-                        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, stride, reinterpret_cast<GLubyte*>(f*frameBytes + 0));
-
-                        glEnableVertexAttribArray(3); //next pos
-                        glVertexAttribPointer(3, 3, GL_FLOAT, GL_FALSE, stride, reinterpret_cast<GLubyte*>(nextf*frameBytes + 0));
-
-                        glEnableVertexAttribArray(1); //tex
-                        glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, stride, reinterpret_cast<GLubyte*>(f*frameBytes + 12));
-
-                        if(header->submesh[s].hasNormals)
-                        {
-                            glEnableVertexAttribArray(2); //norm
-                            glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, stride, reinterpret_cast<GLubyte*>(f*frameBytes + 20));
-
-                            glEnableVertexAttribArray(4); //next norm
-                            glVertexAttribPointer(4, 3, GL_FLOAT, GL_FALSE, stride, reinterpret_cast<GLubyte*>(nextf*frameBytes + 20));
-                        }
-                        if(mesh->indexCount > 0)
-                            glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh->indexBuffer);
-                    }
+                    vector<GLfloat> texCoords;
+                    vector<GLushort> frames;
+                    vec3 boxMin, boxMax;
+                    compressFrames(reinterpret_cast<const GLfloat*>(vertexData), mesh->vertexCount, mesh->frameCount,
+                            hasNormals, texCoords, frames, boxMin, boxMax);
+                    glBufferData(GL_ARRAY_BUFFER, texCoordBytes, &texCoords[0], GL_STATIC_DRAW);
+                    mesh->createFrameTexture(&frames[0], mesh->frameCount * frameBytes);
+
+                    mesh->positionOffset = boxMin;
+                    mesh->positionScale = boxMax - boxMin;
+                }
+                mesh->compressed = true;
+                memorySize += texCoordBytes + mesh->frameCount * frameBytes;
+
+                glEnableVertexAttribArray(1); //tex
+                glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 0, reinterpret_cast<GLubyte*>(0));
+            }
+            else if(vertexFormat == VERTEX_FORMAT_SKINNED)
+            {
+                const int stride = 8 * sizeof(GLfloat) + 8;
+                const int bufferBytes = mesh->vertexCount * stride;
+                glBufferData(GL_ARRAY_BUFFER, bufferBytes, vertexData, GL_STATIC_DRAW);
+                memorySize += bufferBytes;
+
+                mesh->skinned = true;
+
+                const GLubyte* base = reinterpret_cast<GLubyte*>(0);
+                glEnableVertexAttribArray(0); //pos
+                glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, stride, base);
+                glEnableVertexAttribArray(1); //tex
+                glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, stride, base + 12);
+                glEnableVertexAttribArray(2); //norm
+                glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, stride, base + 20);
+                glEnableVertexAttribArray(3); //bone indices
+                glVertexAttribIPointer(3, 4, GL_UNSIGNED_BYTE, stride, base + 32);
+                glEnableVertexAttribArray(4); //bone weights
+                glVertexAttribPointer(4, 4, GL_UNSIGNED_BYTE, GL_TRUE, stride, base + 36);
+            }
+            else if(vertexFormat == VERTEX_FORMAT_COMPRESSED)
+            {
+                const int texCoordBytes = mesh->vertexCount * 2 * sizeof(GLfloat);
+                const int stride = 4 * sizeof(GLushort);
+                const int bufferBytes = texCoordBytes + mesh->vertexCount * stride;
+                glBufferData(GL_ARRAY_BUFFER, bufferBytes, vertexData, GL_STATIC_DRAW);
+                memorySize += bufferBytes;
+
+                mesh->compressed = true;
+                mesh->positionOffset = vec3(model->minX, model->minY, model->minZ);
+                mesh->positionScale = vec3(model->maxX - model->minX, model->maxY - model->minY, model->maxZ - model->minZ);
+
+                const GLubyte* base = reinterpret_cast<GLubyte*>(0);
+                glEnableVertexAttribArray(0); //pos
+                glVertexAttribPointer(0, 3, GL_UNSIGNED_SHORT, GL_TRUE, stride, base + texCoordBytes);
+                glEnableVertexAttribArray(1); //tex
+                glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 0, base);
+                glEnableVertexAttribArray(2); //norm
+                glVertexAttribPointer(2, 2, GL_BYTE, GL_TRUE, stride, base + texCoordBytes + 6);
+            }
+            else
+            {
+                const int stride = (hasNormals ? 8 : 5) * sizeof(GLfloat);
+                const int bufferBytes = mesh->vertexCount * stride;
+                glBufferData(GL_ARRAY_BUFFER, bufferBytes, vertexData, GL_STATIC_DRAW);
+                memorySize += bufferBytes;
+
+                glEnableVertexAttribArray(0); //pos
+                glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, stride, reinterpret_cast<GLubyte*>(0));
+                glEnableVertexAttribArray(1); //tex
+                glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, stride, reinterpret_cast<GLubyte*>(12));
+                if(hasNormals)
+                {
+                    glEnableVertexAttribArray(2); //norm
+                    glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, stride, reinterpret_cast<GLubyte*>(20));
                 }
             }
 
-            addResource(filename, model);
-        }while(0);
+            if( submesh.indexCount > 0 )
+            {
+                //All levels of detail after each other in one index buffer
+                mesh->indexCount = submesh.indexCount;
+                MeshLOD lod;
+                lod.firstIndex = 0;
+                lod.indexCount = submesh.indexCount;
+                mesh->lods.push_back(lod);
+                for(unsigned int l = 0; l < submesh.lodIndexData.size(); ++l)
+                {
+                    lod.firstIndex += lod.indexCount;
+                    lod.indexCount = submesh.lodIndexCount[l];
+                    mesh->lods.push_back(lod);
+                }
+                const int totalIndexCount = lod.firstIndex + lod.indexCount;
+
+                glGenBuffers(1, &mesh->indexBuffer);
+                glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh->indexBuffer);
+                glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(GLuint) * totalIndexCount, 0, GL_STATIC_DRAW);
+                for(unsigned int l = 0; l < mesh->lods.size(); ++l)
+                {
+                    glBufferSubData(GL_ELEMENT_ARRAY_BUFFER,
+                            sizeof(GLuint) * mesh->lods[l].firstIndex,
+                            sizeof(GLuint) * mesh->lods[l].indexCount,
+                            (l == 0 ? submesh.indexData : submesh.lodIndexData[l - 1]));
+                }
+                memorySize += sizeof(GLuint) * totalIndexCount;
+            }
+            else
+            {
+                mesh->indexCount = 0;
+                mesh->indexBuffer = 0;
+            }
+
+            //The model file is not kept, so the static batches
+            //get a copy instead of reading the buffers back
+            if(model->modelType == ModelTypeStatic && !mesh->isAnimated() && mesh->primitiveType == GL_TRIANGLES
+                    && vertexFormat != VERTEX_FORMAT_SKINNED && mesh->vertexCount > 0)
+                mesh->geometry = createMeshGeometry(mesh, submesh);
+        }
+        glBindVertexArray(0);
+        //The buffer textures were bound without the cache
+        GLStateCache::shared().invalidate();
+
+        return memorySize;
+    }
+
+    Model* ModelManager::loadResource(std::string filename)
+    {
+        //Mapped, so that the vertex data goes from the
+        //page cache to glBufferData without an extra copy
+        File* modelfile = FileSystem::shared().getMappedFile(string("models/") + filename);
+        if( modelfile == 0 ) return 0;
+
+        const char* data = modelfile->getData();
+        const unsigned int size = modelfile->getSize();
+        unsigned int magic = 0;
+        if(size >= sizeof(magic)) memcpy(&magic, data, sizeof(magic));
+
+        Model* model = new Model;
+        vector<SubmeshSource> submeshes;
+        bool parsed = false;
+        if(magic == MODEL_FILE_MAGIC)
+            parsed = parseModel(filename, data, size, model, submeshes);
+        else if(magic == ARYAMAGICINT)
+            parsed = parseLegacyModel(filename, data, size, model, submeshes);
+        else
+            LOG_ERROR("Not a valid Arya model file: " << filename);
+
+        if(parsed)
+        {
+            LOG_INFO("Loading model " << filename << " with " << submeshes.size() << " meshes.");
+            unsigned int memorySize = createMeshes(model, submeshes);
+            addResource(filename, model, memorySize);
+        }
+        else
+        {
+            delete model;
+            model = 0;
+        }
 
         FileSystem::shared().releaseFile(modelfile);
         return model;
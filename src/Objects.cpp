@@ -1,66 +1,87 @@
 #include "Objects.h"
 #include "Models.h"
+#include "AnimationSystem.h"
+#include "StaticBatcher.h"
 #include "common/Logger.h"
-#include <glm/gtc/matrix_transform.hpp>
 
 namespace Arya
 {
-    Object::Object()
+    Object::Object(AnimationSystem* animationSystem, TransformSystem* transformSystem, StaticBatcher* staticBatcher)
     {
         model = 0;
-        animState = 0;
-        updateMatrix = true;
-        position = vec3(0.0, 0.0, 0.0);
-        pitch = 0.0f;
-        yaw = 0.0f;
+        animations = animationSystem;
+        animationSlot = -1;
+        lodLevel = 0;
+        batcher = staticBatcher;
+        batchSlot = -1;
+        batchPending = false;
+        transforms = transformSystem;
+        transformSlot = transforms->add(this);
         tintColor = vec3(0.5);
         obsolete = false;
+        staticObject = false;
     }
 
     Object::~Object()
     {
-        if(animState) delete animState;
-    }
-
-    const mat4& Object::getMoveMatrix()
-    {
-        if(updateMatrix)
-        {
-            mMatrix = glm::translate(mat4(1.0f), position);
-            mMatrix = glm::rotate(mMatrix, yaw, vec3(0.0, 1.0, 0.0));
-            mMatrix = glm::rotate(mMatrix, pitch, vec3(1.0, 0.0, 0.0));
-        }
-        return mMatrix;
+        if(animationSlot >= 0) animations->remove(animationSlot);
+        transforms->remove(transformSlot);
+        batcher->removeObject(this);
+        //Unreferenced models can be evicted by ModelManager
+        if(model) model->release();
     }
 
     void Object::setModel(Model* newModel)
     {
         if( model ) model->release();
-        if( animState ) delete animState;
+        if( animationSlot >= 0 ) animations->remove(animationSlot);
+        animationSlot = -1;
 
-        //Set new model and get a new animation state object
-        //(subclass of AnimationState)
+        //Set new model and get a new animation slot
         model = newModel;
         if(model)
         {
-            animState = model->createAnimationState();
+            if(model->getAnimationCount() > 0)
+                animationSlot = animations->add(this, model);
             model->addRef();
         }
+        if(staticObject) batchChanged();
+    }
+
+    void Object::batchChanged()
+    {
+        batcher->objectChanged(this);
     }
 
     void Object::setAnimation(const char* name)
     {
-        if( animState ) animState->setAnimation(name);
+        if( animationSlot < 0 ) return;
+        int clipId = model->getAnimationId(name);
+        if( clipId < 0 )
+        {
+            LOG_WARNING("Animation not found: " << name);
+            return;
+        }
+        animations->play(animationSlot, clipId);
+    }
+
+    void Object::setAnimation(int clipId)
+    {
+        if( animationSlot >= 0 ) animations->play(animationSlot, clipId);
     }
 
     void Object::setAnimationTime(float time)
     {
-        if( animState ) animState->setAnimationTime(time);
+        if( animationSlot >= 0 ) animations->setDuration(animationSlot, time);
     }
 
-    void Object::updateAnimation(float elapsedTime)
+    int Object::getAnimationFrame() const
     {
-        if( animState ) animState->updateAnimation(elapsedTime);
+        return (animationSlot >= 0 ? animations->getFrame(animationSlot) : 0);
     }
-}
 
+    float Object::getAnimationInterpolation() const
+    {
+        return (animationSlot >= 0 ? animations->getInterpolation(animationSlot) : 0.0f);
+    }
+}
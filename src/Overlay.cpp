@@ -3,6 +3,7 @@
 #include "Root.h"
 #include "Textures.h"
 #include "Shaders.h"
+#include "RenderQueue.h"
 #include "common/Logger.h"
 
 namespace Arya
@@ -55,11 +56,12 @@ namespace Arya
         int wh = Root::shared().getWindowHeight();
 
         // bind shader
+        GLStateCache& stateCache = GLStateCache::shared();
         overlayProgram->use();
-        glBindVertexArray(rectVAO);
+        stateCache.bindVertexArray(rectVAO);
 
         overlayProgram->setUniform1i("texture1", 0);
-        glActiveTexture(GL_TEXTURE0);
+        GLuint whiteHandle = TextureManager::shared().getTexture("white")->handle;
 
         // render all rects
         for(unsigned int i = 0; i < rects.size(); ++i)
@@ -68,11 +70,11 @@ namespace Arya
             overlayProgram->setUniform4fv("uColor", rects[i]->fillColor);
             if(rects[i]->textureHandle !=0)
             {
-                glBindTexture(GL_TEXTURE_2D, rects[i]->textureHandle);
+                stateCache.bindTexture(0, rects[i]->textureHandle);
             }
             else
             {
-                glBindTexture(GL_TEXTURE_2D, TextureManager::shared().getTexture("white")->handle);
+                stateCache.bindTexture(0, whiteHandle);
             }
             // TODO: use dirty flag maybe?
             rects[i]->screenPosition = rects[i]->relative + vec2(2.0 * rects[i]->offsetInPixels.x / ww, 2.0 * rects[i]->offsetInPixels.y / wh);
@@ -28,8 +28,9 @@ namespace Arya
                 triangleVertices,
                 GL_STATIC_DRAW);
 
-        mesh->createVAOs(1);
-        glBindVertexArray(mesh->vaoHandles[0]);
+        mesh->frameCount = 1;
+        mesh->createVAO();
+        glBindVertexArray(mesh->vaoHandle);
 
         glEnableVertexAttribArray(0);
 
@@ -51,8 +52,9 @@ namespace Arya
         glGenBuffers(1, &mesh->vertexBuffer);
         glBindBuffer(GL_ARRAY_BUFFER, mesh->vertexBuffer);
         glBufferData(GL_ARRAY_BUFFER, mesh->vertexCount * 3 * sizeof(GLfloat), quadVerts, GL_STATIC_DRAW);
-        mesh->createVAOs(1);
-        glBindVertexArray(mesh->vaoHandles[0]);
+        mesh->frameCount = 1;
+        mesh->createVAO();
+        glBindVertexArray(mesh->vaoHandle);
         glEnableVertexAttribArray(0);
         glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, (GLvoid*)0);
     }
@@ -0,0 +1,164 @@
+#include <algorithm>
+#include "RenderQueue.h"
+
+namespace Arya
+{
+    template<> GLStateCache* Singleton<GLStateCache>::singleton = 0;
+
+    //Invalid value for unknown bindings
+    static const GLuint UNKNOWN_BINDING = 0xffffffff;
+
+    GLStateCache::GLStateCache()
+    {
+        invalidate();
+        resetCounters();
+    }
+
+    GLStateCache::~GLStateCache()
+    {
+    }
+
+    void GLStateCache::invalidate()
+    {
+        currentProgram = UNKNOWN_BINDING;
+        currentVertexArray = UNKNOWN_BINDING;
+        for(int i = 0; i < MAX_TEXTURE_UNITS; ++i)
+            currentTextures[i] = UNKNOWN_BINDING;
+        activeTextureUnit = -1;
+        blendState = -1;
+        depthTestState = -1;
+        cullFaceState = -1;
+    }
+
+    void GLStateCache::useProgram(GLuint program)
+    {
+        if(program == currentProgram)
+        {
+            ++skippedCount;
+            return;
+        }
+        glUseProgram(program);
+        currentProgram = program;
+        ++issuedCount;
+    }
+
+    void GLStateCache::bindTexture(int unit, GLuint texture, GLenum target)
+    {
+        if(unit < 0 || unit >= MAX_TEXTURE_UNITS)
+        {
+            //Not cached
+            glActiveTexture(GL_TEXTURE0 + unit);
+            glBindTexture(target, texture);
+            activeTextureUnit = unit;
+            ++issuedCount;
+            return;
+        }
+        if(texture == currentTextures[unit])
+        {
+            ++skippedCount;
+            return;
+        }
+        if(unit != activeTextureUnit)
+        {
+            glActiveTexture(GL_TEXTURE0 + unit);
+            activeTextureUnit = unit;
+        }
+        glBindTexture(target, texture);
+        currentTextures[unit] = texture;
+        ++issuedCount;
+    }
+
+    void GLStateCache::bindVertexArray(GLuint vertexArray)
+    {
+        if(vertexArray == currentVertexArray)
+        {
+            ++skippedCount;
+            return;
+        }
+        glBindVertexArray(vertexArray);
+        currentVertexArray = vertexArray;
+        ++issuedCount;
+    }
+
+    void GLStateCache::setBlend(bool enable)
+    {
+        setCapability(GL_BLEND, blendState, enable);
+    }
+
+    void GLStateCache::setDepthTest(bool enable)
+    {
+        setCapability(GL_DEPTH_TEST, depthTestState, enable);
+    }
+
+    void GLStateCache::setCullFace(bool enable)
+    {
+        setCapability(GL_CULL_FACE, cullFaceState, enable);
+    }
+
+    void GLStateCache::setCapability(GLenum cap, int& state, bool enable)
+    {
+        if(state == (enable ? 1 : 0))
+        {
+            ++skippedCount;
+            return;
+        }
+        if(enable) glEnable(cap);
+        else glDisable(cap);
+        state = (enable ? 1 : 0);
+        ++issuedCount;
+    }
+
+    //---------------------------
+    // RenderQueue
+    //---------------------------
+
+    void RenderQueue::clear()
+    {
+        items.clear();
+        programIds.clear();
+        textureIds.clear();
+        vertexArrayIds.clear();
+    }
+
+    unsigned int RenderQueue::getHandleId(HandleIds& ids, GLuint handle)
+    {
+        HandleIds::iterator it = ids.find(handle);
+        if(it != ids.end()) return it->second;
+        unsigned int id = ids.size();
+        ids.insert(std::make_pair(handle, id));
+        return id;
+    }
+
+    SortKey RenderQueue::makeSortKey(RenderPass pass, GLuint program, GLuint texture, GLuint vertexArray, float depth)
+    {
+        if(depth < 0.0f) depth = 0.0f;
+        if(depth > 1.0f) depth = 1.0f;
+
+        //  63..60 pass, 59..48 program, 47..32 texture
+        //  31..16 vertex array, 15..0 depth
+        //The handles are replaced by their ids in this queue
+        SortKey key = 0;
+        key |= (SortKey)(pass & 0xf) << 60;
+        key |= (SortKey)(getHandleId(programIds, program) & 0xfff) << 48;
+        key |= (SortKey)(getHandleId(textureIds, texture) & 0xffff) << 32;
+        key |= (SortKey)(getHandleId(vertexArrayIds, vertexArray) & 0xffff) << 16;
+        key |= (SortKey)(depth * 0xffff);
+        return key;
+    }
+
+    void RenderQueue::submit()
+    {
+        //stable_sort keeps the submission order for equal keys
+        std::stable_sort(items.begin(), items.end());
+
+        GLStateCache& cache = GLStateCache::shared();
+        for(unsigned int i = 0; i < items.size(); ++i)
+        {
+            const RenderItem& item = items[i];
+            cache.useProgram(item.program);
+            cache.bindTexture(item.textureUnit, item.texture);
+            cache.bindVertexArray(item.vertexArray);
+            item.owner->renderItem(item);
+        }
+    }
+}
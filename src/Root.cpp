@@ -17,8 +17,10 @@
 #include "Overlay.h"
 #include "Camera.h"
 #include "Sounds.h"
+#include "Materials.h"
 #include "common/Logger.h"
 #include "Interface.h"
+#include "RenderQueue.h"
 
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
@@ -39,6 +41,8 @@ namespace Arya
     {
         scene = 0;
         oldTime = 0;
+        stateChangesIssued = 0;
+        stateChangesSkipped = 0;
         interface = 0;
 		settingsManager = 0;
 
@@ -52,6 +56,7 @@ namespace Arya
         SoundManager::create();
         Console::create();
         Decals::create();
+        GLStateCache::create();
 
         //Some classes should be initialized
         //before the graphics, like Config.
@@ -59,6 +64,9 @@ namespace Arya
         //initialized in Root::initialize
         //when the graphics are initialized
         if(!Config::shared().init()) LOG_WARNING("Unable to init config");
+
+        CommandHandler::shared().addCommandListener("residency", this);
+        CommandHandler::shared().addCommandListener("renderstats", this);
     }
 
     Root::~Root()
@@ -67,6 +75,8 @@ namespace Arya
         //so it must be deleted first
         Console::destroy();
 
+        CommandHandler::shared().removeCommandListener(this);
+
         if(scene) delete scene;
 		if(settingsManager) delete settingsManager;
         if(interface) delete interface;
@@ -80,6 +90,7 @@ namespace Arya
         CommandHandler::destroy();
         FileSystem::destroy();
 		Decals::destroy();
+        GLStateCache::destroy();
 
         //TODO: Check if GLEW, GLFW, Shaders, Objects were still initated
         //Only clean them up if needed
@@ -109,6 +120,8 @@ namespace Arya
         TextureManager::shared().initialize();
 		//MaterialManager::shared().initialize();
 		ModelManager::shared().initialize();
+		applyResourceBudgets();
+		ModelManager::shared().setValidateFiles(Config::shared().getCvarBool("modelvalidate"));
 		if(!SoundManager::shared().init())
 		{
 			LOG_WARNING("Could not initialize SoundManager, files not found!");
@@ -196,6 +209,8 @@ namespace Arya
 				oldTime = pollTime;
 			}
 
+			trimResources();
+
 			render();
 
 			glfwPollEvents();
@@ -294,6 +309,11 @@ namespace Arya
 
 		checkForErrors("root render start");
 
+		//Loading and updating code binds without the cache
+		GLStateCache& stateCache = GLStateCache::shared();
+		stateCache.invalidate();
+		stateCache.resetCounters();
+
 		if(scene)
 		{
 			scene->render();
@@ -306,6 +326,8 @@ namespace Arya
 				std::list<FrameListener*>::iterator iter = it++;
 				(*iter)->onRender();
 			}
+			//The callbacks can use GL directly
+			stateCache.invalidate();
 
 			checkForErrors("callback onRender");
 
@@ -327,9 +349,95 @@ namespace Arya
 
 		checkForErrors("root render end");
 
+		stateChangesIssued = stateCache.getIssuedCount();
+		stateChangesSkipped = stateCache.getSkippedCount();
+
 		glfwSwapBuffers();
 	}
 
+	void Root::applyResourceBudgets()
+	{
+		TextureManager::shared().setMemoryBudget(Config::shared().getCvarInt("texturebudget") << 20);
+		ModelManager::shared().setMemoryBudget(Config::shared().getCvarInt("modelbudget") << 20);
+	}
+
+	void Root::trimResources()
+	{
+		//Models reference materials and materials reference
+		//textures, so unused models must go first before
+		//their textures can be evicted
+		ModelManager::shared().enforceBudget();
+		if(TextureManager::shared().isOverBudget())
+		{
+			ModelManager::shared().unloadUnused();
+			MaterialManager::shared().unloadUnused();
+			TextureManager::shared().enforceBudget();
+		}
+	}
+
+	template <typename T>
+	static void logResidencyOf(const char* typeName, ResourceManager<T>& manager)
+	{
+		LOG_INFO(typeName << ": " << manager.getResourceCount() << " resident, "
+				<< (manager.getMemoryUsage() >> 10) << " KB used, budget "
+				<< (manager.getMemoryBudget() ? (manager.getMemoryBudget() >> 20) : 0) << " MB"
+				<< (manager.getMemoryBudget() ? "" : " (unlimited)")
+				<< ", " << manager.getEvictionCount() << " evicted");
+	}
+
+	void Root::logResidency()
+	{
+		logResidencyOf("Textures", TextureManager::shared());
+		logResidencyOf("Materials", MaterialManager::shared());
+		logResidencyOf("Models", ModelManager::shared());
+	}
+
+	//Usage:
+	//residency                 - print residency statistics
+	//residency textures <MB>   - set the texture budget
+	//residency models <MB>     - set the model budget
+	bool Root::handleCommand(string command)
+	{
+		string cmd = CommandHandler::shared().splitLineCommand(command);
+		if(cmd == "renderstats")
+		{
+			LOG_INFO("GL state changes last frame: " << stateChangesIssued << " issued, " << stateChangesSkipped << " skipped");
+			return true;
+		}
+		if(cmd != "residency")
+			return false;
+
+		std::stringstream parser;
+		parser << CommandHandler::shared().splitLineParameters(command);
+		string type;
+		int budget = -1;
+		parser >> type >> budget;
+
+		if(type.empty())
+		{
+			logResidency();
+			return true;
+		}
+		if(budget < 0)
+		{
+			LOG_WARNING("Usage: residency [textures|models <budget in MB>]");
+			return false;
+		}
+		if(type == "textures")
+			Config::shared().setCvarInt("texturebudget", budget);
+		else if(type == "models")
+			Config::shared().setCvarInt("modelbudget", budget);
+		else
+		{
+			LOG_WARNING("Unknown resource type: " << type);
+			return false;
+		}
+		applyResourceBudgets();
+		trimResources();
+		logResidency();
+		return true;
+	}
+
 	Overlay* Root::getOverlay() const
 	{
 		return interface->getOverlay();
@@ -1,5 +1,8 @@
 #include <iostream>
 #include <string.h>
+#include <algorithm>
+#include <new>
+#include <cmath>
 #include <GL/glew.h>
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtx/rotate_vector.hpp>
@@ -18,6 +21,7 @@
 #include "Decals.h"
 #include "FogMap.h"
 #include "MiniMap.h"
+#include "StaticBatcher.h"
 
 #include "Overlay.h"
 
@@ -29,6 +33,12 @@ using glm::vec3;
 
 const float PI = 3.14159265358979323846264338327950288f;
 
+//Texture unit of the animation frames, see staticmodel.vert
+//The terrain uses the lower units
+static const int FRAME_TEXTURE_UNIT = 9;
+//Texture unit of the bone palette
+static const int PALETTE_TEXTURE_UNIT = 10;
+
 namespace Arya
 {	
     Scene::Scene()
@@ -38,7 +48,26 @@ namespace Arya
         camera = 0;
 		fm = 0;
         basicProgram = 0;
+        parametersLocation = -1;
+        positionOffsetLocation = -1;
+        positionScaleLocation = -1;
+        octNormalsLocation = -1;
+        animatedLocation = -1;
+        vertexCountLocation = -1;
+        skinnedLocation = -1;
+        batchedLocation = -1;
+        staticBatcher = 0;
+        paletteBuffer = 0;
+        paletteTexture = 0;
+        sceneConstants = 0;
+        instanceBuffer = 0;
+        shadowDepthTextureHandle = 0;
+        staticShadowTextureHandle = 0;
+        for(int i = 0; i < SHADOW_CASCADES; ++i)
+            shadowFBOHandles[i] = staticShadowFBOHandles[i] = 0;
         lightDirection=glm::normalize(vec3(0.7,0.7,0.2));
+        cascadeLightDirection = vec3(0.0f);
+        modelPixelError = 2.0f;
         init();
     }
 
@@ -49,17 +78,63 @@ namespace Arya
 
     Object* Scene::createObject()
     {
-        Object* obj = new Object;
+        Object* obj = allocateObject();
         objects.push_back(obj);
         return obj;
     }
 
+    Object* Scene::allocateObject()
+    {
+        if(freeObjects.empty())
+        {
+            //A new block, its objects are handed out from the back
+            char* block = new char[OBJECT_BLOCK_SIZE * sizeof(Object)];
+            objectBlocks.push_back(block);
+            for(int i = OBJECT_BLOCK_SIZE - 1; i >= 0; --i)
+                freeObjects.push_back(reinterpret_cast<Object*>(block + i * sizeof(Object)));
+        }
+        void* memory = freeObjects.back();
+        freeObjects.pop_back();
+        return new(memory) Object(&animationSystem, &transformSystem, staticBatcher);
+    }
+
+    void Scene::freeObject(Object* obj)
+    {
+        obj->~Object();
+        freeObjects.push_back(obj);
+    }
+
+    static bool compareObjectModels(const Object* a, const Object* b)
+    {
+        return a->getModel() < b->getModel();
+    }
+
+    void Scene::groupObjectsByModel()
+    {
+        //Only sort when an object was added, removed or got another model
+        for(unsigned int i = 1; i < objects.size(); ++i)
+        {
+            if(objects[i]->model < objects[i-1]->model)
+            {
+                std::sort(objects.begin(), objects.end(), compareObjectModels);
+                return;
+            }
+        }
+    }
+
     bool Scene::init()
     {
         if(!initShaders()) return false;
 
         if(!initShadowSupport()) return false;
 
+        if(!initInstancing()) return false;
+
+        staticBatcher = new StaticBatcher;
+        if(!staticBatcher->init(basicProgram)) return false;
+
+        if(!initSceneConstants()) return false;
+
         LOG_INFO("Loading scene");
 
         if(!camera)
@@ -95,34 +170,28 @@ namespace Arya
         basicProgram->attach(basicFragment);
         if(!(basicProgram->link())) return false;
 
+        basicProgram->use();
+        basicProgram->setUniform1i("tex", 0);
+        parametersLocation = basicProgram->getUniformLocation("parameters");
+        positionOffsetLocation = basicProgram->getUniformLocation("positionOffset");
+        positionScaleLocation = basicProgram->getUniformLocation("positionScale");
+        octNormalsLocation = basicProgram->getUniformLocation("octNormals");
+        animatedLocation = basicProgram->getUniformLocation("animated");
+        vertexCountLocation = basicProgram->getUniformLocation("vertexCount");
+        basicProgram->setUniform1i("frames", FRAME_TEXTURE_UNIT);
+        skinnedLocation = basicProgram->getUniformLocation("skinned");
+        basicProgram->setUniform1i("palette", PALETTE_TEXTURE_UNIT);
+        batchedLocation = basicProgram->getUniformLocation("batched");
+
         return true;
     }
 
-    bool Scene::initShadowSupport()
+    //Logs the status of the bound framebuffer
+    static bool checkFramebufferStatus()
     {
-        if(glGetError() != GL_NO_ERROR)
-            LOG_ERROR("GL error before FBO");
-
-        int shadowFBOSize = 2048;
-        glGenFramebuffers(1, &shadowFBOHandle);
-        glBindFramebuffer(GL_FRAMEBUFFER, shadowFBOHandle);
-
-        glGenTextures(1, &shadowDepthTextureHandle);
-        glBindTexture(GL_TEXTURE_2D, shadowDepthTextureHandle);
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT24, shadowFBOSize, shadowFBOSize, 0, GL_DEPTH_COMPONENT, GL_FLOAT, 0);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-
-        glDrawBuffer(GL_NONE);
-
-        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, shadowDepthTextureHandle, 0);
-
         switch(glCheckFramebufferStatus(GL_FRAMEBUFFER)) {
             case GL_FRAMEBUFFER_COMPLETE:
-                LOG_INFO("Framebuffer is complete");
-                break;
+                return true;
 
             case GL_FRAMEBUFFER_UNSUPPORTED:
                 LOG_ERROR("Framebuffer is unsupported");
@@ -154,13 +223,124 @@ namespace Arya
                 return false;
                 break;
         }
+    }
+
+    //Depth texture array with a layer for every cascade
+    static GLuint createShadowTextureArray(int size, int layers)
+    {
+        GLuint handle;
+        glGenTextures(1, &handle);
+        glBindTexture(GL_TEXTURE_2D_ARRAY, handle);
+        glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_DEPTH_COMPONENT24, size, size, layers, 0, GL_DEPTH_COMPONENT, GL_FLOAT, 0);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        return handle;
+    }
+
+    bool Scene::initShadowSupport()
+    {
+        if(glGetError() != GL_NO_ERROR)
+            LOG_ERROR("GL error before FBO");
 
-        orthoShadowCubeMatrix = glm::ortho(-100.0, 100.0, -100.0, 100.0, -100.0, 100.0);
-        lightOrthoMatrix = orthoShadowCubeMatrix;
+        shadowDepthTextureHandle = createShadowTextureArray(SHADOW_MAP_SIZE, SHADOW_CASCADES);
+        staticShadowTextureHandle = createShadowTextureArray(SHADOW_MAP_SIZE, SHADOW_CASCADES);
+        GLStateCache::shared().invalidate();
+
+        glGenFramebuffers(SHADOW_CASCADES, shadowFBOHandles);
+        glGenFramebuffers(SHADOW_CASCADES, staticShadowFBOHandles);
+        for(int i = 0; i < SHADOW_CASCADES; ++i)
+        {
+            glBindFramebuffer(GL_FRAMEBUFFER, shadowFBOHandles[i]);
+            glDrawBuffer(GL_NONE);
+            glReadBuffer(GL_NONE);
+            glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, shadowDepthTextureHandle, 0, i);
+            if(!checkFramebufferStatus()) return false;
+
+            glBindFramebuffer(GL_FRAMEBUFFER, staticShadowFBOHandles[i]);
+            glDrawBuffer(GL_NONE);
+            glReadBuffer(GL_NONE);
+            glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, staticShadowTextureHandle, 0, i);
+            if(!checkFramebufferStatus()) return false;
+
+            cascades[i].lightMatrix = mat4(1.0f);
+            cascades[i].center = vec3(0.0f);
+            cascades[i].halfSize = 0.0f;
+            cascades[i].splitFar = 0.0f;
+            cascades[i].staticSignature = 0;
+            cascades[i].staticValid = false;
+        }
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        LOG_INFO("Shadow framebuffers are complete");
 
         return true;
     }
 
+    bool Scene::initInstancing()
+    {
+        glGenBuffers(1, &instanceBuffer);
+        if(!instanceBuffer)
+        {
+            LOG_ERROR("Unable to create instance buffer");
+            return false;
+        }
+
+        glGenBuffers(1, &paletteBuffer);
+        glGenTextures(1, &paletteTexture);
+        if(!paletteBuffer || !paletteTexture)
+        {
+            LOG_ERROR("Unable to create bone palette buffer");
+            return false;
+        }
+        glBindBuffer(GL_TEXTURE_BUFFER, paletteBuffer);
+        glBufferData(GL_TEXTURE_BUFFER, 3 * sizeof(vec4), 0, GL_STREAM_DRAW);
+        glBindTexture(GL_TEXTURE_BUFFER, paletteTexture);
+        glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, paletteBuffer);
+        glBindTexture(GL_TEXTURE_BUFFER, 0);
+        glBindBuffer(GL_TEXTURE_BUFFER, 0);
+        GLStateCache::shared().invalidate();
+        return true;
+    }
+
+    bool Scene::initSceneConstants()
+    {
+        sceneConstants = new UniformBuffer;
+        return sceneConstants->init(sizeof(SceneConstants), CONSTANTS_COUNT);
+    }
+
+    void Scene::updateSceneConstants()
+    {
+        //Maps the light clip space to shadow map coordinates
+        static mat4 biasMatrix(
+            0.5f, 0.0f, 0.0f, 0.0f,
+            0.0f, 0.5f, 0.0f, 0.0f,
+            0.0f, 0.0f, 0.5f, 0.0f,
+            0.5f, 0.5f, 0.5f, 1.0f
+        );
+
+        SceneConstants constants;
+        constants.vpMatrix = camera->getVPMatrix();
+        constants.viewMatrix = camera->getVMatrix();
+        for(int i = 0; i < SHADOW_CASCADES; ++i)
+        {
+            constants.lightMatrix[i] = biasMatrix * cascades[i].lightMatrix;
+            constants.cascadeSplits[i] = cascades[i].splitFar;
+        }
+        for(int i = SHADOW_CASCADES; i < 4; ++i)
+            constants.cascadeSplits[i] = 0.0f;
+        constants.lightDirection = vec4(lightDirection, 0.0f);
+        sceneConstants->setBlock(CONSTANTS_CAMERA, &constants);
+
+        for(int i = 0; i < SHADOW_CASCADES; ++i)
+        {
+            constants.vpMatrix = cascades[i].lightMatrix;
+            sceneConstants->setBlock(CONSTANTS_SHADOW + i, &constants);
+        }
+
+        sceneConstants->upload();
+    }
+
     bool Scene::setTerrain(char* heightData, int terrainSize, const char* waterMap, const vector<Material*>& tileSet, Texture* cloudMap, Texture* splatMap)
     {
         if(currentTerrain) delete currentTerrain;
@@ -192,209 +372,646 @@ namespace Arya
         if(basicProgram) delete basicProgram;
         basicProgram = 0;
 
+        if(sceneConstants) delete sceneConstants;
+        sceneConstants = 0;
+
+        if(instanceBuffer) glDeleteBuffers(1, &instanceBuffer);
+        instanceBuffer = 0;
+        if(paletteTexture) glDeleteTextures(1, &paletteTexture);
+        paletteTexture = 0;
+        if(paletteBuffer) glDeleteBuffers(1, &paletteBuffer);
+        paletteBuffer = 0;
+
 		if(fm) delete fm;
 		fm = 0;
 
+        if(shadowFBOHandles[0]) glDeleteFramebuffers(SHADOW_CASCADES, shadowFBOHandles);
+        if(staticShadowFBOHandles[0]) glDeleteFramebuffers(SHADOW_CASCADES, staticShadowFBOHandles);
+        for(int i = 0; i < SHADOW_CASCADES; ++i)
+            shadowFBOHandles[i] = staticShadowFBOHandles[i] = 0;
+        if(shadowDepthTextureHandle) glDeleteTextures(1, &shadowDepthTextureHandle);
+        if(staticShadowTextureHandle) glDeleteTextures(1, &staticShadowTextureHandle);
+        shadowDepthTextureHandle = staticShadowTextureHandle = 0;
+
         for(unsigned int i = 0; i < objects.size(); ++i)
-            delete objects[i];
+            freeObject(objects[i]);
         objects.clear();
+        freeObjects.clear();
+        for(unsigned int i = 0; i < objectBlocks.size(); ++i)
+            delete[] objectBlocks[i];
+        objectBlocks.clear();
+
+        //After the objects, they remove themselves from it
+        if(staticBatcher) delete staticBatcher;
+        staticBatcher = 0;
 
         initialized = false;
     }
 
     void Scene::onFrame(float elapsedTime)
     {
-        //We might want to let the Game loop on all
-        //the objects and animate them. This way the game
-        //has more control: it could slow animations down for example
-        for(vector<Object*>::iterator iter = objects.begin(); iter != objects.end(); )
+        //The last object is moved into the place of a removed one,
+        //so removing many objects at once is still a single pass
+        for(unsigned int i = 0; i < objects.size(); )
         {
-            if( (*iter)->isObsolete() )
+            Object* obj = objects[i];
+            if(!obj->isObsolete())
             {
-                delete *iter;
-                iter = objects.erase(iter);
-            }
-            else
-            {
-                (*iter)->updateAnimation(elapsedTime);
-                ++iter;
+                ++i;
+                continue;
             }
+            objects[i] = objects.back();
+            objects.pop_back();
+            freeObject(obj);
         }
+        //All animations in one pass
+        animationSystem.update(elapsedTime);
         camera->update(elapsedTime);
         currentTerrain->update(elapsedTime, this);
 
-        //
-        // Calculate the shadow projection matrix
-        //
+        updateShadowCascades();
 
+		fm->update(elapsedTime);
+		minimap->update(elapsedTime, this);
+    }
+
+    //The cascades cover the view up to this many times the zoom
+    static const float SHADOW_DISTANCE_ZOOM = 4.0f;
+    //Blend between logarithmic (1) and uniform (0) split distances
+    static const float SHADOW_SPLIT_LAMBDA = 0.5f;
+    //A fitted box is this much larger than the split it covers
+    static const float SHADOW_BOX_MARGIN = 0.25f;
+    //The box is refitted when the split needs less than this part of it
+    static const float SHADOW_BOX_SHRINK = 0.6f;
+    //Casters this far outside the box, towards or away from the light, are still drawn
+    static const float SHADOW_CASTER_DEPTH = 100.0f;
+
+    void Scene::updateShadowCascades()
+    {
         //assumes lightDirection is normalized
         float lightPitch = 90.0f - (180.0f/PI)*glm::acos(lightDirection.y); //[-180,180] positive means pointing upward
         float lightYaw = (180.0f/PI)*glm::atan(lightDirection.x , lightDirection.z);
         rotateToLightDirMatrix = mat4(1.0f);
         rotateToLightDirMatrix = glm::rotate( rotateToLightDirMatrix, lightPitch, vec3(1.0, 0.0, 0.0) );
         rotateToLightDirMatrix = glm::rotate( rotateToLightDirMatrix, -lightYaw, vec3(0.0, 1.0, 0.0) );
-        rotateToLightDirMatrix = glm::translate( rotateToLightDirMatrix, -camera->getPosition() );
-        
-        float shadowBoxSize = 2.0f*camera->getZoom();
-        //left,right,bottom,top,near,far
-        orthoShadowCubeMatrix = glm::ortho(-shadowBoxSize, shadowBoxSize, -shadowBoxSize, shadowBoxSize, -shadowBoxSize, shadowBoxSize);
 
-        lightOrthoMatrix = orthoShadowCubeMatrix * rotateToLightDirMatrix;
+        //All boxes are fitted again when the light moved
+        bool lightMoved = (glm::length(lightDirection - cascadeLightDirection) > 1e-4f);
+        cascadeLightDirection = lightDirection;
+
+        //Recover the clip planes from the perspective matrix
+        const mat4& projection = camera->getProjectionMatrix();
+        float nearPlane = projection[3][2] / (projection[2][2] - 1.0f);
+        float farPlane = projection[3][2] / (projection[2][2] + 1.0f);
+        float shadowDistance = camera->getZoom()*SHADOW_DISTANCE_ZOOM;
+        if(shadowDistance > farPlane) shadowDistance = farPlane;
+
+        //World space corners of the camera frustum, near plane first
+        vec3 nearCorners[4], farCorners[4];
+        mat4 inverseVP = camera->getInverseVPMatrix();
+        for(int i = 0; i < 4; ++i)
+        {
+            vec4 nearCorner = inverseVP * vec4((i & 1) ? 1.0f : -1.0f, (i & 2) ? 1.0f : -1.0f, -1.0f, 1.0f);
+            vec4 farCorner = inverseVP * vec4((i & 1) ? 1.0f : -1.0f, (i & 2) ? 1.0f : -1.0f, 1.0f, 1.0f);
+            nearCorners[i] = vec3(nearCorner.x, nearCorner.y, nearCorner.z) / nearCorner.w;
+            farCorners[i] = vec3(farCorner.x, farCorner.y, farCorner.z) / farCorner.w;
+        }
 
-		fm->update(elapsedTime);
-		minimap->update(elapsedTime, this);
+        float splitNear = nearPlane;
+        for(int c = 0; c < SHADOW_CASCADES; ++c)
+        {
+            ShadowCascade& cascade = cascades[c];
+
+            float fraction = float(c + 1) / float(SHADOW_CASCADES);
+            float logSplit = nearPlane * std::pow(shadowDistance / nearPlane, fraction);
+            float uniformSplit = nearPlane + (shadowDistance - nearPlane) * fraction;
+            float splitFar = SHADOW_SPLIT_LAMBDA * logSplit + (1.0f - SHADOW_SPLIT_LAMBDA) * uniformSplit;
+            cascade.splitFar = splitFar;
+
+            //The view depth is linear along the frustum edges
+            float t0 = (splitNear - nearPlane) / (farPlane - nearPlane);
+            float t1 = (splitFar - nearPlane) / (farPlane - nearPlane);
+            splitNear = splitFar;
+
+            //Bounding sphere of the split, it does not change size when the camera rotates
+            vec3 corners[8];
+            vec3 center(0.0f);
+            for(int i = 0; i < 4; ++i)
+            {
+                vec3 edge = farCorners[i] - nearCorners[i];
+                corners[i] = nearCorners[i] + edge * t0;
+                corners[i + 4] = nearCorners[i] + edge * t1;
+                center += corners[i] + corners[i + 4];
+            }
+            center /= 8.0f;
+            float radius = 0.0f;
+            for(int i = 0; i < 8; ++i)
+                radius = glm::max(radius, glm::length(corners[i] - center));
+
+            vec4 lightCenter = rotateToLightDirMatrix * vec4(center, 1.0f);
+            vec3 splitCenter(lightCenter.x, lightCenter.y, lightCenter.z);
+
+            //Keep the box while the split still fits in it, so the
+            //cached static layer stays valid while the camera moves
+            bool fits = (cascade.halfSize > 0.0f)
+                && (glm::length(splitCenter - cascade.center) + radius <= cascade.halfSize)
+                && (radius >= SHADOW_BOX_SHRINK * cascade.halfSize);
+            if(fits && !lightMoved)
+                continue;
+
+            cascade.center = splitCenter;
+            cascade.halfSize = radius * (1.0f + SHADOW_BOX_MARGIN);
+            cascade.staticValid = false;
+
+            //left,right,bottom,top,near,far
+            //The view direction of the light is -z in light view space
+            const vec3& b = cascade.center;
+            float h = cascade.halfSize;
+            mat4 ortho = glm::ortho(b.x - h, b.x + h, b.y - h, b.y + h,
+                    -b.z - h - SHADOW_CASTER_DEPTH, -b.z + h + SHADOW_CASTER_DEPTH);
+            cascade.lightMatrix = ortho * rotateToLightDirMatrix;
+        }
     }
 
-    void Scene::render()
+    //Sort helper for the instance batches
+    struct VisibleInstance
     {
-        Root::shared().checkForErrors("scene render start");
+        Model* model;
+        int lodLevel;
+        int frame;
+        Object* object;
+        float interpolation;
 
-        //------------------------------
-        // SHADOW PASS
-        //------------------------------
+        bool operator<(const VisibleInstance& other) const
+        {
+            if(model != other.model) return model < other.model;
+            return lodLevel < other.lodLevel;
+        }
+    };
 
-        glBindFramebuffer(GL_FRAMEBUFFER, shadowFBOHandle);
-        glViewport(0, 0, 2048, 2048);
+    void Scene::cullObjects()
+    {
+        //All matrices of objects that moved since the last frame in one batch
+        transformSystem.update();
+        //The candidates below and the culling results keep this order
+        groupObjectsByModel();
+        const mat4* matrices = transformSystem.getMatrices();
+
+        cullCandidates.clear();
+        boundsX.clear(); boundsY.clear(); boundsZ.clear();
+        extentX.clear(); extentY.clear(); extentZ.clear();
+        boundsRadius.clear();
+
+        //Merge the static objects that changed and build
+        //the cells they were and are in again
+        staticBatcher->update();
+
+        // fog of war
+        fogCandidates.clear();
+        fogPositions.clear();
+        for(unsigned int i = 0; i < objects.size(); ++i)
+        {
+            Object* obj = objects[i];
+            if(obj->model == 0) continue;
+            if(obj->isObsolete()) continue;
+            fogCandidates.push_back(obj);
+            fogPositions.push_back(obj->getPosition2());
+        }
+        fogVisibleMask.resize((fogCandidates.size() + 31) / 32 + 1);
+        if(!fogCandidates.empty())
+            fm->queryVisibility(&fogPositions[0], fogCandidates.size(), &fogVisibleMask[0]);
 
-        // glDrawBuffer(GL_NONE);
+        for(unsigned int i = 0; i < fogCandidates.size(); ++i)
+        {
+            Object* obj = fogCandidates[i];
+            bool visible = ((fogVisibleMask[i >> 5] >> (i & 31)) & 1);
+            //Batched objects are culled per chunk, and hidden by the shader
+            if(obj->batchSlot >= 0)
+            {
+                staticBatcher->setObjectVisible(obj->batchSlot, visible);
+                continue;
+            }
+            if(!visible)
+                continue;
+
+            //Transform the model space box to a world space center and AABB
+            const mat4& mMatrix = matrices[obj->transformSlot];
+            vec3 localExtent = obj->model->getBoundingBoxExtent();
+            vec4 center = mMatrix * vec4(obj->model->getBoundingBoxCenter(), 1.0f);
+
+            cullCandidates.push_back(obj);
+            boundsX.push_back(center.x);
+            boundsY.push_back(center.y);
+            boundsZ.push_back(center.z);
+            extentX.push_back(glm::abs(mMatrix[0][0])*localExtent.x + glm::abs(mMatrix[1][0])*localExtent.y + glm::abs(mMatrix[2][0])*localExtent.z);
+            extentY.push_back(glm::abs(mMatrix[0][1])*localExtent.x + glm::abs(mMatrix[1][1])*localExtent.y + glm::abs(mMatrix[2][1])*localExtent.z);
+            extentZ.push_back(glm::abs(mMatrix[0][2])*localExtent.x + glm::abs(mMatrix[1][2])*localExtent.y + glm::abs(mMatrix[2][2])*localExtent.z);
+            //Objects are only rotated and translated so the radius does not change
+            boundsRadius.push_back(glm::length(localExtent));
+        }
 
-        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-        glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+        staticBatcher->updateObjectData();
 
-        basicProgram->use();
+        selectLODs();
+        cullAgainstFrustum(camera->getVPMatrix(), visibleForCamera);
+    }
 
-        basicProgram->setUniformMatrix4fv("vpMatrix", lightOrthoMatrix);
-        //basicProgram->setUniformMatrix4fv("viewMatrix", camera->getVMatrix());
+    //A coarser level is only taken when its error is below this fraction of the limit
+    static const float LOD_HYSTERESIS = 0.75f;
 
-        for(unsigned int i = 0; i < objects.size(); ++i)
+    void Scene::selectLODs()
+    {
+        vec3 camPos = camera->getRealCameraPosition();
+        //A world space length at distance d is this many pixels per d on the screen
+        float pixelsPerUnit = 0.5f * camera->getProjectionMatrix()[1][1] * Root::shared().getWindowHeight();
+        if(pixelsPerUnit <= 0.0f) return;
+
+        for(unsigned int i = 0; i < cullCandidates.size(); ++i)
         {
-            if( objects[i]->model == 0 ) continue;
-            if(objects[i]->isObsolete()) continue;
-
-			//culling
-			mat4 totalMatrix = camera->getVPMatrix() * objects[i]->getMoveMatrix();
-			bool flag = false;
-			for(int j = 0; j < 8; j++)
-			{
-				vec4 onScreen(objects[i]->model->getBoundingBoxVertex(j), 1.0);
-				onScreen = totalMatrix * onScreen;
-				onScreen /= onScreen.w;
-				if(!(onScreen.x < -2.0 || onScreen.x > 2.0 || onScreen.y < -2.0 || onScreen.y > 2.0))
-				{
-					flag = true;
-					break;
-				}
-			}
-			if(flag == false) continue;           
-
-			// fog of war
-			if(!fm->isVisible(objects[i]->getPosition2()))
-				continue;
-
-
-            basicProgram->setUniformMatrix4fv("mMatrix", objects[i]->getMoveMatrix());
-
-            int frame = 0;
-            float interpolation = 0.0f;
-            AnimationState* animState = objects[i]->getAnimationState(); //can be zero
-            if(animState)
+            Object* obj = cullCandidates[i];
+            const Model* model = obj->model;
+            const int levelCount = model->getLODCount();
+            if(levelCount <= 1)
             {
-                frame = animState->getCurFrame();
-                interpolation = animState->getInterpolation();
-                basicProgram->setUniform1f("interpolation", interpolation);
+                obj->lodLevel = 0;
+                continue;
             }
 
-            Model* model = objects[i]->model;
-            for(unsigned int j = 0; j < model->getMeshes().size(); ++j)
+            //Distance to the bounding sphere
+            float dx = boundsX[i] - camPos.x, dy = boundsY[i] - camPos.y, dz = boundsZ[i] - camPos.z;
+            float distance = glm::sqrt(dx*dx + dy*dy + dz*dz) - boundsRadius[i];
+            if(distance < 0.0f) distance = 0.0f;
+            //Largest error in world units that is allowed at this distance
+            float maxError = modelPixelError * distance / pixelsPerUnit;
+
+            int level = (obj->lodLevel < levelCount ? obj->lodLevel : levelCount - 1);
+            while(level > 0 && model->getLODError(level) > maxError)
+                --level;
+            while(level + 1 < levelCount && model->getLODError(level + 1) <= maxError * LOD_HYSTERESIS)
+                ++level;
+            obj->lodLevel = level;
+        }
+    }
+
+    void Scene::cullAgainstFrustum(const mat4& vpMatrix, vector<Object*>& visibleList)
+    {
+        visibleList.clear();
+        const int count = cullCandidates.size();
+        if(count == 0) return;
+
+        cullResult.assign(count, 1);
+
+        const float* x = &boundsX[0];
+        const float* y = &boundsY[0];
+        const float* z = &boundsZ[0];
+        const float* ex = &extentX[0];
+        const float* ey = &extentY[0];
+        const float* ez = &extentZ[0];
+        const float* r = &boundsRadius[0];
+        unsigned char* result = &cullResult[0];
+
+        vec4 planes[6];
+        getFrustumPlanes(vpMatrix, planes);
+
+        for(int p = 0; p < 6; ++p)
+        {
+            const vec4& plane = planes[p];
+            const float a = plane.x, b = plane.y, c = plane.z, d = plane.w;
+            const float absA = glm::abs(a), absB = glm::abs(b), absC = glm::abs(c);
+
+            //An object is outside when its sphere or its box
+            //is completely behind the plane
+            for(int i = 0; i < count; ++i)
             {
-                Mesh* mesh = model->getMeshes()[j];
-                if(mesh->frameCount > 0)
+                float distance = a*x[i] + b*y[i] + c*z[i] + d;
+                float boxRadius = absA*ex[i] + absB*ey[i] + absC*ez[i];
+                float radius = (boxRadius < r[i] ? boxRadius : r[i]);
+                result[i] &= (distance >= -radius);
+            }
+        }
+
+        for(int i = 0; i < count; ++i)
+            if(result[i]) visibleList.push_back(cullCandidates[i]);
+    }
+
+    void Scene::buildInstanceBatches(const vector<Object*>& visibleObjects)
+    {
+        static vector<VisibleInstance> visible;
+        visible.clear();
+
+        for(unsigned int i = 0; i < visibleObjects.size(); ++i)
+        {
+            VisibleInstance inst;
+            inst.model = visibleObjects[i]->model;
+            inst.lodLevel = visibleObjects[i]->lodLevel;
+            inst.object = visibleObjects[i];
+            inst.frame = visibleObjects[i]->getAnimationFrame();
+            inst.interpolation = visibleObjects[i]->getAnimationInterpolation();
+            visible.push_back(inst);
+        }
+
+        //Group by model and level of detail so every group is one instanced draw per mesh.
+        //The objects are already grouped by model, see groupObjectsByModel,
+        //so only the levels of detail within a model are sorted
+        for(unsigned int first = 0; first < visible.size(); )
+        {
+            unsigned int end = first + 1;
+            while(end < visible.size() && visible[end].model == visible[first].model)
+                ++end;
+            std::sort(visible.begin() + first, visible.begin() + end);
+            first = end;
+        }
+
+        const mat4* matrices = transformSystem.getMatrices();
+        instanceData.resize(visible.size());
+        instanceBatches.clear();
+        paletteData.clear();
+        for(unsigned int i = 0; i < visible.size(); ++i)
+        {
+            InstanceData& data = instanceData[i];
+            data.mMatrix = matrices[visible[i].object->transformSlot];
+            data.tintAndInterpolation = vec4(visible[i].object->getTintColor(), visible[i].interpolation);
+            data.frame = visible[i].frame;
+            data.nextFrame = visible[i].model->getNextFrame(visible[i].frame);
+            data.padding[0] = data.padding[1] = 0;
+
+            //Bone animated models: evaluate the pose into the palette,
+            //the frame of the instance is the first bone in the palette.
+            //Instances in the same pose share it
+            int boneCount = visible[i].model->getBoneCount();
+            if(boneCount > 0)
+            {
+                if(i > 0 && visible[i-1].model == visible[i].model
+                        && visible[i-1].frame == visible[i].frame
+                        && visible[i-1].interpolation == visible[i].interpolation)
+                {
+                    data.frame = instanceData[i-1].frame;
+                }
+                else
                 {
-                    Material* mat = model->getMaterials()[mesh->materialIndex];
-                    basicProgram->setUniform4fv("parameters", vec4(mat->specAmp,mat->specPow,mat->ambient,mat->diffuse));
-                    basicProgram->setUniform1i("tex", 0);
-                    glActiveTexture(GL_TEXTURE0);
-                    if(mat) glBindTexture(GL_TEXTURE_2D, mat->texture->handle);
-
-                    glBindVertexArray(mesh->vaoHandles[frame]);
-                    glDrawArrays(mesh->primitiveType, 0, mesh->vertexCount);
+                    int paletteBase = paletteData.size() / 3;
+                    paletteData.resize(paletteData.size() + 3 * boneCount);
+                    visible[i].model->evaluatePose(visible[i].frame, data.nextFrame, visible[i].interpolation, &paletteData[3 * paletteBase]);
+                    data.frame = paletteBase;
                 }
             }
+
+            if(instanceBatches.empty() || visible[i-1].model != visible[i].model
+                    || visible[i-1].lodLevel != visible[i].lodLevel)
+            {
+                InstanceBatch batch;
+                batch.model = visible[i].model;
+                batch.lodLevel = visible[i].lodLevel;
+                batch.firstInstance = i;
+                batch.instanceCount = 0;
+                instanceBatches.push_back(batch);
+            }
+            instanceBatches.back().instanceCount++;
         }
 
-        glBindFramebuffer(GL_FRAMEBUFFER, 0);
-        glViewport(0, 0, Root::shared().getWindowWidth(), Root::shared().getWindowHeight());
+        //Orphan the old storage so the driver does not have to wait
+        //for the previous pass to finish reading from it
+        glBindBuffer(GL_ARRAY_BUFFER, instanceBuffer);
+        glBufferData(GL_ARRAY_BUFFER, instanceData.size() * sizeof(InstanceData), 0, GL_STREAM_DRAW);
+        if(!instanceData.empty())
+            glBufferSubData(GL_ARRAY_BUFFER, 0, instanceData.size() * sizeof(InstanceData), &instanceData[0]);
 
-        //------------------------------
-        // TERRAIN AND DECALS
-        //------------------------------
+        //All poses of this pass in one upload
+        if(!paletteData.empty())
+        {
+            glBindBuffer(GL_TEXTURE_BUFFER, paletteBuffer);
+            glBufferData(GL_TEXTURE_BUFFER, paletteData.size() * sizeof(vec4), &paletteData[0], GL_STREAM_DRAW);
+            glBindBuffer(GL_TEXTURE_BUFFER, 0);
+        }
+    }
 
-        currentTerrain->render(camera);
-		Decals::shared().render();
+    void Scene::queueInstanceBatches(RenderPass pass)
+    {
+        instanceDraws.clear();
 
-        //------------------------------
-        // NORMAL PASS
-        //------------------------------
+        RenderItem item;
+        item.owner = this;
+        item.program = basicProgram->getHandle();
+        item.textureUnit = 0;
+        for(unsigned int b = 0; b < instanceBatches.size(); ++b)
+        {
+            const InstanceBatch& batch = instanceBatches[b];
+            Model* model = batch.model;
+            for(unsigned int j = 0; j < model->getMeshes().size(); ++j)
+            {
+                Mesh* mesh = model->getMeshes()[j];
+                if(mesh->frameCount <= 0) continue;
+
+                InstanceDraw draw;
+                draw.mesh = mesh;
+                draw.material = model->getMaterials()[mesh->materialIndex];
+                draw.lodLevel = batch.lodLevel;
+                draw.firstInstance = batch.firstInstance;
+                draw.instanceCount = batch.instanceCount;
+                instanceDraws.push_back(draw);
+
+                item.texture = (draw.material ? draw.material->texture->handle : 0);
+                item.vertexArray = mesh->vaoHandle;
+                item.index = instanceDraws.size() - 1;
+                item.sortKey = renderQueue.makeSortKey(pass, item.program, item.texture, item.vertexArray, 0.0f);
+                renderQueue.addItem(item);
+            }
+        }
+    }
 
-        basicProgram->use();
+    void Scene::renderItem(const RenderItem& item)
+    {
+        const InstanceDraw& draw = instanceDraws[item.index];
+        GLStateCache::shared().setBlend(false);
+        GLStateCache::shared().setDepthTest(true);
+        GLStateCache::shared().setCullFace(true);
 
-        basicProgram->setUniformMatrix4fv("vpMatrix", camera->getVPMatrix());
-        //basicProgram->setUniformMatrix4fv("viewMatrix", camera->getVMatrix());
+        if(draw.material)
+            basicProgram->setUniform4fv(parametersLocation, draw.material->getParameters());
 
-        for(unsigned int i = 0; i < objects.size(); ++i)
+        //Decoding of compressed meshes
+        basicProgram->setUniform3fv(positionOffsetLocation, draw.mesh->positionOffset);
+        basicProgram->setUniform3fv(positionScaleLocation, draw.mesh->positionScale);
+        basicProgram->setUniform1i(octNormalsLocation, draw.mesh->compressed ? 1 : 0);
+
+        basicProgram->setUniform1i(batchedLocation, 0);
+
+        //Skinned meshes read the pose of the instance from the palette
+        basicProgram->setUniform1i(skinnedLocation, draw.mesh->skinned ? 1 : 0);
+        if(draw.mesh->skinned)
+            GLStateCache::shared().bindTexture(PALETTE_TEXTURE_UNIT, paletteTexture, GL_TEXTURE_BUFFER);
+
+        //Animated meshes read their frames from a buffer texture
+        basicProgram->setUniform1i(animatedLocation, draw.mesh->isAnimated() ? 1 : 0);
+        if(draw.mesh->isAnimated())
         {
-            if( objects[i]->model == 0 ) continue;
-            if(objects[i]->isObsolete()) continue;
-
-			mat4 totalMatrix = camera->getVPMatrix() * objects[i]->getMoveMatrix();
-			bool flag = false;
-			for(int j = 0; j < 8; j++)
-			{
-				vec4 onScreen(objects[i]->model->getBoundingBoxVertex(j), 1.0);
-				onScreen = totalMatrix * onScreen;
-				onScreen /= onScreen.w;
-				if(!(onScreen.x < -1.0 || onScreen.x > 1.0 || onScreen.y < -1.0 || onScreen.y > 1.0))
-				{
-					flag = true;
-					break;
-				}
-			}
-			if(flag == false) continue;
-
-			// fog of war
-			if(!fm->isVisible(objects[i]->getPosition2()))
-				continue;
-
-			basicProgram->setUniform3fv("tintColor", objects[i]->getTintColor());
-            basicProgram->setUniformMatrix4fv("mMatrix", objects[i]->getMoveMatrix());
-
-            int frame = 0;
-            float interpolation = 0.0f;
-            AnimationState* animState = objects[i]->getAnimationState(); //can be zero
-            if(animState)
+            basicProgram->setUniform1i(vertexCountLocation, draw.mesh->vertexCount);
+            GLStateCache::shared().bindTexture(FRAME_TEXTURE_UNIT, draw.mesh->frameTexture, GL_TEXTURE_BUFFER);
+        }
+
+        //Instance attributes: mMatrix in 5-8, tint and interpolation in 9,
+        //frame and next frame in 10.
+        //These are part of the VAO state, so set them for this draw
+        const GLsizei stride = sizeof(InstanceData);
+        const GLubyte* base = reinterpret_cast<GLubyte*>(0) + draw.firstInstance * stride;
+        glBindBuffer(GL_ARRAY_BUFFER, instanceBuffer);
+        for(int c = 0; c < 4; ++c)
+        {
+            glEnableVertexAttribArray(5 + c);
+            glVertexAttribPointer(5 + c, 4, GL_FLOAT, GL_FALSE, stride, base + c * sizeof(vec4));
+            glVertexAttribDivisor(5 + c, 1);
+        }
+        glEnableVertexAttribArray(9);
+        glVertexAttribPointer(9, 4, GL_FLOAT, GL_FALSE, stride, base + sizeof(mat4));
+        glVertexAttribDivisor(9, 1);
+        glEnableVertexAttribArray(10);
+        glVertexAttribIPointer(10, 2, GL_INT, stride, base + sizeof(mat4) + sizeof(vec4));
+        glVertexAttribDivisor(10, 1);
+
+        //The index buffer, with all levels of detail, is part of the VAO
+        if(draw.mesh->indexCount > 0)
+        {
+            const MeshLOD& lod = draw.mesh->getLOD(draw.lodLevel);
+            glDrawElementsInstanced(draw.mesh->primitiveType, lod.indexCount, GL_UNSIGNED_INT,
+                    reinterpret_cast<GLubyte*>(0) + lod.firstIndex * sizeof(GLuint), draw.instanceCount);
+        }
+        else
+            glDrawArraysInstanced(draw.mesh->primitiveType, 0, draw.mesh->vertexCount, draw.instanceCount);
+    }
+
+    //FNV-1a
+    static unsigned int hashBytes(unsigned int hash, const void* data, unsigned int size)
+    {
+        const unsigned char* bytes = reinterpret_cast<const unsigned char*>(data);
+        for(unsigned int i = 0; i < size; ++i)
+            hash = (hash ^ bytes[i]) * 16777619u;
+        return hash;
+    }
+
+    //Changes when a static caster is added, removed, moved,
+    //reaches another key frame or changes its level of detail. The interpolation between key
+    //frames is ignored so animated casters do not redraw every frame
+    static unsigned int getCasterSignature(const vector<Object*>& casters)
+    {
+        unsigned int hash = 2166136261u;
+        for(unsigned int i = 0; i < casters.size(); ++i)
+        {
+            Object* obj = casters[i];
+            Model* model = obj->getModel();
+            const vec3& position = obj->getPosition();
+            float yaw = obj->getYaw();
+            int frame = obj->getAnimationFrame();
+            int lodLevel = obj->getLODLevel();
+            hash = hashBytes(hash, &obj, sizeof(obj));
+            hash = hashBytes(hash, &model, sizeof(model));
+            hash = hashBytes(hash, &position.x, sizeof(float));
+            hash = hashBytes(hash, &position.y, sizeof(float));
+            hash = hashBytes(hash, &position.z, sizeof(float));
+            hash = hashBytes(hash, &yaw, sizeof(yaw));
+            hash = hashBytes(hash, &frame, sizeof(frame));
+            hash = hashBytes(hash, &lodLevel, sizeof(lodLevel));
+        }
+        return hash;
+    }
+
+    void Scene::renderShadowCasters(const vector<Object*>& casters, const mat4* batchLightMatrix)
+    {
+        renderQueue.clear();
+        if(!casters.empty())
+        {
+            buildInstanceBatches(casters);
+            queueInstanceBatches(PASS_SHADOW);
+        }
+        if(batchLightMatrix)
+            staticBatcher->queueRender(*batchLightMatrix, PASS_SHADOW, renderQueue);
+        renderQueue.submit();
+    }
+
+    void Scene::renderShadowCascades()
+    {
+        glViewport(0, 0, SHADOW_MAP_SIZE, SHADOW_MAP_SIZE);
+
+        for(int c = 0; c < SHADOW_CASCADES; ++c)
+        {
+            ShadowCascade& cascade = cascades[c];
+
+            //Caster culling in light space
+            cullAgainstFrustum(cascade.lightMatrix, shadowCasters);
+            staticCasters.clear();
+            dynamicCasters.clear();
+            for(unsigned int i = 0; i < shadowCasters.size(); ++i)
             {
-                frame = animState->getCurFrame();
-                interpolation = animState->getInterpolation();
-                basicProgram->setUniform1f("interpolation", interpolation);
+                if(shadowCasters[i]->isStatic())
+                    staticCasters.push_back(shadowCasters[i]);
+                else
+                    dynamicCasters.push_back(shadowCasters[i]);
             }
 
-            Model* model = objects[i]->model;
-            for(unsigned int j = 0; j < model->getMeshes().size(); ++j)
+            sceneConstants->bindBlock(CONSTANTS_SHADOW + c, SCENE_CONSTANTS_BINDING);
+
+            //The static batches are part of the cached layer
+            unsigned int signature = getCasterSignature(staticCasters);
+            unsigned int batchSignature = staticBatcher->getSignature();
+            signature = hashBytes(signature, &batchSignature, sizeof(batchSignature));
+            if(!cascade.staticValid || signature != cascade.staticSignature)
             {
-                Mesh* mesh = model->getMeshes()[j];
-                if(mesh->frameCount > 0)
-                {
-                    Material* mat = model->getMaterials()[mesh->materialIndex];
-                    basicProgram->setUniform4fv("parameters", vec4(mat->specAmp,mat->specPow,mat->ambient,mat->diffuse));
-                    basicProgram->setUniform1i("tex", 0);
-                    glActiveTexture(GL_TEXTURE0);
-                    if(mat) glBindTexture(GL_TEXTURE_2D, mat->texture->handle);
-
-                    glBindVertexArray(mesh->vaoHandles[frame]);
-                    glDrawArrays(mesh->primitiveType, 0, mesh->vertexCount);
-                }
+                glBindFramebuffer(GL_FRAMEBUFFER, staticShadowFBOHandles[c]);
+                glClear(GL_DEPTH_BUFFER_BIT);
+                renderShadowCasters(staticCasters, &cascade.lightMatrix);
+                cascade.staticSignature = signature;
+                cascade.staticValid = true;
             }
+
+            //Start from the cached static casters
+            glBindFramebuffer(GL_READ_FRAMEBUFFER, staticShadowFBOHandles[c]);
+            glBindFramebuffer(GL_DRAW_FRAMEBUFFER, shadowFBOHandles[c]);
+            glBlitFramebuffer(0, 0, SHADOW_MAP_SIZE, SHADOW_MAP_SIZE,
+                    0, 0, SHADOW_MAP_SIZE, SHADOW_MAP_SIZE, GL_DEPTH_BUFFER_BIT, GL_NEAREST);
+
+            glBindFramebuffer(GL_FRAMEBUFFER, shadowFBOHandles[c]);
+            if(!dynamicCasters.empty())
+                renderShadowCasters(dynamicCasters, 0);
         }
+    }
+
+    void Scene::render()
+    {
+        Root::shared().checkForErrors("scene render start");
+
+        cullObjects();
+        updateSceneConstants();
+
+        //------------------------------
+        // SHADOW PASS
+        //------------------------------
+
+        renderShadowCascades();
+
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        glViewport(0, 0, Root::shared().getWindowWidth(), Root::shared().getWindowHeight());
+
+        //------------------------------
+        // TERRAIN, DECALS AND OBJECTS
+        //------------------------------
+
+        sceneConstants->bindBlock(CONSTANTS_CAMERA, SCENE_CONSTANTS_BINDING);
+
+        renderQueue.clear();
+
+        currentTerrain->queueRender(camera, renderQueue);
+		Decals::shared().queueRender(renderQueue);
+
+        buildInstanceBatches(visibleForCamera);
+        queueInstanceBatches(PASS_OBJECTS);
+        staticBatcher->queueRender(camera->getVPMatrix(), PASS_OBJECTS, renderQueue);
+        renderQueue.submit();
+
+        //Restore the default state
+        GLStateCache& stateCache = GLStateCache::shared();
+        stateCache.setBlend(false);
+        stateCache.setDepthTest(true);
+        stateCache.setCullFace(true);
+        stateCache.bindVertexArray(0);
 
         Root::shared().checkForErrors("scene render end");
 
@@ -6,6 +6,7 @@
 #include "common/Logger.h"
 #include "Shaders.h"
 #include "Files.h"
+#include "RenderQueue.h"
 
 using std::string;
 
@@ -194,22 +195,61 @@ namespace Arya
             return false;
         }
 
+        resolveUniforms();
+
+        GLuint blockIndex = glGetUniformBlockIndex(handle, "SceneConstants");
+        if(blockIndex != GL_INVALID_INDEX)
+            glUniformBlockBinding(handle, blockIndex, SCENE_CONSTANTS_BINDING);
+
 		valid = true;
         return true;
     }
 
+    void ShaderProgram::resolveUniforms()
+    {
+        uniformLocations.clear();
+
+        GLint uniformCount = 0;
+        GLint maxLength = 0;
+        glGetProgramiv(handle, GL_ACTIVE_UNIFORMS, &uniformCount);
+        glGetProgramiv(handle, GL_ACTIVE_UNIFORM_MAX_LENGTH, &maxLength);
+        if(uniformCount <= 0 || maxLength <= 0) return;
+
+        char* nameBuf = new char[maxLength];
+        for(GLint i = 0; i < uniformCount; ++i)
+        {
+            GLsizei length;
+            GLint size;
+            GLenum type;
+            glGetActiveUniform(handle, i, maxLength, &length, &size, &type, nameBuf);
+
+            //Uniforms inside a block have no location
+            GLint location = glGetUniformLocation(handle, nameBuf);
+            if(location < 0) continue;
+
+            //Arrays are reported as "name[0]"
+            string uniformName(nameBuf, length);
+            if(uniformName.size() > 3 && uniformName.compare(uniformName.size() - 3, 3, "[0]") == 0)
+                uniformName.erase(uniformName.size() - 3);
+            uniformLocations[uniformName] = location;
+        }
+        delete[] nameBuf;
+    }
+
     void ShaderProgram::use()
     {
-        glUseProgram(handle);
+        GLStateCache::shared().useProgram(handle);
     }
 
     //---------------------------
     // Uniforms
     //---------------------------
 
-    GLuint ShaderProgram::getUniformLocation(const char* name)
+    GLint ShaderProgram::getUniformLocation(const char* name)
     {
-        return glGetUniformLocation(handle, name);
+        map<string, GLint>::iterator iter = uniformLocations.find(name);
+        if(iter == uniformLocations.end()) return -1;
+        return iter->second;
     }
 
     void ShaderProgram::setUniform1i(const char* name, int val)
@@ -241,4 +281,95 @@ namespace Arya
     {
         glUniformMatrix4fv(getUniformLocation(name), 1, false, &matrix[0][0]);
     }
+
+    void ShaderProgram::setUniform1i(GLint location, int val)
+    {
+        glUniform1i(location, val);
+    }
+
+    void ShaderProgram::setUniform1f(GLint location, float val)
+    {
+        glUniform1f(location, val);
+    }
+
+    void ShaderProgram::setUniform2fv(GLint location, const vec2& values)
+    {
+        glUniform2fv(location, 1, &values[0]);
+    }
+
+    void ShaderProgram::setUniform3fv(GLint location, const vec3& values)
+    {
+        glUniform3fv(location, 1, &values[0]);
+    }
+
+    void ShaderProgram::setUniform4fv(GLint location, const vec4& values)
+    {
+        glUniform4fv(location, 1, &values[0]);
+    }
+
+    void ShaderProgram::setUniformMatrix4fv(GLint location, const mat4& matrix)
+    {
+        glUniformMatrix4fv(location, 1, false, &matrix[0][0]);
+    }
+
+    //---------------------------------------------------------
+    // UNIFORM BUFFER
+    //---------------------------------------------------------
+
+    UniformBuffer::UniformBuffer()
+    {
+        handle = 0;
+        blockSize = 0;
+        blockStride = 0;
+        blockCount = 0;
+    }
+
+    UniformBuffer::~UniformBuffer()
+    {
+        if(handle)
+            glDeleteBuffers(1, &handle);
+    }
+
+    bool UniformBuffer::init(unsigned int size, unsigned int count)
+    {
+        GLint alignment = 0;
+        glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &alignment);
+        if(alignment <= 0) alignment = 256;
+
+        blockSize = size;
+        blockCount = count;
+        blockStride = ((size + alignment - 1) / alignment) * alignment;
+        data.assign(blockStride * blockCount, 0);
+
+        if(!handle) glGenBuffers(1, &handle);
+        if(!handle)
+        {
+            LOG_ERROR("Unable to create uniform buffer");
+            return false;
+        }
+        glBindBuffer(GL_UNIFORM_BUFFER, handle);
+        glBufferData(GL_UNIFORM_BUFFER, data.size(), 0, GL_DYNAMIC_DRAW);
+        glBindBuffer(GL_UNIFORM_BUFFER, 0);
+        return true;
+    }
+
+    void UniformBuffer::setBlock(unsigned int index, const void* blockData)
+    {
+        if(index >= blockCount) return;
+        memcpy(&data[index * blockStride], blockData, blockSize);
+    }
+
+    void UniformBuffer::upload()
+    {
+        if(data.empty()) return;
+        glBindBuffer(GL_UNIFORM_BUFFER, handle);
+        glBufferSubData(GL_UNIFORM_BUFFER, 0, data.size(), &data[0]);
+        glBindBuffer(GL_UNIFORM_BUFFER, 0);
+    }
+
+    void UniformBuffer::bindBlock(unsigned int index, GLuint bindingPoint)
+    {
+        if(index >= blockCount) return;
+        glBindBufferRange(GL_UNIFORM_BUFFER, bindingPoint, handle, index * blockStride, blockSize);
+    }
 }
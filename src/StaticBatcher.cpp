@@ -0,0 +1,469 @@
+#include <map>
+#include <cmath>
+#include <cstddef>
+
+#include "StaticBatcher.h"
+#include "Objects.h"
+#include "Models.h"
+#include "Mesh.h"
+#include "Materials.h"
+#include "Textures.h"
+#include "Shaders.h"
+#include "Camera.h"
+#include "common/Logger.h"
+
+namespace Arya
+{
+    //Texture unit of the per object data, see staticmodel.vert
+    static const int OBJECT_DATA_TEXTURE_UNIT = 11;
+    //Vertex attribute with the batch slot of the object
+    static const int OBJECT_INDEX_ATTRIBUTE = 11;
+    //Width of the square cells in world units. Larger cells
+    //mean fewer draw calls but coarser culling
+    static const float STATIC_BATCH_CELL_SIZE = 256.0f;
+
+    StaticBatcher::StaticBatcher()
+    {
+        cellsDirty = false;
+        objectBuffer = 0;
+        objectTexture = 0;
+        buildCount = 0;
+        signature = 0;
+        program = 0;
+        parametersLocation = -1;
+        positionOffsetLocation = -1;
+        positionScaleLocation = -1;
+        octNormalsLocation = -1;
+        animatedLocation = -1;
+        skinnedLocation = -1;
+        batchedLocation = -1;
+    }
+
+    StaticBatcher::~StaticBatcher()
+    {
+        cleanup();
+    }
+
+    bool StaticBatcher::init(ShaderProgram* objectProgram)
+    {
+        program = objectProgram;
+        program->use();
+        program->setUniform1i("objectData", OBJECT_DATA_TEXTURE_UNIT);
+        parametersLocation = program->getUniformLocation("parameters");
+        positionOffsetLocation = program->getUniformLocation("positionOffset");
+        positionScaleLocation = program->getUniformLocation("positionScale");
+        octNormalsLocation = program->getUniformLocation("octNormals");
+        animatedLocation = program->getUniformLocation("animated");
+        skinnedLocation = program->getUniformLocation("skinned");
+        batchedLocation = program->getUniformLocation("batched");
+
+        glGenBuffers(1, &objectBuffer);
+        glGenTextures(1, &objectTexture);
+        if(!objectBuffer || !objectTexture)
+        {
+            LOG_ERROR("Unable to create static batch object buffer");
+            return false;
+        }
+        glBindBuffer(GL_TEXTURE_BUFFER, objectBuffer);
+        glBufferData(GL_TEXTURE_BUFFER, sizeof(vec4), 0, GL_STREAM_DRAW);
+        glBindTexture(GL_TEXTURE_BUFFER, objectTexture);
+        glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, objectBuffer);
+        glBindTexture(GL_TEXTURE_BUFFER, 0);
+        glBindBuffer(GL_TEXTURE_BUFFER, 0);
+        GLStateCache::shared().invalidate();
+        return true;
+    }
+
+    void StaticBatcher::cleanup()
+    {
+        for(CellMap::iterator it = cells.begin(); it != cells.end(); ++it)
+            deleteChunks(it->second);
+        cells.clear();
+        chunks.clear();
+        freeChunks.clear();
+        GLStateCache::shared().invalidate();
+
+        //Objects that are still alive are not batched anymore
+        for(unsigned int i = 0; i < batchedObjects.size(); ++i)
+            if(batchedObjects[i].object) batchedObjects[i].object->batchSlot = -1;
+        for(unsigned int i = 0; i < changedObjects.size(); ++i)
+            changedObjects[i]->batchPending = false;
+        batchedObjects.clear();
+        freeSlots.clear();
+        changedObjects.clear();
+        cellsDirty = false;
+
+        objectData.clear();
+        if(objectTexture) glDeleteTextures(1, &objectTexture);
+        objectTexture = 0;
+        if(objectBuffer) glDeleteBuffers(1, &objectBuffer);
+        objectBuffer = 0;
+    }
+
+    bool StaticBatcher::canBatch(Object* obj)
+    {
+        if(!obj->isStatic() || obj->isObsolete()) return false;
+        Model* model = obj->getModel();
+        if(!model) return false;
+        if(model->getAnimationCount() > 0 || model->getBoneCount() > 0) return false;
+
+        //Only kept for static triangle meshes in the plain vertex formats
+        const vector<Mesh*>& meshes = model->getMeshes();
+        for(unsigned int i = 0; i < meshes.size(); ++i)
+            if(!meshes[i]->geometry) return false;
+        return true;
+    }
+
+    void StaticBatcher::objectChanged(Object* obj)
+    {
+        if(obj->batchPending) return;
+        obj->batchPending = true;
+        changedObjects.push_back(obj);
+    }
+
+    void StaticBatcher::removeObject(Object* obj)
+    {
+        if(obj->batchPending)
+        {
+            for(unsigned int i = 0; i < changedObjects.size(); ++i)
+            {
+                if(changedObjects[i] != obj) continue;
+                changedObjects[i] = changedObjects.back();
+                changedObjects.pop_back();
+                break;
+            }
+            obj->batchPending = false;
+        }
+        if(obj->batchSlot >= 0)
+        {
+            removeFromCell(obj->batchSlot);
+            freeSlot(obj->batchSlot);
+            obj->batchSlot = -1;
+        }
+    }
+
+    void StaticBatcher::update()
+    {
+        for(unsigned int i = 0; i < changedObjects.size(); ++i)
+        {
+            Object* obj = changedObjects[i];
+            obj->batchPending = false;
+            bool batchable = canBatch(obj);
+            if(obj->batchSlot >= 0)
+            {
+                removeFromCell(obj->batchSlot);
+                if(!batchable)
+                {
+                    freeSlot(obj->batchSlot);
+                    obj->batchSlot = -1;
+                }
+            }
+            else if(batchable)
+            {
+                if(freeSlots.empty())
+                {
+                    obj->batchSlot = batchedObjects.size();
+                    batchedObjects.push_back(BatchedObject());
+                    objectData.push_back(vec4(0.0f));
+                }
+                else
+                {
+                    obj->batchSlot = freeSlots.back();
+                    freeSlots.pop_back();
+                }
+                batchedObjects[obj->batchSlot].object = obj;
+            }
+            if(batchable)
+                addToCell(obj->batchSlot);
+        }
+        changedObjects.clear();
+
+        if(!cellsDirty) return;
+        cellsDirty = false;
+
+        int builtCells = 0;
+        for(CellMap::iterator it = cells.begin(); it != cells.end(); )
+        {
+            Cell& cell = it->second;
+            if(!cell.dirty)
+            {
+                ++it;
+                continue;
+            }
+            //No object refers to an empty cell
+            if(cell.slots.empty())
+            {
+                deleteChunks(cell);
+                cells.erase(it++);
+                continue;
+            }
+            buildCell(cell);
+            ++builtCells;
+            ++it;
+        }
+        GLStateCache::shared().invalidate();
+
+        ++buildCount;
+        signature = buildCount;
+
+        LOG_INFO("Static batches: built " << builtCells << " cells, " << getObjectCount()
+                << " objects in " << getChunkCount() << " chunks");
+    }
+
+    void StaticBatcher::addToCell(int slot)
+    {
+        const vec3& position = batchedObjects[slot].object->getPosition();
+        std::pair<int, int> key((int)std::floor(position.x / STATIC_BATCH_CELL_SIZE),
+                (int)std::floor(position.z / STATIC_BATCH_CELL_SIZE));
+        CellMap::iterator cell = cells.find(key);
+        if(cell == cells.end())
+            cell = cells.insert(std::make_pair(key, Cell())).first;
+        cell->second.slots.push_back(slot);
+        cell->second.dirty = true;
+        cellsDirty = true;
+        batchedObjects[slot].cell = cell;
+    }
+
+    void StaticBatcher::removeFromCell(int slot)
+    {
+        Cell& cell = batchedObjects[slot].cell->second;
+        for(unsigned int i = 0; i < cell.slots.size(); ++i)
+        {
+            if(cell.slots[i] != slot) continue;
+            cell.slots[i] = cell.slots.back();
+            cell.slots.pop_back();
+            break;
+        }
+        cell.dirty = true;
+        cellsDirty = true;
+    }
+
+    void StaticBatcher::freeSlot(int slot)
+    {
+        batchedObjects[slot].object = 0;
+        objectData[slot] = vec4(0.0f);
+        freeSlots.push_back(slot);
+    }
+
+    void StaticBatcher::deleteChunks(Cell& cell)
+    {
+        for(unsigned int i = 0; i < cell.chunks.size(); ++i)
+        {
+            Chunk& chunk = chunks[cell.chunks[i]];
+            glDeleteVertexArrays(1, &chunk.vaoHandle);
+            glDeleteBuffers(1, &chunk.vertexBuffer);
+            glDeleteBuffers(1, &chunk.indexBuffer);
+            chunk.vaoHandle = chunk.vertexBuffer = chunk.indexBuffer = 0;
+            freeChunks.push_back(cell.chunks[i]);
+        }
+        cell.chunks.clear();
+    }
+
+    //A mesh of a batched object
+    struct ChunkPart
+    {
+        int slot;
+        const Mesh* mesh;
+    };
+
+    void StaticBatcher::buildCell(Cell& cell)
+    {
+        cell.dirty = false;
+        deleteChunks(cell);
+
+        std::map<Material*, vector<ChunkPart> > parts;
+        for(unsigned int i = 0; i < cell.slots.size(); ++i)
+        {
+            ChunkPart part;
+            part.slot = cell.slots[i];
+            Model* model = batchedObjects[part.slot].object->getModel();
+            const vector<Mesh*>& meshes = model->getMeshes();
+            for(unsigned int j = 0; j < meshes.size(); ++j)
+            {
+                part.mesh = meshes[j];
+                parts[model->getMaterials()[meshes[j]->materialIndex]].push_back(part);
+            }
+        }
+
+        vector<BatchVertex> vertices;
+        vector<GLuint> indices;
+        for(std::map<Material*, vector<ChunkPart> >::iterator it = parts.begin(); it != parts.end(); ++it)
+        {
+            Chunk chunk;
+            chunk.material = it->first;
+            chunk.boundsMin = vec3(1e30f);
+            chunk.boundsMax = vec3(-1e30f);
+            vertices.clear();
+            indices.clear();
+
+            const vector<ChunkPart>& chunkParts = it->second;
+            for(unsigned int p = 0; p < chunkParts.size(); ++p)
+            {
+                const ChunkPart& part = chunkParts[p];
+                const MeshGeometry& mesh = *part.mesh->geometry;
+
+                //Objects are only rotated and translated, so the
+                //normals are transformed with the same matrix
+                const mat4& mMatrix = batchedObjects[part.slot].object->getMoveMatrix();
+                const GLuint firstVertex = vertices.size();
+                for(unsigned int v = 0; v < mesh.positions.size(); ++v)
+                {
+                    vec4 position = mMatrix * vec4(mesh.positions[v], 1.0f);
+                    vec4 normal = mMatrix * vec4(mesh.normals[v], 0.0f);
+                    BatchVertex vertex;
+                    vertex.position[0] = position.x;
+                    vertex.position[1] = position.y;
+                    vertex.position[2] = position.z;
+                    vertex.texCoord[0] = mesh.texCoords[v].x;
+                    vertex.texCoord[1] = mesh.texCoords[v].y;
+                    vertex.normal[0] = normal.x;
+                    vertex.normal[1] = normal.y;
+                    vertex.normal[2] = normal.z;
+                    vertex.object = part.slot;
+                    vertices.push_back(vertex);
+
+                    chunk.boundsMin = glm::min(chunk.boundsMin, vec3(position.x, position.y, position.z));
+                    chunk.boundsMax = glm::max(chunk.boundsMax, vec3(position.x, position.y, position.z));
+                }
+                for(unsigned int i = 0; i < mesh.indices.size(); ++i)
+                    indices.push_back(firstVertex + mesh.indices[i]);
+            }
+
+            if(indices.empty()) continue;
+            if(!createChunk(chunk, vertices, indices)) continue;
+            if(freeChunks.empty())
+            {
+                cell.chunks.push_back(chunks.size());
+                chunks.push_back(chunk);
+            }
+            else
+            {
+                cell.chunks.push_back(freeChunks.back());
+                chunks[freeChunks.back()] = chunk;
+                freeChunks.pop_back();
+            }
+        }
+    }
+
+    bool StaticBatcher::createChunk(Chunk& chunk, const vector<BatchVertex>& vertices, const vector<GLuint>& indices)
+    {
+        chunk.vaoHandle = chunk.vertexBuffer = chunk.indexBuffer = 0;
+        chunk.indexCount = indices.size();
+
+        glGenVertexArrays(1, &chunk.vaoHandle);
+        glGenBuffers(1, &chunk.vertexBuffer);
+        glGenBuffers(1, &chunk.indexBuffer);
+        if(!chunk.vaoHandle || !chunk.vertexBuffer || !chunk.indexBuffer)
+        {
+            LOG_ERROR("Unable to create static batch buffers");
+            if(chunk.vaoHandle) glDeleteVertexArrays(1, &chunk.vaoHandle);
+            if(chunk.vertexBuffer) glDeleteBuffers(1, &chunk.vertexBuffer);
+            if(chunk.indexBuffer) glDeleteBuffers(1, &chunk.indexBuffer);
+            return false;
+        }
+
+        glBindVertexArray(chunk.vaoHandle);
+        glBindBuffer(GL_ARRAY_BUFFER, chunk.vertexBuffer);
+        glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(BatchVertex), &vertices[0], GL_STATIC_DRAW);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, chunk.indexBuffer);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(GLuint), &indices[0], GL_STATIC_DRAW);
+
+        const GLsizei stride = sizeof(BatchVertex);
+        const GLubyte* base = reinterpret_cast<GLubyte*>(0);
+        glEnableVertexAttribArray(0); //pos
+        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, stride, base + offsetof(BatchVertex, position));
+        glEnableVertexAttribArray(1); //tex
+        glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, stride, base + offsetof(BatchVertex, texCoord));
+        glEnableVertexAttribArray(2); //norm
+        glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, stride, base + offsetof(BatchVertex, normal));
+        glEnableVertexAttribArray(OBJECT_INDEX_ATTRIBUTE);
+        glVertexAttribIPointer(OBJECT_INDEX_ATTRIBUTE, 1, GL_INT, stride, base + offsetof(BatchVertex, object));
+
+        glBindVertexArray(0);
+        return true;
+    }
+
+    void StaticBatcher::setObjectVisible(int slot, bool visible)
+    {
+        float w = (visible ? 1.0f : 0.0f);
+        //The cached shadows have to be redrawn when an object appears or disappears
+        if(objectData[slot].w != w)
+            signature = signature * 16777619u + slot + 1;
+        objectData[slot].w = w;
+    }
+
+    void StaticBatcher::updateObjectData()
+    {
+        if(objectData.empty()) return;
+        for(unsigned int i = 0; i < batchedObjects.size(); ++i)
+        {
+            if(!batchedObjects[i].object) continue;
+            vec3 tint = batchedObjects[i].object->getTintColor();
+            objectData[i].x = tint.x;
+            objectData[i].y = tint.y;
+            objectData[i].z = tint.z;
+        }
+        glBindBuffer(GL_TEXTURE_BUFFER, objectBuffer);
+        glBufferData(GL_TEXTURE_BUFFER, objectData.size() * sizeof(vec4), &objectData[0], GL_STREAM_DRAW);
+        glBindBuffer(GL_TEXTURE_BUFFER, 0);
+    }
+
+    void StaticBatcher::queueRender(const mat4& vpMatrix, RenderPass pass, RenderQueue& queue)
+    {
+        if(chunks.size() == freeChunks.size()) return;
+
+        vec4 planes[6];
+        getFrustumPlanes(vpMatrix, planes);
+
+        RenderItem item;
+        item.owner = this;
+        item.program = program->getHandle();
+        item.textureUnit = 0;
+        for(unsigned int i = 0; i < chunks.size(); ++i)
+        {
+            const Chunk& chunk = chunks[i];
+            if(!chunk.vaoHandle) continue;
+            vec3 center = 0.5f * (chunk.boundsMin + chunk.boundsMax);
+            vec3 extent = 0.5f * (chunk.boundsMax - chunk.boundsMin);
+
+            bool inside = true;
+            for(int p = 0; p < 6 && inside; ++p)
+            {
+                const vec4& plane = planes[p];
+                float distance = plane.x*center.x + plane.y*center.y + plane.z*center.z + plane.w;
+                float radius = glm::abs(plane.x)*extent.x + glm::abs(plane.y)*extent.y + glm::abs(plane.z)*extent.z;
+                inside = (distance >= -radius);
+            }
+            if(!inside) continue;
+
+            item.texture = (chunk.material && chunk.material->texture ? chunk.material->texture->handle : 0);
+            item.vertexArray = chunk.vaoHandle;
+            item.index = i;
+            item.sortKey = queue.makeSortKey(pass, item.program, item.texture, item.vertexArray, 0.0f);
+            queue.addItem(item);
+        }
+    }
+
+    void StaticBatcher::renderItem(const RenderItem& item)
+    {
+        const Chunk& chunk = chunks[item.index];
+        GLStateCache& stateCache = GLStateCache::shared();
+        stateCache.setBlend(false);
+        stateCache.setDepthTest(true);
+        stateCache.setCullFace(true);
+
+        if(chunk.material)
+            program->setUniform4fv(parametersLocation, chunk.material->getParameters());
+
+        //The vertices are decoded and in world space already
+        program->setUniform3fv(positionOffsetLocation, vec3(0.0f));
+        program->setUniform3fv(positionScaleLocation, vec3(1.0f));
+        program->setUniform1i(octNormalsLocation, 0);
+        program->setUniform1i(animatedLocation, 0);
+        program->setUniform1i(skinnedLocation, 0);
+        program->setUniform1i(batchedLocation, 1);
+        stateCache.bindTexture(OBJECT_DATA_TEXTURE_UNIT, objectTexture, GL_TEXTURE_BUFFER);
+
+        glDrawElements(GL_TRIANGLES, chunk.indexCount, GL_UNSIGNED_INT, 0);
+    }
+}
@@ -0,0 +1,73 @@
+#include "StreamBuffer.h"
+#include "common/Logger.h"
+
+namespace Arya
+{
+    StreamBuffer::StreamBuffer()
+    {
+        target = GL_ARRAY_BUFFER;
+        handle = 0;
+        size = 0;
+        position = 0;
+        mappedOffset = 0;
+    }
+
+    StreamBuffer::~StreamBuffer()
+    {
+        if(handle)
+            glDeleteBuffers(1, &handle);
+    }
+
+    bool StreamBuffer::init(GLenum _target, unsigned int _size)
+    {
+        target = _target;
+        size = _size;
+        position = 0;
+
+        glGenBuffers(1, &handle);
+        glBindBuffer(target, handle);
+        glBufferData(target, size, 0, GL_STREAM_DRAW);
+        glBindBuffer(target, 0);
+        return handle != 0;
+    }
+
+    void* StreamBuffer::map(unsigned int bytes)
+    {
+        if(!handle || bytes == 0 || bytes > size) return 0;
+
+        glBindBuffer(target, handle);
+
+        position = (position + 15) & ~15u;
+        if(position + bytes > size)
+        {
+            //Orphan, the old storage stays valid for pending GL calls
+            glBufferData(target, size, 0, GL_STREAM_DRAW);
+            position = 0;
+        }
+
+        //Nothing the GPU still reads is in this range, so no need to synchronize
+        void* data = glMapBufferRange(target, position, bytes,
+                GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+        if(!data)
+        {
+            LOG_WARNING("Could not map stream buffer");
+            return 0;
+        }
+
+        mappedOffset = position;
+        position += bytes;
+        return data;
+    }
+
+    unsigned int StreamBuffer::unmap()
+    {
+        if(glUnmapBuffer(target) == GL_FALSE)
+            LOG_WARNING("Stream buffer data was lost while mapped");
+        return mappedOffset;
+    }
+
+    void StreamBuffer::unbind()
+    {
+        glBindBuffer(target, 0);
+    }
+}
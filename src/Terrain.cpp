@@ -14,6 +14,8 @@
 #include "FogMap.h"
 
 #include <string>
+#include <string.h>
+#include <algorithm>
 using std::string;
 
 using glm::log;
@@ -36,11 +38,29 @@ namespace Arya
         splatMap = sm;
         vertexBuffer = 0;
         indexBuffer = 0;
-        indexCount = 0;
+        vaoHandle = 0;
+        gridSize = 0;
         terrainProgram = 0;
+        scaleMatrixLocation = -1;
+        for(int i = 0; i < 4; ++i) parametersLocation[i] = -1;
+        pageLayerLocation = -1;
+        pageOffsetLocation = -1;
+        pageScaleLocation = -1;
+        maxPixelError = 4.0f;
+        boundsChanged = true;
         patchCount = 0;
         patchSizeMax = 0;
         levelMax = 0;
+        paged = false;
+        pageCount = 1;
+        overviewLOD = 0;
+        pagePoolHandle = 0;
+        for(int i = 0; i < PAGE_POOL_SIZE; ++i)
+        {
+            layerPage[i] = -1;
+            layerLastUsed[i] = 0;
+        }
+        pageFrame = 0;
 
         heightMapHandle = 0;
 		waterMapHandle = 0;
@@ -52,12 +72,10 @@ namespace Arya
 
     Terrain::~Terrain()
     {
-        if(indexBuffer) {
-            glDeleteBuffers(levelMax, indexBuffer);
-            delete[] indexBuffer;
-        }
-        if(indexCount)
-            delete[] indexCount;
+        if(indexBuffer)
+            glDeleteBuffers(1, &indexBuffer);
+        if(vaoHandle)
+            glDeleteVertexArrays(1, &vaoHandle);
         if(terrainProgram) 
             delete terrainProgram;
 
@@ -66,6 +84,8 @@ namespace Arya
 
         if(heightMapHandle)
             glDeleteTextures(1, &heightMapHandle);
+        if(pagePoolHandle)
+            glDeleteTextures(1, &pagePoolHandle);
 
 		if(waterMapHandle)
 			glDeleteTextures(1, &waterMapHandle);
@@ -100,6 +120,29 @@ namespace Arya
         terrainProgram->attach(terrainFragment);
         if(!(terrainProgram->link())) return false;
 
+        //The texture units never change
+        terrainProgram->use();
+        terrainProgram->setUniform1i("heightMap", 0);
+        terrainProgram->setUniform1i("splatTexture", 1);
+        terrainProgram->setUniform1i("texture1", 2);
+        terrainProgram->setUniform1i("texture2", 3);
+        terrainProgram->setUniform1i("texture3", 4);
+        terrainProgram->setUniform1i("texture4", 5);
+        terrainProgram->setUniform1i("fogMap", 6);
+        terrainProgram->setUniform1i("shadowMap", 7);
+        terrainProgram->setUniform1i("heightPages", 8);
+
+        terrainProgram->setUniform1f("oneOverGridSize", 1.0f / (gridSize - 1));
+
+        scaleMatrixLocation = terrainProgram->getUniformLocation("scaleMatrix");
+        parametersLocation[0] = terrainProgram->getUniformLocation("parameters1");
+        parametersLocation[1] = terrainProgram->getUniformLocation("parameters2");
+        parametersLocation[2] = terrainProgram->getUniformLocation("parameters3");
+        parametersLocation[3] = terrainProgram->getUniformLocation("parameters4");
+        pageLayerLocation = terrainProgram->getUniformLocation("pageLayer");
+        pageOffsetLocation = terrainProgram->getUniformLocation("pageOffset");
+        pageScaleLocation = terrainProgram->getUniformLocation("pageScale");
+
 		Shader* waterVertex = new Shader(VERTEX);
         if(!(waterVertex->addSourceFile("../shaders/water.vert"))) return false;
         if(!(waterVertex->compile())) return false;
@@ -119,15 +162,22 @@ namespace Arya
         //hFile = FileSystem::shared().getFile(heightMapString);
         //if(!hFile) return false;
 
-        glGenTextures(1, &heightMapHandle);
-        glBindTexture(GL_TEXTURE_2D, heightMapHandle);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-
-        glPixelStorei(GL_UNPACK_ALIGNMENT, 2);
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_R16, terrainSize, terrainSize, 0, GL_RED, GL_UNSIGNED_SHORT, heightData);
+        if(paged)
+        {
+            if(!generatePages()) return false;
+        }
+        else
+        {
+            glGenTextures(1, &heightMapHandle);
+            glBindTexture(GL_TEXTURE_2D, heightMapHandle);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+            glPixelStorei(GL_UNPACK_ALIGNMENT, 2);
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_R16, terrainSize, terrainSize, 0, GL_RED, GL_UNSIGNED_SHORT, heightData);
+        }
 
 		// load in watermap
         string waterMapString(waterMapName);
@@ -143,8 +193,14 @@ namespace Arya
         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
 
-        glPixelStorei(GL_UNPACK_ALIGNMENT, 2);
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_R16, terrainSize, terrainSize, 0, GL_RED, GL_UNSIGNED_SHORT, wFile->getData());
+        //The watermap is not paged, it has to match the size of the heightmap
+        if(wFile->getSize() >= sizeof(GLushort) * terrainSize * terrainSize)
+        {
+            glPixelStorei(GL_UNPACK_ALIGNMENT, 2);
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_R16, terrainSize, terrainSize, 0, GL_RED, GL_UNSIGNED_SHORT, wFile->getData());
+        }
+        else
+            LOG_WARNING("Watermap is smaller than the heightmap and is not used");
 		
 
 
@@ -165,30 +221,49 @@ namespace Arya
         w = terrainSize;
         h = terrainSize;
 
-        if(!(((w-1) & (w-2)) == 0) || w != h) {
+        // Larger heightmaps are split in pages of 1024x1024 quads.
+        // The number of pages per row has to be a power of two
+        // so that the overview texture holds every pageCount-th sample
+        paged = false;
+        pageCount = 1;
+        if(w == h && w > PAGE_QUADS + 1 && (w-1) % PAGE_QUADS == 0)
+        {
+            int pages = (w-1) / PAGE_QUADS;
+            if((pages & (pages-1)) == 0 && pages <= 64)
+            {
+                paged = true;
+                pageCount = pages;
+            }
+        }
+
+        if(!paged && (!(((w-1) & (w-2)) == 0) || w != h)) {
             LOG_WARNING("Heightmap is of the wrong size. Must be of the form 2^n + 1, and square.");
             w = 1025;
             h = 1025;
             LOG_INFO("Heightmap: width and height set to default value (1025).");
         }
 
-        patchCount = 16; // default: 16 x 16 grid
+        patchCount = PATCHES_PER_PAGE * pageCount; // default: 16 x 16 grid
         patchSizeMax = (w-1)/patchCount + 1; // default: 1024/16 + 1 = 65x65
 
-        GLfloat* vertexData = new GLfloat[patchSizeMax*patchSizeMax * 2];
+        overviewLOD = 0;
+        while((1 << overviewLOD) < pageCount) ++overviewLOD;
 
-        float perVertex = (1.0f / ((patchSizeMax - 1) * patchCount));
+        // One vertex per heightmap sample of a page, holding its integer grid
+        // position. Patches select their part of the grid with a base vertex
+        gridSize = (patchSizeMax - 1) * PATCHES_PER_PAGE + 1;
+        GLushort* vertexData = new GLushort[gridSize*gridSize * 2];
 
-        for(int i = 0; i < patchSizeMax; ++i)
-            for(int j = 0; j < patchSizeMax; ++j) {
-                vertexData[2*i*patchSizeMax + 2*j + 0] = j*perVertex;
-                vertexData[2*i*patchSizeMax + 2*j + 1] = i*perVertex;
+        for(int i = 0; i < gridSize; ++i)
+            for(int j = 0; j < gridSize; ++j) {
+                vertexData[2*i*gridSize + 2*j + 0] = j;
+                vertexData[2*i*gridSize + 2*j + 1] = i;
             }
 
         glGenBuffers(1, &vertexBuffer);
         glBindBuffer(GL_ARRAY_BUFFER, vertexBuffer);
         glBufferData(GL_ARRAY_BUFFER, 
-                sizeof(GLfloat) * patchSizeMax*patchSizeMax * 2, 
+                sizeof(GLushort) * gridSize*gridSize * 2, 
                 vertexData,
                 GL_STATIC_DRAW);
 
@@ -201,60 +276,288 @@ namespace Arya
                 p.offset = vec2((1.0 / patchCount)*j, (1.0 / patchCount)*i);
                 p.position = (vec2(-0.5 + 0.5 / patchCount) + p.offset);
                 p.lod = -1;
+                p.cameraDistance = 0.0f;
                 patches.push_back(p);
+                patchPage.push_back((i / PATCHES_PER_PAGE) * pageCount + j / PATCHES_PER_PAGE);
             }
+        lodFloor.assign(patches.size(), 0);
+        pageLayer.assign(pageCount * pageCount, -1);
 
         generateIndices();
+        computePatchErrors();
+
+        return true;
+    }
+
+    bool Terrain::generatePages()
+    {
+        // Overview with every pageCount-th sample,
+        // the same size as a single page
+        int overviewSize = PAGE_QUADS + 1;
+        const unsigned short* heights = reinterpret_cast<const unsigned short*>(heightData);
+        vector<GLushort> overview(overviewSize * overviewSize);
+        for(int i = 0; i < overviewSize; ++i)
+            for(int j = 0; j < overviewSize; ++j)
+                overview[i*overviewSize + j] = heights[(i*pageCount)*terrainSize + j*pageCount];
+
+        glGenTextures(1, &heightMapHandle);
+        glBindTexture(GL_TEXTURE_2D, heightMapHandle);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
 
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 2);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_R16, overviewSize, overviewSize, 0, GL_RED, GL_UNSIGNED_SHORT, &overview[0]);
+
+        // Pool for the full resolution pages, one layer per page.
+        // Neighbouring pages share their border samples
+        glGenTextures(1, &pagePoolHandle);
+        glBindTexture(GL_TEXTURE_2D_ARRAY, pagePoolHandle);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_R16, PAGE_QUADS + 1, PAGE_QUADS + 1, PAGE_POOL_SIZE,
+                0, GL_RED, GL_UNSIGNED_SHORT, 0);
+
+        LOG_INFO("Paged terrain: " << pageCount << "x" << pageCount << " pages");
         return true;
     }
 
+    //Sorts pages by distance to the camera
+    struct PageDistanceCompare
+    {
+        bool operator()(const std::pair<float,int>& a, const std::pair<float,int>& b) const { return a.first < b.first; }
+    };
+
+    bool Terrain::updateResidency(const vec3& camPos)
+    {
+        ++pageFrame;
+
+        //Camera position in pages
+        vec4 local = glm::inverse(scaleMatrix) * vec4(camPos.x, camPos.y, camPos.z, 1.0f);
+        float cx = (local.x + 0.5f) * pageCount;
+        float cy = (local.z + 0.5f) * pageCount;
+
+        //The pages within one page size of the camera are needed, at most 3x3
+        vector<std::pair<float,int> > wanted;
+        for(int py = (int)(cy - 1.0f); py <= (int)(cy + 1.0f); ++py)
+            for(int px = (int)(cx - 1.0f); px <= (int)(cx + 1.0f); ++px)
+            {
+                if(px < 0 || py < 0 || px >= pageCount || py >= pageCount) continue;
+                float dx = px + 0.5f - cx;
+                float dy = py + 0.5f - cy;
+                wanted.push_back(std::make_pair(dx*dx + dy*dy, py*pageCount + px));
+            }
+        std::sort(wanted.begin(), wanted.end(), PageDistanceCompare());
+
+        for(unsigned int i = 0; i < wanted.size(); ++i)
+            if(pageLayer[wanted[i].second] >= 0)
+                layerLastUsed[pageLayer[wanted[i].second]] = pageFrame;
+
+        //Upload the closest missing page into the least recently used layer
+        for(unsigned int i = 0; i < wanted.size(); ++i)
+        {
+            int page = wanted[i].second;
+            if(pageLayer[page] >= 0) continue;
+
+            int layer = -1;
+            for(int l = 0; l < PAGE_POOL_SIZE && layer < 0; ++l)
+                if(layerPage[l] < 0) layer = l;
+            if(layer < 0)
+            {
+                for(int l = 0; l < PAGE_POOL_SIZE; ++l)
+                    if(layerLastUsed[l] != pageFrame && (layer < 0 || layerLastUsed[l] < layerLastUsed[layer]))
+                        layer = l;
+            }
+            if(layer < 0) return false;
+
+            if(layerPage[layer] >= 0)
+                pageLayer[layerPage[layer]] = -1;
+            uploadPage(page, layer);
+            layerPage[layer] = page;
+            layerLastUsed[layer] = pageFrame;
+            pageLayer[page] = layer;
+            return true;
+        }
+        return false;
+    }
+
+    void Terrain::uploadPage(int page, int layer)
+    {
+        int px = page % pageCount;
+        int py = page / pageCount;
+        const unsigned short* heights = reinterpret_cast<const unsigned short*>(heightData);
+        const unsigned short* first = heights + (py*PAGE_QUADS)*terrainSize + px*PAGE_QUADS;
+
+        GLStateCache::shared().bindTexture(8, pagePoolHandle, GL_TEXTURE_2D_ARRAY);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 2);
+        glPixelStorei(GL_UNPACK_ROW_LENGTH, terrainSize);
+        glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, layer, PAGE_QUADS + 1, PAGE_QUADS + 1, 1,
+                GL_RED, GL_UNSIGNED_SHORT, first);
+        glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+    }
+
+    float Terrain::getHeight(int x, int y) const
+    {
+        if(x >= terrainSize) x = terrainSize - 1;
+        if(y >= terrainSize) y = terrainSize - 1;
+        const unsigned short* heights = reinterpret_cast<const unsigned short*>(heightData);
+        return heights[y*terrainSize + x] / 65535.0f;
+    }
+
+    void Terrain::computePatchErrors()
+    {
+        lodErrors.assign(patches.size() * levelMax, 0.0f);
+
+        int patchQuads = patchSizeMax - 1;
+        for(int py = 0; py < patchCount; ++py)
+            for(int px = 0; px < patchCount; ++px)
+            {
+                Patch& p = patches[py*patchCount + px];
+                int baseX = px * patchQuads;
+                int baseY = py * patchQuads;
+
+                p.minHeight = 1.0f;
+                p.maxHeight = 0.0f;
+                for(int j = 0; j < patchSizeMax; ++j)
+                    for(int i = 0; i < patchSizeMax; ++i)
+                    {
+                        float h = getHeight(baseX + i, baseY + j);
+                        if(h < p.minHeight) p.minHeight = h;
+                        if(h > p.maxHeight) p.maxHeight = h;
+                    }
+
+                //Level l only has every 2^l-th vertex. The error is the largest
+                //difference between a skipped vertex and the bilinear
+                //interpolation of the corners of its cell
+                float* errors = &lodErrors[(py*patchCount + px) * levelMax];
+                for(int l = 1; l < levelMax; ++l)
+                {
+                    int step = 1 << l;
+                    float maxError = errors[l-1];
+                    for(int cy = 0; cy < patchQuads; cy += step)
+                        for(int cx = 0; cx < patchQuads; cx += step)
+                        {
+                            float h00 = getHeight(baseX + cx, baseY + cy);
+                            float h10 = getHeight(baseX + cx + step, baseY + cy);
+                            float h01 = getHeight(baseX + cx, baseY + cy + step);
+                            float h11 = getHeight(baseX + cx + step, baseY + cy + step);
+                            for(int j = 0; j <= step; ++j)
+                                for(int i = 0; i <= step; ++i)
+                                {
+                                    float fx = i / (float)step;
+                                    float fy = j / (float)step;
+                                    float interpolated = (1.0f-fy)*((1.0f-fx)*h00 + fx*h10) + fy*((1.0f-fx)*h01 + fx*h11);
+                                    float error = glm::abs(getHeight(baseX + cx + i, baseY + cy + j) - interpolated);
+                                    if(error > maxError) maxError = error;
+                                }
+                        }
+                    errors[l] = maxError;
+                }
+            }
+    }
+
+    void Terrain::updatePatchBounds()
+    {
+        float delta = 1.0f/((float)patchCount);
+        for(unsigned int i = 0; i < patches.size(); ++i)
+        {
+            Patch& p = patches[i];
+            p.boundsMin = vec3(1e30f);
+            p.boundsMax = vec3(-1e30f);
+            for(int c = 0; c < 8; ++c)
+            {
+                vec4 corner(p.offset.x - 0.5f + delta*(c%2),
+                            (c/4 == 0 ? p.minHeight : p.maxHeight),
+                            p.offset.y - 0.5f + delta*((c/2)%2),
+                            1.0f);
+                corner = scaleMatrix * corner;
+                p.boundsMin = glm::min(p.boundsMin, vec3(corner.x, corner.y, corner.z));
+                p.boundsMax = glm::max(p.boundsMax, vec3(corner.x, corner.y, corner.z));
+            }
+        }
+    }
+
+    GLuint Terrain::stitchedIndex(int i, int j, int level, int edgeMask) const
+    {
+        // Vertices on an edge next to a coarser patch that are not
+        // part of the coarser grid are moved onto their neighbour.
+        // The triangles that use them become degenerate or stretch
+        // to the coarser edge, so the edges match exactly.
+        int last = patchSizeMax - 1;
+        int coarseStep = 2 << level;
+        int step = 1 << level;
+        if(j == 0 && (edgeMask & EDGE_BOTTOM) && i % coarseStep) i -= step;
+        else if(j == last && (edgeMask & EDGE_TOP) && i % coarseStep) i += step;
+        else if(i == 0 && (edgeMask & EDGE_LEFT) && j % coarseStep) j -= step;
+        else if(i == last && (edgeMask & EDGE_RIGHT) && j % coarseStep) j += step;
+        return j*gridSize + i;
+    }
+
     bool Terrain::generateIndices()
     {
         // make indices for all possibilities
         // level 0: patchSizeMax^2
         // ...
         // level levels: 1^2
+        // Every level has a variant for every combination of
+        // edges that border a patch one level coarser.
+        // All variants are stored in one index buffer
 
         levelMax = log((float)(patchSizeMax-1), 2.0f) + 1;
 
-        indexBuffer = new GLuint[levelMax];
-        indexCount = new GLuint[levelMax];
-
-        glGenBuffers(levelMax, indexBuffer);
-
-        GLuint* indices = new GLuint[patchSizeMax * (patchSizeMax-1) * 2 + (patchSizeMax - 1)];
+        variantOffset.assign(levelMax * EDGE_VARIANTS, 0);
+        variantCount.assign(levelMax * EDGE_VARIANTS, 0);
 
+        vector<GLuint> indices;
         for(int l = 0; l < levelMax; ++l)
         {
-            int c = 0;
-            //int levelSize = (patchSizeMax-1)/(1 << l) + 1;
-            // level l
-            int row = 0;
-            for(int j = 0; j < patchSizeMax - 1; j += 1 << l) {
-                if(row++ % 2 == 0)
-                    for(int i = 0; i < patchSizeMax; i += 1 << l) {
-                        indices[c++] = j*patchSizeMax + i;
-                        indices[c++] = (j+(1 << l))*patchSizeMax + i;
-                    }
-                else
-                    for(int i = 0; i < patchSizeMax; i += 1 << l) {
-                        indices[c++] = j*patchSizeMax + patchSizeMax - 1 - i;
-                        indices[c++] = (j+(1 << l))*patchSizeMax + patchSizeMax - 1 - i;
+            int step = 1 << l;
+            for(int mask = 0; mask < EDGE_VARIANTS; ++mask)
+            {
+                // The coarsest level never has a coarser neighbour
+                if(l == levelMax - 1 && mask != 0)
+                {
+                    variantOffset[l*EDGE_VARIANTS + mask] = variantOffset[l*EDGE_VARIANTS];
+                    variantCount[l*EDGE_VARIANTS + mask] = variantCount[l*EDGE_VARIANTS];
+                    continue;
+                }
+
+                variantOffset[l*EDGE_VARIANTS + mask] = indices.size();
+                for(int j = 0; j < patchSizeMax - 1; j += step)
+                    for(int i = 0; i < patchSizeMax - 1; i += step)
+                    {
+                        GLuint a = stitchedIndex(i, j, l, mask);
+                        GLuint b = stitchedIndex(i + step, j, l, mask);
+                        GLuint c = stitchedIndex(i + step, j + step, l, mask);
+                        GLuint d = stitchedIndex(i, j + step, l, mask);
+
+                        // same winding as the old triangle strips
+                        if(a != c && a != b && b != c)
+                        {
+                            indices.push_back(a);
+                            indices.push_back(c);
+                            indices.push_back(b);
+                        }
+                        if(a != d && a != c && c != d)
+                        {
+                            indices.push_back(a);
+                            indices.push_back(d);
+                            indices.push_back(c);
+                        }
                     }
-                indices[c] = indices[c-1];
-                c++;
+                variantCount[l*EDGE_VARIANTS + mask] = indices.size() - variantOffset[l*EDGE_VARIANTS + mask];
             }
-
-            indexCount[l] = c;
-            glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indexBuffer[l]);
-            glBufferData(GL_ELEMENT_ARRAY_BUFFER,
-                    sizeof(GLuint) * indexCount[l],
-                    indices,
-                    GL_STATIC_DRAW);
         }
 
-        delete[] indices;
+        glGenBuffers(1, &indexBuffer);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indexBuffer);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER,
+                sizeof(GLuint) * indices.size(),
+                &indices[0],
+                GL_STATIC_DRAW);
 
         if(!generateVAO()) return false;
         return true;
@@ -262,19 +565,14 @@ namespace Arya
 
     bool Terrain::generateVAO()
     {
-        vaoHandles = new GLuint[levelMax];
-        glGenVertexArrays(levelMax, vaoHandles);
-
-        for(int l = 0; l < levelMax; ++l) 
-        {
-            glBindVertexArray(vaoHandles[l]);
+        glGenVertexArrays(1, &vaoHandle);
+        glBindVertexArray(vaoHandle);
 
-            glEnableVertexAttribArray(0);
-            glBindBuffer(GL_ARRAY_BUFFER, vertexBuffer);
-            glVertexAttribPointer(0, 2, GL_FLOAT, false, 0, (void*)0);
+        glEnableVertexAttribArray(0);
+        glBindBuffer(GL_ARRAY_BUFFER, vertexBuffer);
+        glVertexAttribPointer(0, 2, GL_UNSIGNED_SHORT, false, 0, (void*)0);
 
-            glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indexBuffer[l]);
-        }
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indexBuffer);
 
         // prevent other code from mesing up our vao
         glBindVertexArray(0);
@@ -287,23 +585,45 @@ namespace Arya
 
 		time+=dt;
 
-        // update patches LOD
-        mat4 vpScaleMatrix = curScene->getCamera()->getVPMatrix() * scaleMatrix;
-        vec3 camPos = curScene->getCamera()->getRealCameraPosition();
+        Camera* cam = curScene->getCamera();
+        mat4 vpMatrix = cam->getVPMatrix();
+        vec3 camPos = cam->getRealCameraPosition();
+
+        bool pagesChanged = paged && updateResidency(camPos);
+
+        //Nothing changes as long as the camera stands still
+        if(!pagesChanged && !boundsChanged && memcmp(&vpMatrix[0][0], &lastVPMatrix[0][0], sizeof(mat4)) == 0)
+            return;
+        lastVPMatrix = vpMatrix;
+
+        if(boundsChanged)
+        {
+            updatePatchBounds();
+            boundsChanged = false;
+        }
+
+        vec4 planes[6];
+        getFrustumPlanes(vpMatrix, planes);
+
+        //A world space length at distance d is this many pixels per d on the screen
+        float pixelsPerUnit = 0.5f * cam->getProjectionMatrix()[1][1] * Root::shared().getWindowHeight();
+        float heightScale = glm::length(vec3(scaleMatrix[1][0], scaleMatrix[1][1], scaleMatrix[1][2]));
 
-        float delta = 1.0f/((float)patchCount);
         for(unsigned int i = 0; i < patches.size(); ++i)
         {
             Patch& p = patches[i];
-            //Project the 4 corners on the screen
-            bool inScreen = false;
-            for(int j = 0; j < 4; ++j)
+
+            //AABB against the frustum planes
+            vec3 center = 0.5f * (p.boundsMin + p.boundsMax);
+            vec3 extent = 0.5f * (p.boundsMax - p.boundsMin);
+            bool inScreen = true;
+            for(int j = 0; j < 6; ++j)
             {
-                vec4 onScreen = vpScaleMatrix * vec4(p.offset.x -0.5 + delta*(j%2), 0, p.offset.y -0.5 + delta*(j/2), 1.0);
-                onScreen /= onScreen.w;
-                if(onScreen.x > -1.1 && onScreen.x < 1.1 && onScreen.y > -1.1 && onScreen.y < 1.1)
+                float planeDistance = planes[j].x*center.x + planes[j].y*center.y + planes[j].z*center.z + planes[j].w;
+                float radius = glm::abs(planes[j].x)*extent.x + glm::abs(planes[j].y)*extent.y + glm::abs(planes[j].z)*extent.z;
+                if(planeDistance < -radius)
                 {
-                    inScreen = true;
+                    inScreen = false;
                     break;
                 }
             }
@@ -312,129 +632,215 @@ namespace Arya
                 p.lod = -1;
                 continue;
             }
-            float dist = distance(vec3(scaleMatrix[0][0] * p.position.x, 0.0f, scaleMatrix[2][2] * p.position.y), camPos);
-            if(dist < 300.0f)
-                p.lod = 0;
-            else if(dist < 600.0f)
-                p.lod = 1;
-            else if(dist < 900.0f)
-                p.lod = 2;
-            else if(dist < 1200.0f)
-                p.lod = 3;
-            else if(dist < 1500.0f)
-                p.lod = 4;
-            else
-                p.lod = levelMax -1;
-        }
-    }
-
-    //---------------------------------------
-    // RENDER
-    //---------------------------------------
-
-    void Terrain::render(Camera* cam)
-    {
-        static mat4 biasMatrix(
-            0.5f, 0.0f, 0.0f, 0.0f,
-            0.0f, 0.5f, 0.0f, 0.0f,
-            0.0f, 0.0f, 0.5f, 0.0f,
-            0.5f, 0.5f, 0.5f, 1.0f
-        );
-
-        Root::shared().checkForErrors("terrain render start");
-
-        terrainProgram->use();
-        terrainProgram->setUniformMatrix4fv("vpMatrix", cam->getVPMatrix());
-		terrainProgram->setUniformMatrix4fv("viewMatrix", cam->getVMatrix());
-        terrainProgram->setUniformMatrix4fv("scaleMatrix", scaleMatrix);
-        terrainProgram->setUniformMatrix4fv("lightOrthoMatrix", biasMatrix * Root::shared().getScene()->getLightOrthoMatrix());
-		terrainProgram->setUniform3fv("lightDirection", vec3(0.7,0.7,0.0));
 
-        // heightmap
-        terrainProgram->setUniform1i("heightMap", 0);
-        glActiveTexture(GL_TEXTURE0);
-        glBindTexture(GL_TEXTURE_2D, heightMapHandle);
+            //Distance to the closest point of the box
+            vec3 closest = glm::max(p.boundsMin, glm::min(camPos, p.boundsMax));
+            float dist = distance(closest, camPos);
+            p.cameraDistance = distance(center, camPos);
 
-        // splatmap
-        terrainProgram->setUniform1i("splatTexture", 1);
-        glActiveTexture(GL_TEXTURE1);
-        glBindTexture(GL_TEXTURE_2D, splatMap->handle);
-
-        // texture 1 to 4
-		terrainProgram->setUniform4fv("parameters1",tileSet[0]->getParameters());
-		terrainProgram->setUniform4fv("parameters2",tileSet[1]->getParameters());
-		terrainProgram->setUniform4fv("parameters3",tileSet[2]->getParameters());
-		terrainProgram->setUniform4fv("parameters4",tileSet[3]->getParameters());
-
-        terrainProgram->setUniform1i("texture1", 2);
-        glActiveTexture(GL_TEXTURE2);
-        glBindTexture(GL_TEXTURE_2D,tileSet[0]->texture->handle);
-
-        terrainProgram->setUniform1i("texture2", 3);
-        glActiveTexture(GL_TEXTURE3);
-        glBindTexture(GL_TEXTURE_2D, tileSet[1]->texture->handle);
-
-        terrainProgram->setUniform1i("texture3", 4);
-        glActiveTexture(GL_TEXTURE4);
-        glBindTexture(GL_TEXTURE_2D, tileSet[2]->texture->handle);
-
-        terrainProgram->setUniform1i("texture4", 5);
-        glActiveTexture(GL_TEXTURE5);
-        glBindTexture(GL_TEXTURE_2D, tileSet[3]->texture->handle);
-
-        terrainProgram->setUniform1i("shadowMap", 7);
-        glActiveTexture(GL_TEXTURE7);
-        glBindTexture(GL_TEXTURE_2D, Root::shared().getScene()->getShadowDepthTextureHandle());
-
-        terrainProgram->setUniform1i("fogMap", 6);
-        glActiveTexture(GL_TEXTURE6);
-        //glBindTexture(GL_TEXTURE_2D, heightMapHandle);
-        glBindTexture(GL_TEXTURE_2D, Root::shared().getScene()->getFogMap()->getFogMapTextureHandle());
+            //Take the coarsest level with a small enough error on the screen
+            const float* errors = &lodErrors[i * levelMax];
+            p.lod = 0;
+            for(int l = levelMax - 1; l > 0; --l)
+            {
+                if(errors[l] * heightScale * pixelsPerUnit <= maxPixelError * dist)
+                {
+                    p.lod = l;
+                    break;
+                }
+            }
+        }
 
+        restrictLODs();
+        buildDrawList();
+    }
 
-        for(unsigned int i = 0; i < patches.size(); ++i) {
-            Patch& p = patches[i];
-            if(p.lod < 0) continue;
-            terrainProgram->setUniform2fv("patchOffset", p.offset);
+    int Terrain::getNeighbourLOD(int px, int py) const
+    {
+        if(px < 0 || py < 0 || px >= patchCount || py >= patchCount) return -1;
+        return patches[py*patchCount + px].lod;
+    }
 
-            glBindVertexArray(vaoHandles[p.lod]);
-            glDrawElements(GL_TRIANGLE_STRIP, indexCount[p.lod], GL_UNSIGNED_INT, (void*)0);
+    void Terrain::restrictLODs()
+    {
+        //Patches of pages that are not resident can not be finer than the
+        //overview. The floor drops one level per patch away from them, so
+        //the refinement below never has to go under the floor of a patch
+        if(paged)
+        {
+            for(unsigned int i = 0; i < patches.size(); ++i)
+                lodFloor[i] = (pageLayer[patchPage[i]] < 0 ? overviewLOD : 0);
+            for(int l = overviewLOD; l > 1; --l)
+                for(int py = 0; py < patchCount; ++py)
+                    for(int px = 0; px < patchCount; ++px)
+                    {
+                        int& floor = lodFloor[py*patchCount + px];
+                        if(floor >= l - 1) continue;
+                        if((py > 0 && lodFloor[(py-1)*patchCount + px] == l) ||
+                           (py < patchCount - 1 && lodFloor[(py+1)*patchCount + px] == l) ||
+                           (px > 0 && lodFloor[py*patchCount + px - 1] == l) ||
+                           (px < patchCount - 1 && lodFloor[py*patchCount + px + 1] == l))
+                            floor = l - 1;
+                    }
+            for(unsigned int i = 0; i < patches.size(); ++i)
+                if(patches[i].lod >= 0 && patches[i].lod < lodFloor[i])
+                    patches[i].lod = lodFloor[i];
         }
 
-		/* 
-        glEnable(GL_BLEND);
+        //The stitched edges can only bridge one level,
+        //so refine patches until neighbours differ at most one level
+        bool changed = true;
+        while(changed)
+        {
+            changed = false;
+            for(int py = 0; py < patchCount; ++py)
+                for(int px = 0; px < patchCount; ++px)
+                {
+                    Patch& p = patches[py*patchCount + px];
+                    if(p.lod < 0) continue;
+                    int neighbours[4] = {
+                        getNeighbourLOD(px, py - 1), getNeighbourLOD(px, py + 1),
+                        getNeighbourLOD(px - 1, py), getNeighbourLOD(px + 1, py) };
+                    for(int n = 0; n < 4; ++n)
+                    {
+                        if(neighbours[n] >= 0 && p.lod > neighbours[n] + 1)
+                        {
+                            p.lod = neighbours[n] + 1;
+                            changed = true;
+                        }
+                    }
+                }
+        }
+    }
 
-		waterProgram->use();
-        waterProgram->setUniformMatrix4fv("vpMatrix", cam->getVPMatrix());
-		waterProgram->setUniformMatrix4fv("viewMatrix", cam->getVMatrix());
-        waterProgram->setUniformMatrix4fv("scaleMatrix", scaleMatrix);
-		waterProgram->setUniform3fv("lightSource",vec3(0.7,0.7,0.0));
+    //Sorts patch indices front to back
+    struct PatchDistanceCompare
+    {
+        const vector<Patch>* patches;
+        bool operator()(int a, int b) const { return (*patches)[a].cameraDistance < (*patches)[b].cameraDistance; }
+    };
 
-		// watermap
-        waterProgram->setUniform1i("waterMap", 6);
-        glActiveTexture(GL_TEXTURE6);
-        glBindTexture(GL_TEXTURE_2D, waterMapHandle);
+    //Sorts patch indices by the rank of their page
+    struct PatchPageCompare
+    {
+        const vector<int>* patchPage;
+        const vector<int>* pageRank;
+        bool operator()(int a, int b) const { return (*pageRank)[(*patchPage)[a]] < (*pageRank)[(*patchPage)[b]]; }
+    };
 
-		// heightmap
-        waterProgram->setUniform1i("heightMap", 0);
+    void Terrain::buildDrawList()
+    {
+        vector<int> visible;
+        for(unsigned int i = 0; i < patches.size(); ++i)
+            if(patches[i].lod >= 0) visible.push_back(i);
+
+        PatchDistanceCompare compare;
+        compare.patches = &patches;
+        std::sort(visible.begin(), visible.end(), compare);
+
+        //Group the patches per page, pages in order of their closest patch
+        vector<int> pageRank(pageCount * pageCount, -1);
+        int rank = 0;
+        for(unsigned int v = 0; v < visible.size(); ++v)
+            if(pageRank[patchPage[visible[v]]] < 0)
+                pageRank[patchPage[visible[v]]] = rank++;
+        PatchPageCompare pageCompare;
+        pageCompare.patchPage = &patchPage;
+        pageCompare.pageRank = &pageRank;
+        std::stable_sort(visible.begin(), visible.end(), pageCompare);
+
+        drawCounts.clear();
+        drawOffsets.clear();
+        drawBaseVertices.clear();
+        pageDraws.clear();
+        for(unsigned int v = 0; v < visible.size(); ++v)
+        {
+            int i = visible[v];
+            if(pageDraws.empty() || pageDraws.back().page != patchPage[i])
+            {
+                PageDraw draw;
+                draw.page = patchPage[i];
+                draw.first = v;
+                draw.count = 0;
+                pageDraws.push_back(draw);
+            }
+            pageDraws.back().count++;
+
+            int px = i % patchCount;
+            int py = i / patchCount;
+            const Patch& p = patches[i];
+
+            //Edges that border a coarser patch
+            int mask = 0;
+            if(getNeighbourLOD(px, py - 1) > p.lod) mask |= EDGE_BOTTOM;
+            if(getNeighbourLOD(px, py + 1) > p.lod) mask |= EDGE_TOP;
+            if(getNeighbourLOD(px - 1, py) > p.lod) mask |= EDGE_LEFT;
+            if(getNeighbourLOD(px + 1, py) > p.lod) mask |= EDGE_RIGHT;
+
+            int variant = p.lod * EDGE_VARIANTS + mask;
+            drawCounts.push_back(variantCount[variant]);
+            drawOffsets.push_back(reinterpret_cast<GLvoid*>(variantOffset[variant] * sizeof(GLuint)));
+            int pagePx = px % PATCHES_PER_PAGE;
+            int pagePy = py % PATCHES_PER_PAGE;
+            drawBaseVertices.push_back((pagePy*gridSize + pagePx) * (patchSizeMax - 1));
+        }
+    }
 
-		//cloudmap
-		waterProgram->setUniform1i("clouds", 7);
-		glActiveTexture(GL_TEXTURE7);
-        glBindTexture(GL_TEXTURE_2D, cloudMap->handle);
+    //---------------------------------------
+    // RENDER
+    //---------------------------------------
 
-		for(unsigned int i = 0; i < patches.size(); ++i) {
-            Patch& p = patches[i];
-            if(p.lod < 0) continue;
-            waterProgram->setUniform2fv("patchOffset", p.offset);
-			waterProgram->setUniform1f("time", time);
+    void Terrain::queueRender(Camera* cam, RenderQueue& queue)
+    {
+        //The camera and light constants come from the SceneConstants block
+        terrainProgram->use();
+        terrainProgram->setUniformMatrix4fv(scaleMatrixLocation, scaleMatrix);
+        for(int i = 0; i < 4; ++i)
+            terrainProgram->setUniform4fv(parametersLocation[i], tileSet[i]->getParameters());
 
-            glBindVertexArray(vaoHandles[p.lod]);
-            glDrawElements(GL_TRIANGLE_STRIP, indexCount[p.lod], GL_UNSIGNED_INT, (void*)0);
+        //The visible patches of a page are drawn with one call
+        for(unsigned int i = 0; i < pageDraws.size(); ++i)
+        {
+            RenderItem item;
+            item.owner = this;
+            item.program = terrainProgram->getHandle();
+            item.texture = heightMapHandle;
+            item.textureUnit = 0;
+            item.vertexArray = vaoHandle;
+            item.index = i;
+            item.sortKey = queue.makeSortKey(PASS_TERRAIN, item.program, item.texture, item.vertexArray, i / (float)pageDraws.size());
+            queue.addItem(item);
         }
+    }
 
-        glDisable(GL_BLEND); */
+    void Terrain::renderItem(const RenderItem& item)
+    {
+        GLStateCache& stateCache = GLStateCache::shared();
+        stateCache.setBlend(false);
+        stateCache.setDepthTest(true);
+        stateCache.setCullFace(true);
 
-        Root::shared().checkForErrors("terrain render end");
+        //Other items can use these units between queueing and drawing,
+        //so they are bound here. The cache skips them for the next pages
+        // heightmap on unit 0 is bound by the render queue
+        stateCache.bindTexture(1, splatMap->handle);
+
+        // texture 1 to 4
+        for(int i = 0; i < 4; ++i)
+            stateCache.bindTexture(2 + i, tileSet[i]->texture->handle);
+
+        stateCache.bindTexture(7, Root::shared().getScene()->getShadowDepthTextureHandle(), GL_TEXTURE_2D_ARRAY);
+        stateCache.bindTexture(6, Root::shared().getScene()->getFogMap()->getFogMapTextureHandle());
+        if(paged)
+            stateCache.bindTexture(8, pagePoolHandle, GL_TEXTURE_2D_ARRAY);
+
+        const PageDraw& draw = pageDraws[item.index];
+        float pageScale = 1.0f / pageCount;
+        terrainProgram->setUniform1i(pageLayerLocation, pageLayer[draw.page]);
+        terrainProgram->setUniform2fv(pageOffsetLocation, vec2(draw.page % pageCount, draw.page / pageCount) * pageScale);
+        terrainProgram->setUniform1f(pageScaleLocation, pageScale);
+
+        glMultiDrawElementsBaseVertex(GL_TRIANGLES, &drawCounts[draw.first], GL_UNSIGNED_INT,
+                &drawOffsets[draw.first], draw.count, &drawBaseVertices[draw.first]);
     }
 }
@@ -27,8 +27,7 @@ namespace Arya
     }
 
     Texture* TextureManager::loadResource( std::string filename ){
-        filename.insert(0, "textures/");
-        File* imagefile = FileSystem::shared().getFile(filename);
+        File* imagefile = FileSystem::shared().getFile(string("textures/") + filename);
         if( imagefile == 0 ) return 0;
 
         Texture* texture = 0;
@@ -49,7 +48,8 @@ namespace Arya
 
             glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, texture->width, texture->height, 0, GL_RGBA, GL_UNSIGNED_BYTE, ptr);
 
-            addResource(filename, texture);
+            //RGBA8, no mipmaps
+            addResource(filename, texture, texture->width * texture->height * 4);
 
             stbi_image_free(ptr);
         }
@@ -68,12 +68,13 @@ namespace Arya
         if(resourceLoaded(name)) return getTexture(name);
 
         Texture* texture = new Texture;
-        addResource(name, texture);
         texture->handle = handle;
         //Get width and height
         glBindTexture(GL_TEXTURE_2D, texture->handle);
         glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_WIDTH, (GLint*)&texture->width);
-        glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_HEIGHT, (GLint*)&texture->width);
+        glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_HEIGHT, (GLint*)&texture->height);
+        //The caller owns the handle and keeps using it
+        addResource(name, texture, texture->width * texture->height * 4, true);
         return texture;
     }
 
@@ -104,7 +105,7 @@ namespace Arya
 
         delete[] imageData;
 
-        addResource("default", defaultTex);
+        addResource("default", defaultTex, pixelCount * 4, true);
         defaultResource = defaultTex;
 
         return;
@@ -133,7 +134,7 @@ namespace Arya
 
         delete[] imageData;
 
-        addResource("white", whiteTex);
+        addResource("white", whiteTex, pixelCount * 4, true);
         return;
 
     }
@@ -0,0 +1,139 @@
+#include <cmath>
+#include "TransformSystem.h"
+#include "Objects.h"
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+
+using glm::vec4;
+
+namespace Arya
+{
+    static const float DEGREES_TO_RADIANS = 3.14159265358979323846f / 180.0f;
+
+    TransformSystem::TransformSystem()
+    {
+        updatedCount = 0;
+    }
+
+    TransformSystem::~TransformSystem()
+    {
+    }
+
+    int TransformSystem::add(Object* owner)
+    {
+        owners.push_back(owner);
+        positions.push_back(vec3(0.0f));
+        yaws.push_back(0.0f);
+        matrices.push_back(mat4(1.0f));
+        dirty.push_back(0);
+        return owners.size() - 1;
+    }
+
+    void TransformSystem::remove(int slot)
+    {
+        int last = owners.size() - 1;
+        if(slot < 0 || slot > last) return;
+        if(slot != last)
+        {
+            owners[slot] = owners[last];
+            positions[slot] = positions[last];
+            yaws[slot] = yaws[last];
+            matrices[slot] = matrices[last];
+            //The dirty list has the old slot, which update skips
+            dirty[slot] = 0;
+            if(dirty[last]) markDirty(slot);
+            owners[slot]->transformSlot = slot;
+        }
+        owners.pop_back();
+        positions.pop_back();
+        yaws.pop_back();
+        matrices.pop_back();
+        dirty.pop_back();
+    }
+
+    //glm::rotate around y followed by glm::translate
+    static inline void setMoveMatrix(mat4& m, float x, float y, float z, float sinYaw, float cosYaw)
+    {
+        m[0] = vec4(cosYaw, 0.0f, -sinYaw, 0.0f);
+        m[1] = vec4(0.0f, 1.0f, 0.0f, 0.0f);
+        m[2] = vec4(sinYaw, 0.0f, cosYaw, 0.0f);
+        m[3] = vec4(x, y, z, 1.0f);
+    }
+
+    void TransformSystem::computeMatrix(int slot)
+    {
+        float angle = yaws[slot] * DEGREES_TO_RADIANS;
+        const vec3& p = positions[slot];
+        setMoveMatrix(matrices[slot], p.x, p.y, p.z, std::sin(angle), std::cos(angle));
+        dirty[slot] = 0;
+    }
+
+    const mat4& TransformSystem::getMatrix(int slot)
+    {
+        if(dirty[slot]) computeMatrix(slot);
+        return matrices[slot];
+    }
+
+    void TransformSystem::update()
+    {
+        //Gather the dirty slots into contiguous arrays
+        batchSlots.clear();
+        batchX.clear(); batchY.clear(); batchZ.clear();
+        batchSin.clear(); batchCos.clear();
+        const int count = owners.size();
+        for(unsigned int i = 0; i < dirtySlots.size(); ++i)
+        {
+            int slot = dirtySlots[i];
+            if(slot >= count || !dirty[slot]) continue;
+            dirty[slot] = 0;
+
+            float angle = yaws[slot] * DEGREES_TO_RADIANS;
+            batchSlots.push_back(slot);
+            batchX.push_back(positions[slot].x);
+            batchY.push_back(positions[slot].y);
+            batchZ.push_back(positions[slot].z);
+            batchSin.push_back(std::sin(angle));
+            batchCos.push_back(std::cos(angle));
+        }
+        dirtySlots.clear();
+
+        const int batchCount = batchSlots.size();
+        updatedCount = batchCount;
+        int i = 0;
+#ifdef __SSE__
+        //Four matrices at a time: the columns of the four matrices
+        //are the transposed rows of the component registers
+        const __m128 zero = _mm_setzero_ps();
+        const __m128 one = _mm_set1_ps(1.0f);
+        const __m128 yAxis = _mm_set_ps(0.0f, 0.0f, 1.0f, 0.0f);
+        for(; i + 4 <= batchCount; i += 4)
+        {
+            __m128 s = _mm_loadu_ps(&batchSin[i]);
+            __m128 c = _mm_loadu_ps(&batchCos[i]);
+
+            __m128 first0 = c, first1 = zero, first2 = _mm_sub_ps(zero, s), first3 = zero;
+            _MM_TRANSPOSE4_PS(first0, first1, first2, first3);
+            __m128 third0 = s, third1 = zero, third2 = c, third3 = zero;
+            _MM_TRANSPOSE4_PS(third0, third1, third2, third3);
+            __m128 last0 = _mm_loadu_ps(&batchX[i]), last1 = _mm_loadu_ps(&batchY[i]);
+            __m128 last2 = _mm_loadu_ps(&batchZ[i]), last3 = one;
+            _MM_TRANSPOSE4_PS(last0, last1, last2, last3);
+
+            const __m128 firstColumns[4] = { first0, first1, first2, first3 };
+            const __m128 thirdColumns[4] = { third0, third1, third2, third3 };
+            const __m128 lastColumns[4] = { last0, last1, last2, last3 };
+            for(int k = 0; k < 4; ++k)
+            {
+                float* m = &matrices[batchSlots[i + k]][0][0];
+                _mm_storeu_ps(m, firstColumns[k]);
+                _mm_storeu_ps(m + 4, yAxis);
+                _mm_storeu_ps(m + 8, thirdColumns[k]);
+                _mm_storeu_ps(m + 12, lastColumns[k]);
+            }
+        }
+#endif
+        for(; i < batchCount; ++i)
+            setMoveMatrix(matrices[batchSlots[i]], batchX[i], batchY[i], batchZ[i], batchSin[i], batchCos[i]);
+    }
+}
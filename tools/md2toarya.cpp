@@ -3,32 +3,17 @@
 #include <sstream>
 #include <string>
 #include <cstring>
+#include <cmath>
 #include <map>
 #include <algorithm>
+#include <vector>
 #include <GL/glew.h>
 
 using namespace std;
 
-typedef struct{
-    int materialIndex;
-    int primitiveType;
-    int vertexCount; //per frame
-    int hasNormals;
-    int indexCount;
-    int bufferOffset;
-    int indexbufferOffset;
-} SubmeshInfo;
-
-typedef struct{
-    int magic;
-    int modeltype; //1 static, 2 vertex animated, 3 bone animated
-    int submeshCount;
-    int materialCount;
-    int frameCount; //1 for static meshes
-    SubmeshInfo submesh[0];
-} AryaHeader;
-
-#define ARYAMAGICINT (('A' << 0) | ('r' << 8) | ('M' << 16) | ('o' << 24))
+#include "../include/ModelFormat.h"
+
+using namespace Arya;
 
 typedef struct {
     //FILE INFO:
@@ -148,6 +133,627 @@ vec3 anorms[] = {
 #include "anorms.h"
 };
 
+//Maps value in [minValue,maxValue] to [0,65535]
+unsigned short quantize(float value, float minValue, float maxValue)
+{
+    if(maxValue <= minValue) return 0;
+    float q = (value - minValue) / (maxValue - minValue) * 65535.0f + 0.5f;
+    if(q < 0.0f) q = 0.0f;
+    if(q > 65535.0f) q = 65535.0f;
+    return (unsigned short)q;
+}
+
+//Octahedral encoding of a unit normal into two signed bytes
+void octEncode(float x, float y, float z, signed char* out)
+{
+    float length = fabs(x) + fabs(y) + fabs(z);
+    float u = x / length;
+    float v = y / length;
+    if(z < 0.0f)
+    {
+        float foldedU = (1.0f - fabs(v)) * (u >= 0.0f ? 1.0f : -1.0f);
+        float foldedV = (1.0f - fabs(u)) * (v >= 0.0f ? 1.0f : -1.0f);
+        u = foldedU;
+        v = foldedV;
+    }
+    out[0] = (signed char)floor(u * 127.0f + 0.5f);
+    out[1] = (signed char)floor(v * 127.0f + 0.5f);
+}
+
+//
+// Mesh optimization
+//
+//Triangles are reordered for the post-transform vertex cache with
+//Tom Forsyth's linear-speed vertex cache optimization. The result is
+//split into clusters where the cache restarts anyway, and the clusters
+//are sorted so that outward facing ones are drawn first to reduce
+//overdraw. Finally the vertices are renumbered in the order they are
+//first used, so vertex fetches are mostly sequential.
+
+#define OPTIMIZE_CACHE_SIZE 32
+//Size of the FIFO cache that is simulated for the statistics
+#define REPORT_CACHE_SIZE 16
+
+//Average cache miss ratio: transformed vertices per triangle
+float averageCacheMissRatio(const vector<unsigned int>& indices, int cacheSize)
+{
+    if(indices.empty()) return 0.0f;
+    vector<unsigned int> cache;
+    int misses = 0;
+    for(unsigned int i = 0; i < indices.size(); ++i)
+    {
+        if(find(cache.begin(), cache.end(), indices[i]) != cache.end()) continue;
+        ++misses;
+        cache.push_back(indices[i]);
+        if((int)cache.size() > cacheSize) cache.erase(cache.begin());
+    }
+    return (float)misses / (float)(indices.size() / 3);
+}
+
+float forsythVertexScore(int cachePosition, int activeTriangles)
+{
+    if(activeTriangles == 0) return -1.0f;
+    float score = 0.0f;
+    if(cachePosition >= 0)
+    {
+        //The last triangle's vertices get a fixed score, so
+        //the next triangle does not depend on their order
+        if(cachePosition < 3) score = 0.75f;
+        else score = pow(1.0f - (float)(cachePosition - 3) / (OPTIMIZE_CACHE_SIZE - 3), 1.5f);
+    }
+    //Vertices with few triangles left are preferred, to avoid leaving single triangles
+    score += 2.0f * pow((float)activeTriangles, -0.5f);
+    return score;
+}
+
+void optimizeVertexCache(vector<unsigned int>& indices, int vertexCount)
+{
+    const int triangleCount = indices.size() / 3;
+
+    vector<int> activeTriangles(vertexCount, 0);
+    for(unsigned int i = 0; i < indices.size(); ++i) activeTriangles[indices[i]]++;
+    vector<int> adjacencyStart(vertexCount + 1, 0);
+    for(int v = 0; v < vertexCount; ++v) adjacencyStart[v + 1] = adjacencyStart[v] + activeTriangles[v];
+    vector<int> adjacency(indices.size());
+    vector<int> fill(adjacencyStart.begin(), adjacencyStart.end() - 1);
+    for(unsigned int i = 0; i < indices.size(); ++i) adjacency[fill[indices[i]]++] = i / 3;
+
+    vector<int> cachePosition(vertexCount, -1);
+    vector<float> vertexScore(vertexCount);
+    for(int v = 0; v < vertexCount; ++v) vertexScore[v] = forsythVertexScore(-1, activeTriangles[v]);
+    vector<float> triangleScore(triangleCount);
+    for(int t = 0; t < triangleCount; ++t)
+        triangleScore[t] = vertexScore[indices[3*t]] + vertexScore[indices[3*t+1]] + vertexScore[indices[3*t+2]];
+    vector<bool> emitted(triangleCount, false);
+
+    vector<unsigned int> output;
+    output.reserve(indices.size());
+    vector<int> cache, newCache;
+    int bestTriangle = -1;
+    int scanPosition = 0;
+    for(int emittedCount = 0; emittedCount < triangleCount; ++emittedCount)
+    {
+        //No candidate around the cache: take the best remaining triangle
+        if(bestTriangle < 0)
+        {
+            float bestScore = -1e30f;
+            for(int t = scanPosition; t < triangleCount; ++t)
+            {
+                if(emitted[t]) continue;
+                if(triangleScore[t] > bestScore){ bestScore = triangleScore[t]; bestTriangle = t; }
+            }
+            while(scanPosition < triangleCount && emitted[scanPosition]) ++scanPosition;
+        }
+
+        emitted[bestTriangle] = true;
+        newCache.clear();
+        for(int k = 0; k < 3; ++k)
+        {
+            unsigned int v = indices[3*bestTriangle + k];
+            output.push_back(v);
+            newCache.push_back(v);
+            //Remove the triangle from the active list of the vertex
+            for(int a = adjacencyStart[v]; a < adjacencyStart[v] + activeTriangles[v]; ++a)
+            {
+                if(adjacency[a] == bestTriangle)
+                {
+                    adjacency[a] = adjacency[adjacencyStart[v] + activeTriangles[v] - 1];
+                    break;
+                }
+            }
+            activeTriangles[v]--;
+        }
+        for(unsigned int c = 0; c < cache.size(); ++c)
+            if(find(newCache.begin(), newCache.begin() + 3, cache[c]) == newCache.begin() + 3)
+                newCache.push_back(cache[c]);
+
+        //Update the scores of everything in the old and new cache
+        for(unsigned int c = 0; c < newCache.size(); ++c)
+        {
+            int v = newCache[c];
+            cachePosition[v] = (c < OPTIMIZE_CACHE_SIZE ? (int)c : -1);
+            vertexScore[v] = forsythVertexScore(cachePosition[v], activeTriangles[v]);
+        }
+
+        //The next triangle is the best one that uses a cached vertex
+        bestTriangle = -1;
+        float bestScore = -1e30f;
+        for(unsigned int c = 0; c < newCache.size(); ++c)
+        {
+            int v = newCache[c];
+            for(int a = adjacencyStart[v]; a < adjacencyStart[v] + activeTriangles[v]; ++a)
+            {
+                int t = adjacency[a];
+                triangleScore[t] = vertexScore[indices[3*t]] + vertexScore[indices[3*t+1]] + vertexScore[indices[3*t+2]];
+                if(c < OPTIMIZE_CACHE_SIZE && triangleScore[t] > bestScore){ bestScore = triangleScore[t]; bestTriangle = t; }
+            }
+        }
+        if(newCache.size() > OPTIMIZE_CACHE_SIZE) newCache.resize(OPTIMIZE_CACHE_SIZE);
+        cache.swap(newCache);
+    }
+    indices.swap(output);
+}
+
+typedef struct
+{
+    unsigned int firstIndex;
+    unsigned int indexCount;
+    float sortKey;
+} TriangleCluster;
+
+bool clusterDrawnBefore(const TriangleCluster& a, const TriangleCluster& b)
+{
+    return a.sortKey > b.sortKey;
+}
+
+//Positions are 3 floats per vertex
+void optimizeOverdraw(vector<unsigned int>& indices, const vector<float>& positions)
+{
+    //Split where a triangle misses the cache with all its
+    //vertices: the cache restarts there, so sorting the
+    //clusters barely changes the cache efficiency
+    vector<TriangleCluster> clusters;
+    vector<unsigned int> cache;
+    for(unsigned int i = 0; i < indices.size(); i += 3)
+    {
+        int misses = 0;
+        for(int k = 0; k < 3; ++k)
+            if(find(cache.begin(), cache.end(), indices[i+k]) == cache.end()) ++misses;
+        if(misses == 3 || clusters.empty())
+        {
+            TriangleCluster cluster;
+            cluster.firstIndex = i;
+            cluster.indexCount = 0;
+            cluster.sortKey = 0.0f;
+            clusters.push_back(cluster);
+        }
+        clusters.back().indexCount += 3;
+        for(int k = 0; k < 3; ++k)
+        {
+            if(find(cache.begin(), cache.end(), indices[i+k]) != cache.end()) continue;
+            cache.push_back(indices[i+k]);
+            if(cache.size() > REPORT_CACHE_SIZE) cache.erase(cache.begin());
+        }
+    }
+    if(clusters.size() < 2) return;
+
+    float meshCenter[3] = {0.0f, 0.0f, 0.0f};
+    for(unsigned int i = 0; i < indices.size(); ++i)
+        for(int c = 0; c < 3; ++c) meshCenter[c] += positions[3*indices[i] + c] / indices.size();
+
+    //Clusters that face away from the center are most likely
+    //to occlude the others, so they are drawn first
+    for(unsigned int cl = 0; cl < clusters.size(); ++cl)
+    {
+        float center[3] = {0.0f, 0.0f, 0.0f};
+        float normal[3] = {0.0f, 0.0f, 0.0f};
+        for(unsigned int i = clusters[cl].firstIndex; i < clusters[cl].firstIndex + clusters[cl].indexCount; i += 3)
+        {
+            const float* p0 = &positions[3*indices[i]];
+            const float* p1 = &positions[3*indices[i+1]];
+            const float* p2 = &positions[3*indices[i+2]];
+            float e1[3] = {p1[0]-p0[0], p1[1]-p0[1], p1[2]-p0[2]};
+            float e2[3] = {p2[0]-p0[0], p2[1]-p0[1], p2[2]-p0[2]};
+            //Area weighted
+            normal[0] += e1[1]*e2[2] - e1[2]*e2[1];
+            normal[1] += e1[2]*e2[0] - e1[0]*e2[2];
+            normal[2] += e1[0]*e2[1] - e1[1]*e2[0];
+            for(int c = 0; c < 3; ++c) center[c] += (p0[c] + p1[c] + p2[c]) / clusters[cl].indexCount;
+        }
+        float length = sqrt(normal[0]*normal[0] + normal[1]*normal[1] + normal[2]*normal[2]);
+        if(length > 0.0f)
+            for(int c = 0; c < 3; ++c) clusters[cl].sortKey += (center[c] - meshCenter[c]) * normal[c] / length;
+    }
+
+    stable_sort(clusters.begin(), clusters.end(), clusterDrawnBefore);
+    vector<unsigned int> output;
+    output.reserve(indices.size());
+    for(unsigned int cl = 0; cl < clusters.size(); ++cl)
+        output.insert(output.end(), indices.begin() + clusters[cl].firstIndex,
+                indices.begin() + clusters[cl].firstIndex + clusters[cl].indexCount);
+    indices.swap(output);
+}
+
+//Renumbers the vertices in the order they are first used.
+//remap[new vertex] is the old vertex
+void optimizeVertexFetch(vector<unsigned int>& indices, int vertexCount, vector<int>& remap)
+{
+    vector<int> newIndex(vertexCount, -1);
+    remap.clear();
+    for(unsigned int i = 0; i < indices.size(); ++i)
+    {
+        if(newIndex[indices[i]] < 0)
+        {
+            newIndex[indices[i]] = remap.size();
+            remap.push_back(indices[i]);
+        }
+        indices[i] = newIndex[indices[i]];
+    }
+}
+
+//
+// Level of detail generation
+//
+//The levels are made by collapsing edges of the mesh, cheapest first,
+//with the quadric error metric (Garland and Heckbert). A vertex is only
+//collapsed onto one of its neighbours, so all levels use the vertices
+//of the full mesh and only need their own indices. Animated meshes keep
+//a quadric per frame, so a collapse has to fit every frame. Vertices on
+//texture seams and open borders are never moved, that would tear the mesh.
+
+#define LOD_LEVELS 3
+//Every level has at most this fraction of the triangles of the previous level
+#define LOD_REDUCTION 0.5f
+//Stop when a level would save less than this fraction of the previous level
+#define LOD_MIN_SAVING 0.1f
+
+//Symmetric 4x4 matrix: a2 ab ac ad b2 bc bd c2 cd d2,
+//summed over planes weighted by the triangle area
+typedef struct
+{
+    double q[10];
+    double area;
+} Quadric;
+
+void addPlaneQuadric(Quadric& quadric, const float* p0, const float* p1, const float* p2)
+{
+    double e1[3] = {p1[0]-p0[0], p1[1]-p0[1], p1[2]-p0[2]};
+    double e2[3] = {p2[0]-p0[0], p2[1]-p0[1], p2[2]-p0[2]};
+    double n[3] = {e1[1]*e2[2] - e1[2]*e2[1], e1[2]*e2[0] - e1[0]*e2[2], e1[0]*e2[1] - e1[1]*e2[0]};
+    double length = sqrt(n[0]*n[0] + n[1]*n[1] + n[2]*n[2]);
+    if(length <= 0.0) return;
+    //Weighted by the area of the triangle
+    double area = 0.5 * length;
+    double a = n[0] / length, b = n[1] / length, c = n[2] / length;
+    double d = -(a*p0[0] + b*p0[1] + c*p0[2]);
+    double plane[10] = {a*a, a*b, a*c, a*d, b*b, b*c, b*d, c*c, c*d, d*d};
+    for(int i = 0; i < 10; ++i) quadric.q[i] += area * plane[i];
+    quadric.area += area;
+}
+
+double quadricError(const Quadric& quadric, const float* p)
+{
+    const double* q = quadric.q;
+    double x = p[0], y = p[1], z = p[2];
+    return q[0]*x*x + 2.0*q[1]*x*y + 2.0*q[2]*x*z + 2.0*q[3]*x
+        + q[4]*y*y + 2.0*q[5]*y*z + 2.0*q[6]*y
+        + q[7]*z*z + 2.0*q[8]*z + q[9];
+}
+
+typedef struct
+{
+    double cost;
+    int from;
+    int to;
+    int fromVersion; //the collapse is outdated when a vertex changed since
+    int toVersion;
+} Collapse;
+
+bool collapseCheaper(const Collapse& a, const Collapse& b)
+{
+    return a.cost > b.cost; //for a min-heap
+}
+
+class MeshSimplifier
+{
+    public:
+        //positions: frameCount times vertexCount times 3 floats
+        MeshSimplifier(const vector<unsigned int>& indices, const float* positions, int vertexCount, int frameCount)
+            : positions(positions), vertexCount(vertexCount), frameCount(frameCount)
+        {
+            triangles = indices;
+            triangleAlive.assign(triangles.size() / 3, true);
+            aliveCount = triangles.size() / 3;
+            maxError = 0.0;
+            version.assign(vertexCount, 0);
+            vertexTriangles.resize(vertexCount);
+            for(unsigned int t = 0; t < triangles.size() / 3; ++t)
+                for(int k = 0; k < 3; ++k)
+                    vertexTriangles[triangles[3*t+k]].push_back(t);
+
+            //Edges that do not have exactly two triangles are
+            //on a border or a texture seam
+            locked.assign(vertexCount, false);
+            map<pair<int,int>, int> edgeUse;
+            for(unsigned int t = 0; t < triangles.size() / 3; ++t)
+            {
+                for(int k = 0; k < 3; ++k)
+                {
+                    int a = triangles[3*t+k], b = triangles[3*t+(k+1)%3];
+                    edgeUse[make_pair(min(a,b), max(a,b))]++;
+                }
+            }
+            for(map<pair<int,int>, int>::iterator iter = edgeUse.begin(); iter != edgeUse.end(); ++iter)
+            {
+                if(iter->second != 2)
+                {
+                    locked[iter->first.first] = true;
+                    locked[iter->first.second] = true;
+                }
+            }
+
+            quadrics.resize(vertexCount * frameCount);
+            for(unsigned int i = 0; i < quadrics.size(); ++i)
+            {
+                for(int j = 0; j < 10; ++j) quadrics[i].q[j] = 0.0;
+                quadrics[i].area = 0.0;
+            }
+            for(unsigned int t = 0; t < triangles.size() / 3; ++t)
+            {
+                for(int f = 0; f < frameCount; ++f)
+                {
+                    Quadric plane;
+                    for(int j = 0; j < 10; ++j) plane.q[j] = 0.0;
+                    plane.area = 0.0;
+                    addPlaneQuadric(plane, position(triangles[3*t], f), position(triangles[3*t+1], f), position(triangles[3*t+2], f));
+                    for(int k = 0; k < 3; ++k)
+                    {
+                        Quadric& quadric = quadrics[triangles[3*t+k] * frameCount + f];
+                        for(int j = 0; j < 10; ++j) quadric.q[j] += plane.q[j];
+                        quadric.area += plane.area;
+                    }
+                }
+            }
+
+            for(int v = 0; v < vertexCount; ++v) addCollapses(v);
+        }
+
+        //Collapses edges until at most targetCount triangles are left
+        //or nothing can be collapsed anymore
+        void simplify(int targetCount)
+        {
+            while(aliveCount > targetCount && !heap.empty())
+            {
+                pop_heap(heap.begin(), heap.end(), collapseCheaper);
+                Collapse collapse = heap.back();
+                heap.pop_back();
+                if(collapse.fromVersion != version[collapse.from] || collapse.toVersion != version[collapse.to]) continue;
+                if(!isValid(collapse.from, collapse.to)) continue;
+                apply(collapse);
+            }
+        }
+
+        int getTriangleCount() const { return aliveCount; }
+        //Estimate of the distance between the simplified and the full surface, in model units
+        float getError() const { return (float)sqrt(maxError); }
+
+        void getIndices(vector<unsigned int>& indices) const
+        {
+            indices.clear();
+            for(unsigned int t = 0; t < triangleAlive.size(); ++t)
+                if(triangleAlive[t])
+                    indices.insert(indices.end(), triangles.begin() + 3*t, triangles.begin() + 3*t + 3);
+        }
+
+    private:
+        const float* positions;
+        int vertexCount;
+        int frameCount;
+        vector<unsigned int> triangles;
+        vector<bool> triangleAlive;
+        int aliveCount;
+        vector<vector<int> > vertexTriangles;
+        vector<bool> locked;
+        vector<Quadric> quadrics; //vertexCount times frameCount
+        vector<int> version;
+        vector<Collapse> heap;
+        double maxError;
+
+        const float* position(int v, int frame) const { return positions + (frame * vertexCount + v) * 3; }
+
+        //Squared distance to the planes around both vertices when from
+        //moves onto to, averaged over the planes (by area) and the frames
+        double collapseCost(int from, int to) const
+        {
+            double cost = 0.0;
+            for(int f = 0; f < frameCount; ++f)
+            {
+                Quadric sum = quadrics[from * frameCount + f];
+                for(int j = 0; j < 10; ++j) sum.q[j] += quadrics[to * frameCount + f].q[j];
+                sum.area += quadrics[to * frameCount + f].area;
+                if(sum.area > 0.0) cost += quadricError(sum, position(to, f)) / sum.area;
+            }
+            cost /= frameCount;
+            return (cost > 0.0 ? cost : 0.0);
+        }
+
+        void addCollapses(int v)
+        {
+            if(locked[v]) return;
+            for(unsigned int i = 0; i < vertexTriangles[v].size(); ++i)
+            {
+                int t = vertexTriangles[v][i];
+                for(int k = 0; k < 3; ++k)
+                {
+                    int to = triangles[3*t+k];
+                    if(to == v) continue;
+                    Collapse collapse;
+                    collapse.cost = collapseCost(v, to);
+                    collapse.from = v;
+                    collapse.to = to;
+                    collapse.fromVersion = version[v];
+                    collapse.toVersion = version[to];
+                    heap.push_back(collapse);
+                    push_heap(heap.begin(), heap.end(), collapseCheaper);
+                }
+            }
+        }
+
+        //A collapse may not flip a triangle in the first frame
+        bool isValid(int from, int to) const
+        {
+            for(unsigned int i = 0; i < vertexTriangles[from].size(); ++i)
+            {
+                int t = vertexTriangles[from][i];
+                const unsigned int* tri = &triangles[3*t];
+                if(tri[0] == (unsigned int)to || tri[1] == (unsigned int)to || tri[2] == (unsigned int)to) continue;
+                const float* before[3];
+                const float* after[3];
+                for(int k = 0; k < 3; ++k)
+                {
+                    before[k] = position(tri[k], 0);
+                    after[k] = position(tri[k] == (unsigned int)from ? to : tri[k], 0);
+                }
+                float nb[3], na[3];
+                triangleNormal(before, nb);
+                triangleNormal(after, na);
+                if(na[0]*nb[0] + na[1]*nb[1] + na[2]*nb[2] <= 0.0f) return false;
+            }
+            return true;
+        }
+
+        static void triangleNormal(const float* const* p, float* n)
+        {
+            float e1[3] = {p[1][0]-p[0][0], p[1][1]-p[0][1], p[1][2]-p[0][2]};
+            float e2[3] = {p[2][0]-p[0][0], p[2][1]-p[0][1], p[2][2]-p[0][2]};
+            n[0] = e1[1]*e2[2] - e1[2]*e2[1];
+            n[1] = e1[2]*e2[0] - e1[0]*e2[2];
+            n[2] = e1[0]*e2[1] - e1[1]*e2[0];
+        }
+
+        void apply(const Collapse& collapse)
+        {
+            const int from = collapse.from;
+            const int to = collapse.to;
+            if(collapse.cost > maxError) maxError = collapse.cost;
+
+            for(unsigned int i = 0; i < vertexTriangles[from].size(); ++i)
+            {
+                int t = vertexTriangles[from][i];
+                unsigned int* tri = &triangles[3*t];
+                if(tri[0] == (unsigned int)to || tri[1] == (unsigned int)to || tri[2] == (unsigned int)to)
+                {
+                    //Degenerate, remove it from the other vertices
+                    triangleAlive[t] = false;
+                    aliveCount--;
+                    for(int k = 0; k < 3; ++k)
+                    {
+                        if(tri[k] == (unsigned int)from) continue;
+                        vector<int>& list = vertexTriangles[tri[k]];
+                        list.erase(find(list.begin(), list.end(), t));
+                    }
+                }
+                else
+                {
+                    for(int k = 0; k < 3; ++k)
+                        if(tri[k] == (unsigned int)from) tri[k] = to;
+                    vertexTriangles[to].push_back(t);
+                }
+            }
+            vertexTriangles[from].clear();
+
+            for(int f = 0; f < frameCount; ++f)
+            {
+                for(int j = 0; j < 10; ++j)
+                    quadrics[to * frameCount + f].q[j] += quadrics[from * frameCount + f].q[j];
+                quadrics[to * frameCount + f].area += quadrics[from * frameCount + f].area;
+            }
+
+            //Everything around the new vertex gets new costs
+            version[from]++;
+            version[to]++;
+            vector<int> neighbours;
+            for(unsigned int i = 0; i < vertexTriangles[to].size(); ++i)
+                for(int k = 0; k < 3; ++k)
+                    neighbours.push_back(triangles[3*vertexTriangles[to][i] + k]);
+            sort(neighbours.begin(), neighbours.end());
+            neighbours.erase(unique(neighbours.begin(), neighbours.end()), neighbours.end());
+            for(unsigned int i = 0; i < neighbours.size(); ++i)
+                if(neighbours[i] != to) version[neighbours[i]]++;
+            for(unsigned int i = 0; i < neighbours.size(); ++i)
+                addCollapses(neighbours[i]);
+        }
+};
+
+//A section of the output file, see ModelFormat.h
+typedef struct
+{
+    unsigned int type;
+    unsigned int count;
+    vector<char> data;
+} OutputSection;
+
+void addSection(vector<OutputSection>& sections, unsigned int type, const void* data, unsigned int size, unsigned int count)
+{
+    OutputSection section;
+    section.type = type;
+    section.count = count;
+    sections.push_back(section);
+    if(size) sections.back().data.assign((const char*)data, (const char*)data + size);
+}
+
+unsigned int alignSize(unsigned int size)
+{
+    return (size + MODEL_SECTION_ALIGNMENT - 1) & ~(MODEL_SECTION_ALIGNMENT - 1);
+}
+
+//Adds the name to the string section
+ModelFileName addName(vector<char>& strings, const string& name)
+{
+    ModelFileName result;
+    result.offset = strings.size();
+    result.length = name.length();
+    strings.insert(strings.end(), name.begin(), name.end());
+    strings.push_back(0);
+    return result;
+}
+
+//Lays out the header, the table of contents and the aligned sections
+//and fills in the sizes, offsets and checksums
+vector<char> buildModelFile(ModelFileHeader header, const vector<OutputSection>& sections)
+{
+    header.magic = MODEL_FILE_MAGIC;
+    header.version = MODEL_FILE_VERSION;
+    header.headerSize = sizeof(ModelFileHeader);
+    header.sectionCount = sections.size();
+    header.checksum = 0;
+    header.tocChecksum = 0;
+
+    vector<ModelFileSection> toc(sections.size());
+    unsigned int offset = alignSize(sizeof(ModelFileHeader) + sections.size() * sizeof(ModelFileSection));
+    for(unsigned int i = 0; i < sections.size(); ++i)
+    {
+        toc[i].type = sections[i].type;
+        toc[i].offset = offset;
+        toc[i].size = sections[i].data.size();
+        toc[i].count = sections[i].count;
+        offset = alignSize(offset + toc[i].size);
+    }
+    header.fileSize = offset;
+
+    vector<char> file(header.fileSize, 0);
+    memcpy(&file[0], &header, sizeof(header));
+    if(!toc.empty())
+        memcpy(&file[sizeof(header)], &toc[0], toc.size() * sizeof(ModelFileSection));
+    for(unsigned int i = 0; i < sections.size(); ++i)
+        if(toc[i].size) memcpy(&file[toc[i].offset], &sections[i].data[0], toc[i].size);
+
+    header.tocChecksum = modelFileChecksum(&file[0], sizeof(header) + toc.size() * sizeof(ModelFileSection));
+    header.checksum = modelFileChecksum(&file[0], header.fileSize);
+    memcpy(&file[0], &header, sizeof(header));
+    return file;
+}
+
 int main(int argc, char* argv[])
 {
     //
@@ -233,53 +839,40 @@ int main(int argc, char* argv[])
 
     bool animated = header->nFrames > 1 ? true : false;
 
-    //TODO: calculate needed size
-    //Just take a huge upper bound :D
-    char* outBuffer = new char[inputFilesize * 300];
-
-    char* pointer = outBuffer;
-
-    //Output data start
-    AryaHeader* outHeader = (AryaHeader*)pointer;
-
-    outHeader->magic = ARYAMAGICINT;
-    outHeader->modeltype = (animated ? 2 : 1);
-    outHeader->submeshCount = 1;
-    outHeader->materialCount = 1;
-    outHeader->frameCount = header->nFrames;
-
-    //Submesh info (only one submesh here)
-    outHeader->submesh[0].materialIndex = 0;
-    outHeader->submesh[0].primitiveType = GL_TRIANGLES;
-    outHeader->submesh[0].hasNormals = 1;
+    ModelFileHeader outHeader;
+    memset(&outHeader, 0, sizeof(outHeader));
+    outHeader.modelType = (animated ? 2 : 1);
+    outHeader.frameCount = header->nFrames;
 
-    pointer += sizeof(AryaHeader);
-    pointer += 1*sizeof(SubmeshInfo);
-    //end of submesh info
+    vector<OutputSection> sections;
+    vector<char> strings;
 
     //material list: only one material
-    int namelen = inputfilename.length() - 4; //remove the .md2
-    for(int i = 0; i < namelen; ++i) *pointer++ = inputfilename[i];
-    *pointer++ = 0; //zero terminated
-    cout << "Saving material " << (pointer - namelen - 1) << endl;
+    vector<ModelFileName> materials;
+    string materialName = inputfilename.substr(0, inputfilename.length() - 4); //remove the .md2
+    materials.push_back(addName(strings, materialName));
+    cout << "Saving material " << materialName << endl;
 
     //Animation info
     //The animation info does not come from the source file. It is static MD2 animation data
+    vector<ModelFileAnimation> animations;
+    vector<float> frameTimes;
     if( animated )
     {
         cout << "Model is animated. Storing animation info" << endl;
 
+        //name, startframe, endframe, (end-start) times the frame time
+        vector<string> names;
+        vector<int> firstFrames, lastFrames;
+        vector<float> fps;
+
         if(specialAnimations)
         {
-            int* animationCount = (int*)pointer; pointer += 4;
-
             char animName[17] = {0}; //buffer
 
             string animationName;
             int startFrame = 0, endFrame = 0;
 
-            *animationCount = 0;
-
             for(int fr = 0; fr < header->nFrames; ++fr)
             {
                 frame* inputFrame = (frame*)(inputData + header->oFrames + fr * header->frameSize);
@@ -308,18 +901,10 @@ int main(int argc, char* argv[])
                     if(!animationName.empty())
                     {
                         cout << "DEBUG: Saving animation: " << animationName << ". Frames " << startFrame << " - " << endFrame << endl;
-                        *animationCount += 1;
-                        //save name
-                        for(unsigned int j = 0; j < animationName.size(); ++j) *pointer++ = animationName[j];
-                        *pointer++ = 0; //0-terminate
-
-                        *(int*)pointer = startFrame; pointer += 4;
-                        *(int*)pointer = endFrame; pointer += 4;
-                        for(int j = 0; j <= endFrame - startFrame; ++j)
-                        {
-                            *(float*)pointer = 1.0f/9.0f;
-                            pointer += 4;
-                        }
+                        names.push_back(animationName);
+                        firstFrames.push_back(startFrame);
+                        lastFrames.push_back(endFrame);
+                        fps.push_back(9.0f);
                     }
                     //new animation
                     animationName = animName;
@@ -330,123 +915,218 @@ int main(int argc, char* argv[])
         }
         else
         {
-            *(int*)pointer = 21; pointer += 4; //21 animations
             for(int i = 0; i < 21; ++i)
             {
-                //name, startframe, endframe, (end-start) times the FPS
-                int len = strlen(MD2animationNameList[i]);
-                for(int j = 0; j < len; ++j) *pointer++ = MD2animationNameList[i][j];
-                *pointer++ = 0; //0 terminate
-
-                *(int*)pointer = MD2animationlist[i].firstFrame; pointer += 4;
-                *(int*)pointer = MD2animationlist[i].lastFrame; pointer += 4;
-                for(int j = 0; j <= MD2animationlist[i].lastFrame - MD2animationlist[i].firstFrame; ++j)
-                {
-                    *(float*)pointer = 1.0f/((float)MD2animationlist[i].fps);
-                    pointer += 4;
-                }
+                names.push_back(MD2animationNameList[i]);
+                firstFrames.push_back(MD2animationlist[i].firstFrame);
+                lastFrames.push_back(MD2animationlist[i].lastFrame);
+                fps.push_back((float)MD2animationlist[i].fps);
             }
         }
-    }
-    else
-    {
-        *(int*)pointer = 0; pointer += 4; //zero animations
+
+        for(unsigned int i = 0; i < names.size(); ++i)
+        {
+            ModelFileAnimation anim;
+            anim.name = addName(strings, names[i]);
+            anim.startFrame = firstFrames[i];
+            anim.endFrame = lastFrames[i];
+            anim.firstFrameTime = frameTimes.size();
+            for(int j = 0; j <= lastFrames[i] - firstFrames[i]; ++j)
+                frameTimes.push_back(1.0f / fps[i]);
+            animations.push_back(anim);
+        }
     }
     //End of animation info
 
-    //Now we will create a new index buffer
-
-    //for(int tri = 0; tri < header->nTriangles; ++tri)
-    //{
-    //    for(int m = 0; m < 3; ++m)
-    //    {
-    //        int index = triangleInput[tri].vert[m];
-    //        int texIndex = triangleInput[tri].tex[m];
-    //    }
-    //}
-	
-	float* boundingBoxPointer = (float*) pointer;
-	pointer+= 6*sizeof(float);
-
     //Vertex data
     cout << "Building vertex buffer" << endl;
 
-    //We want the vertex data 4-byte aligned
-    int offset = (int)(pointer - outBuffer);
-    offset = (offset + 3) & (~3);
-    pointer = outBuffer + offset;
-
-    outHeader->submesh[0].bufferOffset = offset; //set offset in header
-
     triangle* triangleInput = (triangle*)(inputData + header->oTriangles);
     texCoo* texCooInput = (texCoo*)(inputData + header->oTexCoo);
 
-    float* floatOutput = (float*)pointer;
-
     float maxX = -10000.0f, maxY = -10000.0f, maxZ = -10000.0f;
     float minX = 10000.0f, minY = 10000.0f, minZ = 10000.0f;
 
+    //Every corner of a triangle uses an MD2 vertex (the position and normal
+    //in every frame) and a texture coordinate. Corners that use the same
+    //pair are merged into one vertex and the triangles get an index buffer
+    vector<int> vertexSource; //MD2 vertex of every output vertex
+    vector<int> texSource; //texture coordinate of every output vertex
+    vector<unsigned int> indices;
+    map<pair<int,int>, unsigned int> vertexIds;
+    for(int tri = 0; tri < header->nTriangles; ++tri)
+    {
+        for(int m = 0; m < 3; ++m)
+        {
+            pair<int,int> corner(triangleInput[tri].vert[m], triangleInput[tri].tex[m]);
+            map<pair<int,int>, unsigned int>::iterator iter = vertexIds.find(corner);
+            if(iter == vertexIds.end())
+            {
+                iter = vertexIds.insert(make_pair(corner, (unsigned int)vertexSource.size())).first;
+                vertexSource.push_back(corner.first);
+                texSource.push_back(corner.second);
+            }
+            indices.push_back(iter->second);
+        }
+    }
+    int vertexCount = vertexSource.size(); //vertex count per frame
+
+    //The positions are stored relative to the bounding box of
+    //all frames, so that has to be calculated first
+    float* positions = new float[header->nFrames * vertexCount * 3];
+    float* positionOutput = positions;
     for(int fr = 0; fr < header->nFrames; ++fr)
     {
         frame* inputFrame = (frame*)(inputData + header->oFrames + fr * header->frameSize);
 
-        for(int tri = 0; tri < header->nTriangles; ++tri)
+        for(int v = 0; v < vertexCount; ++v)
         {
-            for(int m = 0; m < 3; ++m)
-            {
-                int index = triangleInput[tri].vert[m];
-                int texIndex = triangleInput[tri].tex[m];
-                int normIndex = inputFrame->verts[index].lightnormalindex;
-
-                float x = scaleFactor*(transX + (float)((inputFrame->verts[index].v[1] * inputFrame->scale[1]) + inputFrame->translate[1]));
-                float y = scaleFactor*(transY + (float)((inputFrame->verts[index].v[2] * inputFrame->scale[2]) + inputFrame->translate[2]));
-                float z = scaleFactor*(transZ - (float)((inputFrame->verts[index].v[0] * inputFrame->scale[0]) + inputFrame->translate[0]));
-                *floatOutput++ = x;
-                *floatOutput++ = y;
-                *floatOutput++ = z;
-
-                *floatOutput++ = (float)(texCooInput[texIndex].s) / ((float)header->textureWidth);
-                *floatOutput++ = (float)(texCooInput[texIndex].t) / ((float)header->textureHeight);
-
-                *floatOutput++ = (float)(anorms[normIndex][1]);
-                *floatOutput++ = (float)(anorms[normIndex][2]);
-                *floatOutput++ = (float)(anorms[normIndex][0]);
-
-                if(x>maxX) maxX = x;
-                else if(x<minX) minX = x;
-                if(y>maxY) maxY = y;
-                else if(y<minY) minY = y;
-                if(z>maxZ) maxZ = z;
-                else if(z<minZ) minZ = z;
-            }
+            int index = vertexSource[v];
+
+            float x = scaleFactor*(transX + (float)((inputFrame->verts[index].v[1] * inputFrame->scale[1]) + inputFrame->translate[1]));
+            float y = scaleFactor*(transY + (float)((inputFrame->verts[index].v[2] * inputFrame->scale[2]) + inputFrame->translate[2]));
+            float z = scaleFactor*(transZ - (float)((inputFrame->verts[index].v[0] * inputFrame->scale[0]) + inputFrame->translate[0]));
+            *positionOutput++ = x;
+            *positionOutput++ = y;
+            *positionOutput++ = z;
+
+            if(x>maxX) maxX = x;
+            if(x<minX) minX = x;
+            if(y>maxY) maxY = y;
+            if(y<minY) minY = y;
+            if(z>maxZ) maxZ = z;
+            if(z<minZ) minZ = z;
+        }
+    }
+
+    //Optimize the triangle and vertex order, the first frame is used for the overdraw order
+    float mergedMissRatio = averageCacheMissRatio(indices, REPORT_CACHE_SIZE);
+    optimizeVertexCache(indices, vertexCount);
+    optimizeOverdraw(indices, vector<float>(positions, positions + vertexCount * 3));
+    vector<int> remap;
+    optimizeVertexFetch(indices, vertexCount, remap);
+    float optimizedMissRatio = averageCacheMissRatio(indices, REPORT_CACHE_SIZE);
+
+    //Levels of detail, with the positions in the new vertex order
+    vector<float> orderedPositions(header->nFrames * vertexCount * 3);
+    for(int fr = 0; fr < header->nFrames; ++fr)
+        for(int v = 0; v < vertexCount; ++v)
+            for(int c = 0; c < 3; ++c)
+                orderedPositions[(fr * vertexCount + v) * 3 + c] = positions[(fr * vertexCount + remap[v]) * 3 + c];
+
+    vector<vector<unsigned int> > lodIndices;
+    vector<float> lodErrors;
+    MeshSimplifier simplifier(indices, &orderedPositions[0], vertexCount, header->nFrames);
+    int previousCount = indices.size() / 3;
+    for(int level = 1; level <= LOD_LEVELS; ++level)
+    {
+        simplifier.simplify((int)(previousCount * LOD_REDUCTION));
+        if(simplifier.getTriangleCount() > previousCount * (1.0f - LOD_MIN_SAVING)) break;
+        previousCount = simplifier.getTriangleCount();
+
+        lodIndices.push_back(vector<unsigned int>());
+        simplifier.getIndices(lodIndices.back());
+        optimizeVertexCache(lodIndices.back(), vertexCount);
+        lodErrors.push_back(simplifier.getError());
+        cout << "LOD " << level << ": " << previousCount << " triangles, error " << lodErrors.back()
+            << ", cache miss ratio " << averageCacheMissRatio(lodIndices.back(), REPORT_CACHE_SIZE) << endl;
+    }
+
+    cout << "Vertices per frame: " << header->nTriangles * 3 << " unindexed, " << vertexCount << " indexed" << endl;
+    cout << "Average cache miss ratio (" << REPORT_CACHE_SIZE << " entry FIFO): 3 unindexed, "
+        << mergedMissRatio << " indexed, " << optimizedMissRatio << " optimized" << endl;
+
+    //Compressed vertex format: texture coordinates once,
+    //then the quantized positions and normals for every frame
+    vector<char> vertexData(vertexCount * 2 * sizeof(float) + header->nFrames * vertexCount * 4 * sizeof(unsigned short));
+
+    //Texture coordinates are the same for every frame
+    float* floatOutput = (float*)&vertexData[0];
+    for(int v = 0; v < vertexCount; ++v)
+    {
+        int texIndex = texSource[remap[v]];
+        *floatOutput++ = (float)(texCooInput[texIndex].s) / ((float)header->textureWidth);
+        *floatOutput++ = (float)(texCooInput[texIndex].t) / ((float)header->textureHeight);
+    }
+
+    unsigned short* shortOutput = (unsigned short*)floatOutput;
+    for(int fr = 0; fr < header->nFrames; ++fr)
+    {
+        frame* inputFrame = (frame*)(inputData + header->oFrames + fr * header->frameSize);
+
+        for(int v = 0; v < vertexCount; ++v)
+        {
+            int index = vertexSource[remap[v]];
+            int normIndex = inputFrame->verts[index].lightnormalindex;
+            positionOutput = positions + (fr * vertexCount + remap[v]) * 3;
+
+            *shortOutput++ = quantize(*positionOutput++, minX, maxX);
+            *shortOutput++ = quantize(*positionOutput++, minY, maxY);
+            *shortOutput++ = quantize(*positionOutput++, minZ, maxZ);
+
+            octEncode(anorms[normIndex][1], anorms[normIndex][2], anorms[normIndex][0], (signed char*)shortOutput);
+            shortOutput++;
         }
     }
-	boundingBoxPointer[0] = minX;
-	boundingBoxPointer[1] = maxX;
-	boundingBoxPointer[2] = minY;
-	boundingBoxPointer[3] = maxY;
-	boundingBoxPointer[4] = minZ;
-	boundingBoxPointer[5] = maxZ;
+    delete[] positions;
 
-    int vertexCount = header->nTriangles * 3; //vertex count per frame
-    pointer += header->nFrames * vertexCount * 8 * sizeof(float);
+    outHeader.boundsMin[0] = minX;
+    outHeader.boundsMin[1] = minY;
+    outHeader.boundsMin[2] = minZ;
+    outHeader.boundsMax[0] = maxX;
+    outHeader.boundsMax[1] = maxY;
+    outHeader.boundsMax[2] = maxZ;
 
-    outHeader->submesh[0].vertexCount = vertexCount;
     //End of vertex data
     cout << "Vertex buffer done. " << header->nFrames << " frames with " << vertexCount << " vertices each written." << endl;
     cout << "min X, min Y, min Z : " << minX << "," << minY << "," << minZ << endl;
     cout << "max X, max Y, max Z : " << maxX << "," << maxY << "," << maxZ << endl;
 
-    //Index data
-    outHeader->submesh[0].indexCount = 0;
-    outHeader->submesh[0].indexbufferOffset = (int)(pointer - outBuffer); //set offset in header
-    //End of index data
+    //Submesh info (only one submesh here)
+    ModelFileSubmesh submesh;
+    memset(&submesh, 0, sizeof(submesh));
+    submesh.materialIndex = 0;
+    submesh.primitiveType = GL_TRIANGLES;
+    submesh.vertexCount = vertexCount;
+    submesh.vertexFormat = VERTEX_FORMAT_COMPRESSED;
+    submesh.indexCount = indices.size();
+
+    //The string section has to be complete before it is added
+    addSection(sections, MODEL_SECTION_STRINGS, &strings[0], strings.size(), strings.size());
+    addSection(sections, MODEL_SECTION_MATERIALS, &materials[0], materials.size() * sizeof(ModelFileName), materials.size());
+    if(!animations.empty())
+    {
+        addSection(sections, MODEL_SECTION_ANIMATIONS, &animations[0], animations.size() * sizeof(ModelFileAnimation), animations.size());
+        if(!frameTimes.empty())
+            addSection(sections, MODEL_SECTION_FRAME_TIMES, &frameTimes[0], frameTimes.size() * sizeof(float), frameTimes.size());
+    }
+    submesh.vertexSection = sections.size();
+    addSection(sections, MODEL_SECTION_VERTICES, &vertexData[0], vertexData.size(), vertexData.size());
+    submesh.indexSection = sections.size();
+    addSection(sections, MODEL_SECTION_INDICES, &indices[0], indices.size() * sizeof(unsigned int), indices.size());
+    addSection(sections, MODEL_SECTION_SUBMESHES, &submesh, sizeof(submesh), 1);
+
+    //The simplified levels share the vertex data
+    vector<ModelFileLOD> lods;
+    for(unsigned int l = 0; l < lodIndices.size(); ++l)
+    {
+        ModelFileLOD lod;
+        lod.submesh = 0;
+        lod.indexSection = sections.size();
+        lod.error = lodErrors[l];
+        lod.padding = 0;
+        lods.push_back(lod);
+        addSection(sections, MODEL_SECTION_INDICES, &lodIndices[l][0], lodIndices[l].size() * sizeof(unsigned int), lodIndices[l].size());
+    }
+    if(!lods.empty())
+        addSection(sections, MODEL_SECTION_LODS, &lods[0], lods.size() * sizeof(ModelFileLOD), lods.size());
 
-    int totalFileSize = (int)(pointer - outBuffer);
-    outputfile.write(outBuffer, totalFileSize);
+    vector<char> outputData = buildModelFile(outHeader, sections);
+    outputfile.write(&outputData[0], outputData.size());
     outputfile.close();
+    cout << "Written " << outputData.size() << " bytes in " << sections.size() << " sections" << endl;
 
-    delete[] outBuffer;
+    delete[] inputData;
 
     return 0;
 }